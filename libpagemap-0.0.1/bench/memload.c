@@ -0,0 +1,197 @@
+// memload - workload generator with controlled memory layouts for pgbench
+// Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+//
+//     This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE   14
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT    21
+#endif
+
+#define MB              (1UL << 20)
+#define HUGE_SIZE       (2*MB)
+#define SPARSE_STRIDE   64      // every n-th page of reservation is touched
+
+#define HELP_STR "memload - creates processes with given memory layout and waits for signal\n"\
+                 "Usage: memload [-a MB] [-f MB] [-v N] [-r MB] [-t MB] [-s MB] [-n procs]\n"\
+                 "\t -a MB :private anonymous memory\n"\
+                 "\t -f MB :shared mapping of temporary file\n"\
+                 "\t -v N :number of small (one page) separate VMAs\n"\
+                 "\t -r MB :sparse reservation, every 64th page is touched\n"\
+                 "\t -t MB :anonymous memory advised for transparent huge pages\n"\
+                 "\t -s MB :anonymous memory paged out to swap (needs swap)\n"\
+                 "\t -n procs :number of processes, children share memory copy-on-write\n"\
+                 "Prints pids of processes to stdout when memory is ready.\n"
+
+static unsigned long a_mb, f_mb, r_mb, t_mb, s_mb, n_vmas;
+static int n_procs = 1;
+
+static void fill(char * p, unsigned long len, unsigned long stride)
+{
+    long pagesize = getpagesize();
+
+    for (unsigned long off = 0; off < len; off += stride*pagesize)
+        p[off] = (char) (off/pagesize) | 1;
+}
+
+static void * map_anon(unsigned long len)
+{
+    void * p;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static void build_layout(void)
+{
+    long pagesize = getpagesize();
+    char name[] = "/tmp/memloadXXXXXX";
+    char * p;
+    int fd;
+
+    if (a_mb)
+        fill(map_anon(a_mb*MB), a_mb*MB, 1);
+    if (f_mb) {
+        fd = mkstemp(name);
+        if (fd < 0 || ftruncate(fd, f_mb*MB) != 0) {
+            perror("file");
+            exit(1);
+        }
+        unlink(name);
+        p = mmap(NULL, f_mb*MB, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        fill(p, f_mb*MB, 1);
+        close(fd);
+    }
+    // alternating protections keep neighbouring VMAs from merging
+    for (unsigned long i = 0; i < n_vmas; i++) {
+        p = map_anon(pagesize);
+        p[0] = 1;
+        mprotect(p, pagesize, i % 2 ? PROT_READ : PROT_READ | PROT_WRITE);
+    }
+    if (r_mb) {
+        p = mmap(NULL, r_mb*MB, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        fill(p, r_mb*MB, SPARSE_STRIDE);
+    }
+    if (t_mb) {
+        // align to huge page boundary
+        p = map_anon(t_mb*MB + HUGE_SIZE);
+        p = (char *) (((unsigned long) p + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1));
+        if (madvise(p, t_mb*MB, MADV_HUGEPAGE) != 0)
+            perror("madvise(MADV_HUGEPAGE)");
+        fill(p, t_mb*MB, 1);
+    }
+    if (s_mb) {
+        p = map_anon(s_mb*MB);
+        fill(p, s_mb*MB, 1);
+        if (madvise(p, s_mb*MB, MADV_PAGEOUT) != 0)
+            perror("madvise(MADV_PAGEOUT)");
+    }
+}
+
+static void on_signal(int sig)
+{
+    (void) sig;
+}
+
+int main(int argc, char * argv[])
+{
+    pid_t * pids;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ha:f:v:r:t:s:n:")) != -1) {
+        switch (opt) {
+            case 'a':
+                a_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                f_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                n_vmas = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                r_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                t_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                s_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                n_procs = atoi(optarg);
+                if (n_procs < 1)
+                    n_procs = 1;
+                break;
+            default:
+                printf("%s", HELP_STR);
+                return 1;
+        }
+    }
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    build_layout();
+    pids = calloc(n_procs, sizeof(pid_t));
+    if (!pids)
+        return 1;
+    pids[0] = getpid();
+    for (int i = 1; i < n_procs; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            pause();
+            _exit(0);
+        }
+        if (pids[i] < 0) {
+            perror("fork");
+            n_procs = i;
+            break;
+        }
+    }
+    for (int i = 0; i < n_procs; i++)
+        printf("%d\n", pids[i]);
+    printf("ready\n");
+    fflush(stdout);
+    pause();
+    for (int i = 1; i < n_procs; i++) {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+    free(pids);
+    return 0;
+}
@@ -0,0 +1,332 @@
+// pgbench - measures scan phases of libpagemap against stored baseline
+// Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+//
+//     This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "libpagemap.h"
+
+#define BUFFSIZE        512
+#define MAX_ROUNDS      100
+
+#define HELP_STR "pgbench - measures libpagemap scan phases, compares them with baseline\n"\
+                 "Usage: pgbench [-r rounds] [-b file] [-W] [-T pct] [-R file] [-B] [-i] [workload [args...]]\n"\
+                 "\t -r rounds :number of measured rounds, median is taken (default 5)\n"\
+                 "\t -b file :baseline file\n"\
+                 "\t -W :writes results as new baseline instead of comparing\n"\
+                 "\t -T pct :slowdown in percent reported as regression (default 10)\n"\
+                 "\t -R file :scans recording of pgmap --record instead of this system\n"\
+                 "\t -B :batched process walk (PAGEMAP_BATCH)\n"\
+                 "\t -i :one table for all rounds with incremental physical walk (PAGEMAP_INCR)\n"\
+                 "\t workload :command started before measuring (e.g. bench/memload -a 1024),\n"\
+                 "\t\t  it has to print \"ready\" line and wait for SIGTERM\n"\
+                 "SYSCALLS are read and write syscalls from /proc/self/io.\n"\
+                 "Exit status is 2 when some phase regressed.\n"
+
+enum { PHASE_TABLE, PHASE_PROCS, PHASE_PHYS, PHASES };
+
+static pgmap_io * replay; // backend of -R, NULL = system
+static int batch;         // -B
+static int incr;          // -i
+static pagemap_tbl * kept; // table of the previous round with -i
+
+static const char * phase_names[PHASES] = {"table_build", "proc_walk", "phys_walk"};
+
+// one measurement of phase
+typedef struct sample_t {
+    uint64_t wall_us;
+    uint64_t pages;     // page entries handled by phase
+    uint64_t syscalls;  // read and write syscalls
+    int ok;
+} sample_t;
+
+typedef struct baseline_t {
+    uint64_t wall_us;
+    uint64_t pages;
+    uint64_t syscalls;
+    int valid;
+} baseline_t;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+// syscalls - read and write syscalls issued by this process so far
+static uint64_t syscalls(void)
+{
+    char line[BUFFSIZE];
+    unsigned long long n, sum = 0;
+    FILE * f;
+
+    f = fopen("/proc/self/io", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "syscr: %llu", &n) == 1 || sscanf(line, "syscw: %llu", &n) == 1)
+            sum += n;
+    }
+    fclose(f);
+    return sum;
+}
+
+// start_workload - runs command and waits for its "ready" line
+static pid_t start_workload(char ** argv)
+{
+    char line[BUFFSIZE];
+    int fds[2];
+    pid_t pid;
+    FILE * out;
+
+    if (pipe(fds) != 0)
+        return -1;
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    out = fdopen(fds[0], "r");
+    while (out && fgets(line, sizeof(line), out)) {
+        if (!strcmp(line, "ready\n")) {
+            fclose(out);
+            return pid;
+        }
+    }
+    if (out)
+        fclose(out);
+    else
+        close(fds[0]);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// run_round - measures all phases once on fresh table
+static void run_round(sample_t * s)
+{
+    pagemap_tbl * table;
+    process_pagemap_t ** procs;
+    unsigned long shared, free_pg, nonshared;
+    int size;
+    uint64_t t, sc;
+
+    memset(s, 0, PHASES*sizeof(sample_t));
+    sc = syscalls();
+    t = now_us();
+    table = kept ? init_pgmap_table(kept) : init_pgmap_table_io(NULL, replay);
+    kept = NULL;
+    s[PHASE_TABLE].wall_us = now_us() - t;
+    s[PHASE_TABLE].syscalls = syscalls() - sc;
+    if (!table)
+        return;
+    s[PHASE_TABLE].ok = 1;
+    set_pgmap_flags(table, (batch ? PAGEMAP_BATCH : 0) | (incr ? PAGEMAP_INCR : 0));
+
+    sc = syscalls();
+    t = now_us();
+    if (open_pgmap_table(table, 0)) {
+        s[PHASE_PROCS].wall_us = now_us() - t;
+        s[PHASE_PROCS].syscalls = syscalls() - sc;
+        s[PHASE_PROCS].ok = 1;
+        procs = get_all_pgmap(table, &size);
+        for (int i = 0; procs && i < size; i++)
+            s[PHASE_PROCS].pages += procs[i]->res + procs[i]->swap;
+        free(procs);
+    }
+
+    sc = syscalls();
+    t = now_us();
+    if (get_physical_pgmap(table, &shared, &free_pg, &nonshared) == 0) {
+        s[PHASE_PHYS].wall_us = now_us() - t;
+        s[PHASE_PHYS].syscalls = syscalls() - sc;
+        s[PHASE_PHYS].pages = shared + free_pg + nonshared;
+        s[PHASE_PHYS].ok = 1;
+    }
+    if (incr)
+        kept = table;
+    else
+        free_pgmap_table(table);
+}
+
+static int cmp_samples(const void * a, const void * b)
+{
+    const sample_t * x = a, * y = b;
+
+    return (x->wall_us > y->wall_us) - (x->wall_us < y->wall_us);
+}
+
+static void read_baseline(const char * path, baseline_t * base)
+{
+    char line[BUFFSIZE], name[BUFFSIZE];
+    unsigned long long wall, pages, sc;
+    FILE * f;
+
+    memset(base, 0, PHASES*sizeof(baseline_t));
+    f = fopen(path, "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%511s %llu %llu %llu", name, &wall, &pages, &sc) != 4)
+            continue;
+        for (int p = 0; p < PHASES; p++) {
+            if (strcmp(name, phase_names[p]))
+                continue;
+            base[p].wall_us = wall;
+            base[p].pages = pages;
+            base[p].syscalls = sc;
+            base[p].valid = 1;
+        }
+    }
+    fclose(f);
+}
+
+static int write_baseline(const char * path, sample_t * med)
+{
+    FILE * f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    fprintf(f, "# pgbench baseline: phase wall_us pages syscalls\n");
+    for (int p = 0; p < PHASES; p++) {
+        if (med[p].ok)
+            fprintf(f, "%s %llu %llu %llu\n", phase_names[p], (unsigned long long) med[p].wall_us,
+                    (unsigned long long) med[p].pages, (unsigned long long) med[p].syscalls);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    static sample_t samples[PHASES][MAX_ROUNDS];
+    sample_t round[PHASES], med[PHASES];
+    baseline_t base[PHASES];
+    char * base_path = NULL;
+    int rounds = 5, write = 0, regressed = 0, opt;
+    double tolerance = 10.0, change;
+    pid_t workload = 0;
+
+    while ((opt = getopt(argc, argv, "+hr:b:WT:R:Bi")) != -1) {
+        switch (opt) {
+            case 'r':
+                rounds = atoi(optarg);
+                if (rounds < 1 || rounds > MAX_ROUNDS)
+                    rounds = 5;
+                break;
+            case 'b':
+                base_path = optarg;
+                break;
+            case 'W':
+                write = 1;
+                break;
+            case 'T':
+                tolerance = atof(optarg);
+                break;
+            case 'R':
+                replay = open_pgmap_replay(optarg);
+                if (!replay) {
+                    fprintf(stderr, "Cannot open recording %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                batch = 1;
+                break;
+            case 'i':
+                incr = 1;
+                break;
+            default:
+                printf("%s", HELP_STR);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        workload = start_workload(argv + optind);
+        if (workload < 0) {
+            fprintf(stderr, "Workload %s did not start\n", argv[optind]);
+            return 1;
+        }
+    }
+    // warm up dentry and page caches
+    run_round(round);
+    for (int r = 0; r < rounds; r++) {
+        run_round(round);
+        for (int p = 0; p < PHASES; p++)
+            samples[p][r] = round[p];
+    }
+    if (workload > 0) {
+        kill(workload, SIGTERM);
+        waitpid(workload, NULL, 0);
+    }
+    free_pgmap_table(kept);
+    close_pgmap_io(replay);
+    for (int p = 0; p < PHASES; p++) {
+        qsort(samples[p], rounds, sizeof(sample_t), cmp_samples);
+        med[p] = samples[p][rounds/2];
+        for (int r = 0; r < rounds; r++)
+            med[p].ok &= samples[p][r].ok;
+    }
+    if (write)
+        return base_path ? write_baseline(base_path, med) : 1;
+    read_baseline(base_path ? base_path : "", base);
+
+    printf("PHASE       WALL(ms)    PAGES/s     SYSCALLS    BASE(ms)    CHANGE\n");
+    for (int p = 0; p < PHASES; p++) {
+        if (!med[p].ok) {
+            printf("%-12sn/a\n", phase_names[p]);
+            continue;
+        }
+        printf("%-12s%-12.2f", phase_names[p], med[p].wall_us/1000.0);
+        if (med[p].pages && med[p].wall_us)
+            printf("%-12.0f", med[p].pages*1e6/med[p].wall_us);
+        else
+            printf("%-12s", "-");
+        printf("%-12llu", (unsigned long long) med[p].syscalls);
+        if (!base[p].valid || !base[p].wall_us) {
+            printf("-\n");
+            continue;
+        }
+        change = 100.0*((double) med[p].wall_us - base[p].wall_us)/base[p].wall_us;
+        printf("%-12.2f%+.1f%%", base[p].wall_us/1000.0, change);
+        if (change > tolerance) {
+            printf(" REGRESSION");
+            regressed = 1;
+        }
+        printf("\n");
+    }
+    return regressed ? 2 : 0;
+}
@@ -16,7 +16,7 @@
 //
 // Author: Petr Holasek , pholasek@redhat.com
 
-#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,15 +28,19 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <dirent.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include "libpagemap.h"
 
-#define PERM_WRITE      0x0100
-#define PERM_READ       0x0200
-#define PERM_EXEC       0x0400
-#define PERM_SHARE      0x0800
-#define PERM_PRIV       0x1000
-
 #define PAGEMAP_COUNTS  0x0001  // non-kpageflags stuff
 #define PAGEMAP_IO      0x0002  // IO stats
 #define PAGEMAP_VARIOUS 0x0004  // various stats
@@ -44,6 +48,29 @@
 #define PAGEMAP_ROOT    0x0010  // without this internal flag we can count only res and swap
                                 // it is set if getuid() == 0
 #define BUFSIZE         512
+#define PM_CHUNK        4096    // number of pagemap entries read by one pread()
+#define IO_TEXT         4096    // initial buffer of /proc text file
+#define PROC_DENTS      32768   // bytes of /proc entries read by one getdents64()
+#define IDLE_RUN        512     // max number of 64-bit bitmap words per one idle I/O
+#define KPAGE_BLOCK     65536   // number of kpageflags/kpagecount entries read at once
+#define KPAGE_CACHE     16      // kpageflags/kpagecount entries read by one page lookup
+#define PAGES_THREADS   8       // max number of threads of get_pages_pgmap() and get_frag_pgmap()
+#define FRAG_BUDDY_MAX  1024    // pages of the largest buddy block (MAX_ORDER-1 = 10), divides KPAGE_BLOCK
+#define INCR_BLOCK      4096    // pfns of one block summary of PAGEMAP_INCR, divides KPAGE_BLOCK
+#define RING_DEPTH      64      // reads in flight of PAGEMAP_BATCH io_uring
+#define RING_SETS       4       // sets of reads started and not fully queued
+#define RING_DRAIN_TRIES 1000  // failed waits (1 ms apart) for reads of aborted ring
+#define BATCH_ENTRIES   65536   // pagemap entries of one PAGEMAP_BATCH window
+#define BATCH_READS     256     // max pagemap reads of one window
+#define KPAGE_RUN       4096    // max kpagecount/kpageflags entries of one batched read
+#define KPAGE_GAP       64      // unneeded entries read to join two runs
+#define PSI_PERIOD      100000000ULL    // ns between memory pressure checks of throttled walk
+#define PSI_BACKOFF     100000000ULL    // first pause of backoff, doubled up to PSI_BACKOFF_MAX
+#define PSI_BACKOFF_MAX 1600000000ULL
+#define PSI_WAIT_MAX    10000000000ULL  // max backoff per check, walk goes on after it
+#define KSM_CHUNK       256     // max number of pages read from /proc/[pid]/mem at once
+#define RMAP_RADIX_BITS 11      // digit width of reverse map radix sort
+#define RMAP_RADIX      (1 << RMAP_RADIX_BITS)
 #define OK              0
 #define ERROR           1
 #define RD_ERROR        2
@@ -69,33 +96,185 @@
 
 #define PM_PRESENT          PM_STATUS(4LL)
 #define PM_SWAP             PM_STATUS(2LL)
+#define PM_FILE             PM_STATUS(1LL)  // page cache or shared anonymous memory
+#define PM_SOFT_DIRTY       (1LL << 55)
+#define PM_MMAP_EXCLUSIVE   (1LL << 56)
+
+/*
+ * Couple of bits from
+ * include/uapi/linux/kernel-page-flags.h
+ */
+#define KPF_LOCKED          0
+#define KPF_LRU             5
+#define KPF_SLAB            7
+#define KPF_BUDDY           10
+#define KPF_COMPOUND_HEAD   15
+#define KPF_COMPOUND_TAIL   16
+#define KPF_HUGE            17
+#define KPF_UNEVICTABLE     18
+#define KPF_NOPAGE          20
+#define KPF_THP             22
+#define KPF_RESERVED        32
+#define KPF_MLOCKED         33
+
+#define CLEAR_SOFT_DIRTY    "4"     // clear_refs command for soft-dirty bits
+
+#define IDLE_BITMAP     "/sys/kernel/mm/page_idle/bitmap"
+#define KPAGECOUNT      "/proc/kpagecount"
+#define KPAGEFLAGS      "/proc/kpageflags"
 
 #define DEBUG 1
 #undef DEBUG
 
 /////// NON-USER STRUCTURES //////////////
-typedef struct proc_mapping {
-    unsigned long start, end, offset;
-    unsigned long * pfns;
-    int perms;
-    struct proc_mapping * next;
-} proc_mapping;
-
 typedef struct pagemap_list {
     process_pagemap_t pid_table; // must be 1st in structure, because of
                                  // dependency of iterating functions
     int exists; // used for marking existing pids in pagemap table
+    unsigned long contig[PGMAP_ORDERS]; // runs of physically contiguous pages by log2 length
     struct pagemap_list * next;
 } pagemap_list;
 
+// aligned block of kpagecount or kpageflags around last looked up pfn
+typedef struct kpage_cache {
+    uint64_t first;         // pfn of buf[0]
+    long n;                 // valid entries, 0 = empty
+    uint64_t buf[KPAGE_CACHE];
+} kpage_cache;
+
+// summaries of blocks of INCR_BLOCK pfns from previous physical walk
+typedef struct incr_t {
+    uint64_t * hash;        // of raw entries of every block, 0 = no summary
+    uint16_t * sums;        // stride counters of every block
+    unsigned long n_blocks; // blocks with place for summary
+    unsigned long seen;     // blocks reached by current walk, size of next one
+    unsigned int stride;
+    uint64_t key;           // summaries are valid for walks with the same key
+} incr_t;
+
 typedef struct kpagemap_t {
-    int kpgm_count_fd;
+    int kpgm_count_fd;      // handles of table's I/O backend
     int kpgm_flags_fd;
     int under_root;
+    int idle_fd;            // page_idle bitmap, opened on first use
     unsigned int pagesize;
     uint64_t phys_p_count;
+    uint64_t * pm_buf;      // PM_CHUNK entries of pagemap read buffer
+    kpage_cache count_cache;
+    kpage_cache flags_cache;
+    struct io_ring * ring;  // of PAGEMAP_BATCH, opened on first use
+    int no_ring;            // io_uring is not available
+    int ring_leak;          // aborted io_uring may still write into batch buffers
+    incr_t * incr_phys;     // of walk_phys_mem(), only with PAGEMAP_INCR
+    incr_t * incr_pages;    // of walk_pages_mem()
 } kpagemap_t;
 
+// state of set_pgmap_throttle()
+typedef struct throttle_t {
+    pgmap_throttle_t lim;
+    uint64_t cpu0;          // thread CPU time at start of scan
+    uint64_t wall0;         // start of scan
+    uint64_t proc0;         // start of walk of current process
+    uint64_t proc_bytes;    // pagemap bytes read from it since proc0
+    uint64_t psi_next;      // time of next pressure check
+    char psi_path[BUFSIZE]; // memory.pressure of its cgroup, "" = none
+} throttle_t;
+
+// copy of pgmap_filter_t of set_pgmap_filter()
+typedef struct filter_t {
+    int uid;                // -1 = any
+    char * cgroup;
+    size_t cgroup_len;
+    int pidns;
+    dev_t ns_dev;           // PID namespace of pidns
+    ino_t ns_ino;
+    int * pids;             // sorted, NULL = any
+    int n_pids;
+} filter_t;
+
+typedef struct rmap_t {
+    pgmap_rmap_entry * items;   // sorted by pfn after walk_procs()
+    unsigned long count;
+    unsigned long size;
+    uint64_t max_pfn;
+} rmap_t;
+
+struct pgmap_snap {
+    void * base;
+    size_t len;
+    pgmap_snap_hdr * hdr;
+};
+
+// publisher side of shared memory segment
+typedef struct shm_pub_t {
+    char * name;
+    int fd;
+    void * base;
+    size_t len;
+} shm_pub_t;
+
+// two generations of table, cur is the readable one
+struct pgmap_rcu {
+    pagemap_tbl * tables[2];
+    int refs[2];            // readers of tables
+    int cur;
+    unsigned long gen;      // number of refreshes, 0 = nothing to read
+    int flags;              // of tables, for tables recreated after failure
+};
+
+// reader side, hdr is copy of pinned snapshot header so torn data can not
+// move reads out of segment
+struct pgmap_shm {
+    int fd;
+    void * base;
+    size_t len;
+    int slot;               // pinned slot, -1 if none
+    uint64_t seq;           // its seq at pin time
+    unsigned long row;      // next row of iterate_pgmap_shm()
+    pgmap_snap_hdr hdr;
+    pgmap_snap snap;        // view of pinned slot
+};
+
+// open pagemap of one process with its read buffer, see open_pgmap_view()
+struct pgmap_view {
+    int fd;
+    unsigned int pagesize;
+    uint64_t * buf;         // PM_CHUNK entries
+};
+
+// offsets of PGMAP_COUNTERS items in process_pagemap_t
+#define PGMAP_COL_OFFSET(item) offsetof(process_pagemap_t, item),
+static const size_t col_offsets[PGMAP_COLS] = { PGMAP_COUNTERS(PGMAP_COL_OFFSET) };
+
+#define PGMAP_COL_NAME(item) #item,
+static const char * col_names[PGMAP_COLS] = { PGMAP_COUNTERS(PGMAP_COL_NAME) };
+
+#define COL_VALUE(p_t,col) (*(unsigned int *) ((char *) (p_t) + col_offsets[col]))
+#define SNAP_ALIGN(x)   (((x) + 7) & ~7ULL)
+
+#define RING_REC_MAX    (2*10 + PGMAP_COLS*5)  // longest encoded sample
+
+// history of one process, oldest sample is kept whole in base and others
+// as delta records in ring buffer data
+typedef struct ring_proc {
+    int pid;
+    uint64_t start;                 // starttime of process
+    uint64_t base_time;             // time of oldest sample
+    uint32_t base[PGMAP_COLS];      // values of oldest sample
+    uint64_t last_time;             // time of newest sample
+    uint32_t last[PGMAP_COLS];      // values of newest sample
+    unsigned int head;              // position of oldest record in data
+    unsigned int used;              // used bytes of data
+    unsigned int samples;           // number of samples including base
+    unsigned char * data;
+} ring_proc;
+
+struct pgmap_ring {
+    ring_proc * procs;              // sorted by pid
+    unsigned long count;
+    unsigned int size;              // bytes of data of every process
+};
+
 ///////// FUNCTIONS ///////////////////////////////
 #ifdef DEBUG
 #define trace(string) fprintf(stderr, "%s\n", string);
@@ -103,44 +282,651 @@ typedef struct kpagemap_t {
 #define trace(string) ((void)0)
 #endif
 
-static int open_kpagemap(kpagemap_t * kpagemap) {
-    FILE * f = NULL;
-    char buffer[BUFSIZE];
-    uint64_t ramsize;
+// counters of scan running in this thread, NULL when they are disabled
+static __thread pgmap_stats_t * cur_stats;
+
+#define STAT_ADD(item,n) do { if (cur_stats) cur_stats->item += (n); } while (0)
+
+static inline uint64_t stat_clock(void) {
+    struct timespec ts;
+
+    if (!cur_stats)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stat_phase(int phase, uint64_t start) {
+    if (cur_stats)
+        cur_stats->phase_ns[phase] += stat_clock() - start;
+}
+
+// scan_begin - must be called by public functions which read /proc
+static inline void scan_begin(pagemap_tbl * table) {
+    cur_stats = (table->flags & PAGEMAP_STATS) ? table->stats : NULL;
+    table->kpagemap->count_cache.n = 0;
+    table->kpagemap->flags_cache.n = 0;
+}
+
+static inline int scan_end(int ret) {
+    cur_stats = NULL;
+    return ret;
+}
+
+/////////// I/O backend ////////////////////////////
+struct pgmap_io {
+    const pgmap_io_ops * ops;
+    void * ctx;
+    long pagesize;          // 0 = of this system
+    int live;               // backend reads this system, direct /proc access allowed
+};
+
+// wrappers count syscalls of backend as if it was the system one
+static inline int io_open(pgmap_io * io, const char * path) {
+    STAT_ADD(syscalls,1);
+    return io->ops->open(io->ctx, path);
+}
+
+static inline long io_pread(pgmap_io * io, int h, void * buf, unsigned long len, uint64_t off) {
+    long got;
+
+    got = io->ops->pread(io->ctx, h, buf, len, off);
+    STAT_ADD(syscalls,1);
+    if (got > 0)
+        STAT_ADD(bytes_read,got);
+    return got;
+}
+
+static inline void io_close(pgmap_io * io, int h) {
+    STAT_ADD(syscalls,1);
+    io->ops->close(io->ctx, h);
+}
+
+// io_read_all - whole text file in malloc'ed buffer terminated by '\0'
+static char * io_read_all(pgmap_io * io, const char * path, size_t * len) {
+    size_t size = IO_TEXT, done = 0;
+    char * buf, * tmp;
+    long got = 0;
+    int h;
+
+    h = io_open(io, path);
+    if (h < 0)
+        return NULL;
+    buf = malloc(size);
+    while (buf && (got = io_pread(io, h, buf + done, size - done - 1, done)) > 0) {
+        done += got;
+        if (size - done > 1)
+            continue;
+        size *= 2;
+        tmp = realloc(buf, size);
+        if (!tmp)
+            free(buf);
+        buf = tmp;
+    }
+    io_close(io, h);
+    if (!buf || got < 0) {
+        free(buf);
+        return NULL;
+    }
+    buf[done] = '\0';
+    if (len)
+        *len = done;
+    return buf;
+}
+
+// system backend, handles are file descriptors
+static int sys_open(void * ctx, const char * path) {
+    return open(path, O_RDONLY);
+}
+
+static long sys_pread(void * ctx, int h, void * buf, unsigned long len, uint64_t off) {
+    return pread64(h, buf, len, off);
+}
+
+static void sys_close(void * ctx, int h) {
+    close(h);
+}
+
+// parse_pid - pid of /proc entry name or 0, digits are checked at once
+static inline int parse_pid(const char * name) {
+    unsigned int pid = 0, bad = 0, d;
+
+    for (int i = 0; name[i]; i++) {
+        d = (unsigned char) name[i] - '0';
+        bad |= d > 9;
+        pid = pid*10 + d;
+    }
+    return bad || pid > 0x7fffffff ? 0 : (int) pid;
+}
+
+// sys_pids - all pids of /proc read by large getdents64() batches, processes
+// which cannot be scanned are dropped when their maps are read
+static int sys_pids(void * ctx, int ** pids) {
+    char buf[PROC_DENTS] __attribute__((aligned(8)));
+    struct dirent64 * ent;
+    long got, pos;
+    int * tmp;
+    int fd, n = 0, size = 0, pid;
+
+    fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    STAT_ADD(syscalls,1);
+    if (fd < 0)
+        return -1;
+    *pids = NULL;
+    while ((got = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        STAT_ADD(syscalls,1);
+        for (pos = 0; pos < got; pos += ent->d_reclen) {
+            ent = (struct dirent64 *) (buf + pos);
+            if (ent->d_type != DT_DIR || !(pid = parse_pid(ent->d_name)))
+                continue;
+            if (n == size) {
+                size = size ? 2*size : 256;
+                tmp = realloc(*pids, size*sizeof(int));
+                if (!tmp) {
+                    free(*pids);
+                    close(fd);
+                    return -1;
+                }
+                *pids = tmp;
+            }
+            (*pids)[n++] = pid;
+        }
+    }
+    STAT_ADD(syscalls,2);
+    close(fd);
+    if (got < 0) {
+        free(*pids);
+        return -1;
+    }
+    return n;
+}
+
+static const pgmap_io_ops sys_ops = { sys_open, sys_pread, sys_close, sys_pids, NULL };
+static pgmap_io sys_io = { &sys_ops, NULL, 0, 1 };
+
+// grow_array - makes room for one more item of array
+static int grow_array(void ** array, unsigned long * size, unsigned long count, size_t item) {
+    void * tmp;
+
+    if (count < *size)
+        return OK;
+    tmp = realloc(*array, (*size ? 2*(*size) : 64)*item);
+    if (!tmp)
+        return ERROR;
+    *array = tmp;
+    *size = *size ? 2*(*size) : 64;
+    return OK;
+}
+
+// io_read_full - pread() until len bytes or end of file, interrupted
+// reads are repeated
+static long io_read_full(pgmap_io * io, int h, void * buf, unsigned long len, uint64_t off) {
+    long got;
+    unsigned long done = 0;
+
+    while (done < len) {
+        got = io_pread(io, h, (char *) buf + done, len - done, off + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return done ? (long) done : -1;
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+/////////// batched reads ////////////////////////////
+// read of io_set, res is number of read bytes or -errno
+typedef struct io_req {
+    int h;
+    void * buf;
+    unsigned long len;
+    uint64_t off;
+    long res;
+    struct io_set * set;
+} io_req;
+
+// reads started and waited for together
+typedef struct io_set {
+    io_req * reqs;
+    unsigned long n;
+    unsigned long queued;   // handed to ring
+    unsigned long done;
+} io_set;
+
+#ifdef HAVE_IO_URING
+// io_uring without liburing, only IORING_OP_READ is used
+struct io_ring {
+    int fd;
+    unsigned int depth;             // max reads in flight
+    unsigned int inflight;          // queued into SQ and not reaped
+    unsigned int * sq_head, * sq_tail, * sq_mask, * sq_array;
+    unsigned int * cq_head, * cq_tail, * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_map, * cq_map;
+    size_t sq_len, cq_len, sqes_len;
+    io_set * sets[RING_SETS];       // sets with reads not queued yet, oldest first
+    int n_sets;
+};
+
+static void ring_close(struct io_ring * r) {
+    if (!r)
+        return;
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_map)
+        munmap(r->cq_map, r->cq_len);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+    free(r);
+}
+
+static void * ring_map(int fd, size_t len, off_t off) {
+    void * p;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static struct io_ring * ring_open(void) {
+    struct io_uring_params p;
+    struct io_ring * r;
+
+    r = calloc(1, sizeof(struct io_ring));
+    if (!r)
+        return NULL;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_DEPTH, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->depth = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sq_map = ring_map(r->fd, r->sq_len, IORING_OFF_SQ_RING);
+    r->cq_map = ring_map(r->fd, r->cq_len, IORING_OFF_CQ_RING);
+    r->sqes = ring_map(r->fd, r->sqes_len, IORING_OFF_SQES);
+    if (!r->sq_map || !r->cq_map || !r->sqes) {
+        ring_close(r);
+        return NULL;
+    }
+    r->sq_head = (unsigned int *) ((char *) r->sq_map + p.sq_off.head);
+    r->sq_tail = (unsigned int *) ((char *) r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned int *) ((char *) r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *) ((char *) r->sq_map + p.sq_off.array);
+    r->cq_head = (unsigned int *) ((char *) r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned int *) ((char *) r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned int *) ((char *) r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_map + p.cq_off.cqes);
+    return r;
+}
+
+// ring_fill - queues reads of waiting sets while there is room, CQ has
+// twice the entries of SQ so it cannot overflow
+static unsigned int ring_fill(struct io_ring * r) {
+    unsigned int tail = *r->sq_tail, queued = 0, slot;
+    struct io_uring_sqe * sqe;
+    io_set * set;
+    io_req * req;
+
+    while (r->n_sets && r->inflight < r->depth) {
+        set = r->sets[0];
+        req = &set->reqs[set->queued++];
+        slot = tail & *r->sq_mask;
+        sqe = &r->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = req->h;
+        sqe->addr = (uint64_t) (uintptr_t) req->buf;
+        sqe->len = req->len;
+        sqe->off = req->off;
+        sqe->user_data = (uint64_t) (uintptr_t) req;
+        r->sq_array[slot] = slot;
+        tail++;
+        queued++;
+        r->inflight++;
+        if (set->queued == set->n) {
+            r->n_sets--;
+            memmove(r->sets, r->sets + 1, r->n_sets*sizeof(io_set *));
+        }
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    return queued;
+}
+
+// ring_pending - SQEs not consumed by kernel yet, also those left by
+// short submission
+static inline unsigned int ring_pending(struct io_ring * r) {
+    return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int ring_enter(struct io_ring * r, unsigned int submit, unsigned int wait) {
+    long ret;
+
+    do {
+        STAT_ADD(syscalls,1);
+        ret = syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+    return ret < 0 ? ERROR : OK;
+}
+
+static void ring_reap(struct io_ring * r) {
+    unsigned int head = *r->cq_head, tail;
+    struct io_uring_cqe * cqe;
+    io_req * req;
+
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        req = (io_req *) (uintptr_t) cqe->user_data;
+        req->res = cqe->res;
+        if (cqe->res > 0)
+            STAT_ADD(bytes_read,cqe->res);
+        req->set->done++;
+        r->inflight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// ring_start - ERROR when set was not taken, nothing is queued then;
+// RD_ERROR when ring failed and has to be dropped by ring_abort()
+static int ring_start(struct io_ring * r, io_set * set) {
+    if (r->n_sets == RING_SETS)
+        return ERROR;
+    if (!set->n)
+        return OK;
+    r->sets[r->n_sets++] = set;
+    ring_fill(r);
+    return ring_enter(r, ring_pending(r), 0) == OK ? OK : RD_ERROR;
+}
+
+static int ring_wait(struct io_ring * r, io_set * set) {
+    while (set->done < set->n) {
+        ring_fill(r);
+        if (ring_enter(r, ring_pending(r), 1) != OK)
+            return RD_ERROR;
+        ring_reap(r);
+    }
+    return OK;
+}
+
+// ring_abort - waits for reads submitted to kernel and closes ring, so no
+// late completion can write into reused buffers; reads which were not
+// submitted stay with res -1 and io_finish() does them synchronously;
+// RD_ERROR when some reads did not complete and their buffers must not
+// be reused
+static int ring_abort(struct io_ring * r) {
+    struct timespec ts = {0, 1000000};
+    int tries = 0, ret;
+
+    r->n_sets = 0;
+    // SQEs kernel did not consume never reach it once ring is closed,
+    // completions are posted to CQ even when waiting in kernel fails
+    while (r->inflight > ring_pending(r) && tries < RING_DRAIN_TRIES) {
+        if (ring_enter(r, 0, 1) != OK) {
+            tries++;
+            nanosleep(&ts, NULL);
+        }
+        ring_reap(r);
+    }
+    ret = r->inflight > ring_pending(r) ? RD_ERROR : OK;
+    ring_close(r);
+    return ret;
+}
+#else
+struct io_ring;
+
+static inline void ring_close(struct io_ring * r) {
+}
+
+static inline int ring_start(struct io_ring * r, io_set * set) {
+    return ERROR;
+}
+
+static inline int ring_wait(struct io_ring * r, io_set * set) {
+    return ERROR;
+}
+
+static inline int ring_abort(struct io_ring * r) {
+    return OK;
+}
+#endif
+
+// batch_ring - io_uring of table with PAGEMAP_BATCH, NULL = synchronous reads
+static struct io_ring * batch_ring(pagemap_tbl * table) {
+#ifdef HAVE_IO_URING
+    kpagemap_t * kpagemap = table->kpagemap;
+
+    // other backends need their pread() called
+    if (!(table->flags & PAGEMAP_BATCH) || table->io != &sys_io)
+        return NULL;
+    if (!kpagemap->ring && !kpagemap->no_ring) {
+        kpagemap->ring = ring_open();
+        kpagemap->no_ring = !kpagemap->ring;
+    }
+    return kpagemap->ring;
+#else
+    return NULL;
+#endif
+}
+
+// batch_abort - drops failed io_uring of table, following reads are synchronous
+static void batch_abort(pagemap_tbl * table) {
+    trace("io_uring failed");
+    if (ring_abort(table->kpagemap->ring) != OK) {
+        trace("io_uring reads in flight, batch buffers are left to them");
+        table->kpagemap->ring_leak = 1;
+    }
+    table->kpagemap->ring = NULL;
+    table->kpagemap->no_ring = 1;
+}
+
+// io_start - starts reads of set, they are done right away without io_uring
+static void io_start(pagemap_tbl * table, io_set * set, io_req * reqs, unsigned long n) {
+    struct io_ring * ring = batch_ring(table);
+    int ret;
+
+    set->reqs = reqs;
+    set->n = n;
+    set->queued = 0;
+    set->done = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        reqs[i].set = set;
+        reqs[i].res = -1;
+    }
+    ret = ring ? ring_start(ring, set) : ERROR;
+    if (ret == OK)
+        return;
+    if (ret == RD_ERROR)
+        batch_abort(table);
+    set->queued = set->done = n;
+    // walk drops its buffers and starts again
+    if (table->kpagemap->ring_leak)
+        return;
+    for (unsigned long i = 0; i < n; i++) {
+        if (reqs[i].res < 0)
+            reqs[i].res = io_read_full(table->io, reqs[i].h, reqs[i].buf, reqs[i].len, reqs[i].off);
+    }
+}
+
+// io_finish - waits for reads of set, short and failed ones of io_uring
+// are finished synchronously
+static void io_finish(pagemap_tbl * table, io_set * set) {
+    struct io_ring * ring = table->kpagemap->ring;
+    io_req * req;
+    long got;
+
+    // reads of set left in aborted ring have res -1
+    if (ring && set->done < set->n && ring_wait(ring, set) != OK)
+        batch_abort(table);
+    if (table->kpagemap->ring_leak)
+        return;
+    for (unsigned long i = 0; i < set->n; i++) {
+        req = &set->reqs[i];
+        if (req->res < 0)
+            req->res = io_read_full(table->io, req->h, req->buf, req->len, req->off);
+        else if (req->res > 0 && (unsigned long) req->res < req->len) {
+            got = io_read_full(table->io, req->h, (char *) req->buf + req->res,
+                    req->len - req->res, req->off + req->res);
+            if (got > 0)
+                req->res += got;
+        }
+    }
+}
+
+/////////// incremental physical walks ////////////////////////////
+static void incr_free(incr_t * incr) {
+    if (!incr)
+        return;
+    free(incr->hash);
+    free(incr->sums);
+    free(incr);
+}
+
+// incr_prepare - summaries for walk of table with stride counters per block,
+// they are dropped when key changes; NULL without PAGEMAP_INCR or memory
+static incr_t * incr_prepare(pagemap_tbl * table, incr_t ** incr, unsigned int stride, uint64_t key) {
+    incr_t * c = *incr;
+    uint64_t * hash;
+    uint16_t * sums;
+
+    if (c && (!(table->flags & PAGEMAP_INCR) || c->stride != stride || c->key != key)) {
+        incr_free(c);
+        *incr = c = NULL;
+    }
+    if (!(table->flags & PAGEMAP_INCR))
+        return NULL;
+    if (!c) {
+        c = calloc(1, sizeof(incr_t));
+        if (!c)
+            return NULL;
+        c->stride = stride;
+        c->key = key;
+        c->seen = table->kpagemap->phys_p_count/INCR_BLOCK + 1;
+        *incr = c;
+    }
+    // physical memory grew since the last walk
+    if (c->seen > c->n_blocks) {
+        hash = realloc(c->hash, c->seen*sizeof(uint64_t));
+        if (hash)
+            c->hash = hash;
+        sums = realloc(c->sums, c->seen*stride*sizeof(uint16_t));
+        if (sums)
+            c->sums = sums;
+        if (!hash || !sums) {
+            incr_free(c);
+            *incr = NULL;
+            return NULL;
+        }
+        memset(c->hash + c->n_blocks, 0, (c->seen - c->n_blocks)*sizeof(uint64_t));
+        c->n_blocks = c->seen;
+    }
+    c->seen = 0;
+    return c;
+}
+
+// block_hash - hash of raw entries in four lanes, never 0 so that 0 means
+// no summary; every lane step is a bijection, so one changed entry always
+// changes the hash
+static uint64_t block_hash(const uint64_t * a, long n, uint64_t h) {
+    uint64_t l[4] = {h, h ^ 1, h ^ 2, h ^ 3};
+    long i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        for (int j = 0; j < 4; j++)
+            l[j] = (((l[j] << 23) | (l[j] >> 41)) ^ a[i + j])*0x9e3779b97f4a7c15ULL;
+    }
+    for (; i < n; i++)
+        l[0] = (((l[0] << 23) | (l[0] >> 41)) ^ a[i])*0x9e3779b97f4a7c15ULL;
+    h = l[0] ^ ((l[1] << 16) | (l[1] >> 48)) ^ ((l[2] << 32) | (l[2] >> 32)) ^ ((l[3] << 48) | (l[3] >> 16));
+    return h ? h : 1;
+}
+
+// incr_lookup - summary of block of walk with hash, NULL if it changed
+static inline uint16_t * incr_lookup(incr_t * incr, unsigned long block, uint64_t hash) {
+    unsigned long seen = __atomic_load_n(&incr->seen, __ATOMIC_RELAXED);
+
+    // threads take blocks out of order
+    while (seen <= block && !__atomic_compare_exchange_n(&incr->seen, &seen, block + 1,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if (block >= incr->n_blocks || incr->hash[block] != hash)
+        return NULL;
+    STAT_ADD(reused_blocks,1);
+    return incr->sums + block*incr->stride;
+}
+
+// incr_store - keeps counters of changed block, they fit into 16 bits
+static inline void incr_store(incr_t * incr, unsigned long block, uint64_t hash, const unsigned long * sums) {
+    if (block >= incr->n_blocks)
+        return;
+    for (unsigned int i = 0; i < incr->stride; i++)
+        incr->sums[block*incr->stride + i] = sums[i];
+    incr->hash[block] = hash;
+}
+
+static void close_kpagemap(kpagemap_t * kpagemap, pgmap_io * io) {
+    if (kpagemap->kpgm_count_fd >= 0)
+        io_close(io, kpagemap->kpgm_count_fd);
+    if (kpagemap->kpgm_flags_fd >= 0)
+        io_close(io, kpagemap->kpgm_flags_fd);
+    if (kpagemap->idle_fd >= 0)
+        close(kpagemap->idle_fd);
+    ring_close(kpagemap->ring);
+    incr_free(kpagemap->incr_phys);
+    incr_free(kpagemap->incr_pages);
+    free(kpagemap->pm_buf);
+}
+
+static int open_kpagemap(kpagemap_t * kpagemap, pgmap_io * io) {
+    char * meminfo, * total;
+    uint64_t ramsize = 0;
 
-    kpagemap->kpgm_count_fd = open("/proc/kpagecount",O_RDONLY);
+    kpagemap->kpgm_flags_fd = -1;
+    kpagemap->idle_fd = -1;
+    kpagemap->count_cache.n = 0;
+    kpagemap->flags_cache.n = 0;
+    kpagemap->ring = NULL;
+    kpagemap->no_ring = 0;
+    kpagemap->incr_phys = NULL;
+    kpagemap->incr_pages = NULL;
+    kpagemap->pm_buf = malloc(PM_CHUNK*PM_ENTRY_BYTES);
+    if (!kpagemap->pm_buf)
+        return ERROR;
+    kpagemap->kpgm_count_fd = io_open(io, KPAGECOUNT);
     if (kpagemap->kpgm_count_fd < 0) {
         kpagemap->under_root = 0;
         goto pagesize;
     }
-    kpagemap->kpgm_flags_fd = open("/proc/kpageflags",O_RDONLY);
+    kpagemap->kpgm_flags_fd = io_open(io, KPAGEFLAGS);
     if (kpagemap->kpgm_flags_fd < 0) {
         kpagemap->under_root = 0;
         goto pagesize;
     }
     kpagemap->under_root = 1;
 pagesize:
-    kpagemap->pagesize = sysconf(_SC_PAGESIZE);
+    kpagemap->pagesize = io->pagesize ? io->pagesize : sysconf(_SC_PAGESIZE);
     if (kpagemap->pagesize < 1)
         goto kpagemap_err;
 
     // how to determine amount of physmemory ?
     // 1. parse from /proc/meminfo
     // 2. another posibility = size of /proc/kcore
-    f = fopen("/proc/meminfo","r");
-    if (!f)
+    meminfo = io_read_all(io, "/proc/meminfo", NULL);
+    if (!meminfo)
+        goto kpagemap_err;
+    total = strstr(meminfo,"MemTotal");
+    if (!total || sscanf(total,"MemTotal: %lu kB",&ramsize) < 1) {
+        free(meminfo);
         goto kpagemap_err;
-    while(fgets(buffer,BUFSIZE,f)) {
-        if (strstr(buffer,"MemTotal")) {
-            if (sscanf(buffer,"MemTotal: %lu kB",&ramsize) < 1) {
-                fclose(f);
-                goto kpagemap_err;
-            } else {
-                break;
-            }
-        }
     }
-    fclose(f);
+    free(meminfo);
     if (ramsize == 0)
         goto kpagemap_err;
     if (kpagemap->pagesize >> 10 == 0) 
@@ -148,16 +934,10 @@ pagesize:
     kpagemap->phys_p_count = ramsize/(kpagemap->pagesize >> 10);
     return OK;
 kpagemap_err:
-    close(kpagemap->kpgm_flags_fd);
-    close(kpagemap->kpgm_count_fd);
+    close_kpagemap(kpagemap, io);
     return ERROR;
 }
 
-static void close_kpagemap(kpagemap_t * kpagemap) {
-    close(kpagemap->kpgm_count_fd);
-    close(kpagemap->kpgm_flags_fd);
-}
-
 /////////// list handlers ////////////////////////////
 static pagemap_list * pid_iter(pagemap_tbl * table) {
     pagemap_list * tmp;
@@ -212,6 +992,7 @@ static pagemap_list * add_pid(int n_pid, pagemap_tbl * table) {
         table->start = malloc(sizeof(pagemap_list));
         if (!table->start)
             return NULL;
+        memset(table->start, '\0', sizeof(pagemap_list));
         table->start->pid_table.pid = n_pid;
         table->start->exists = 1;
         table->start->next = NULL;
@@ -228,8 +1009,8 @@ static pagemap_list * add_pid(int n_pid, pagemap_tbl * table) {
             if (!curr->next)
                 return NULL;
             curr = curr->next;
+            memset(curr, '\0', sizeof(pagemap_list));
             curr->pid_table.pid = n_pid;
-            curr->pid_table.mappings = NULL;
             curr->exists = 1;
             curr->next = NULL;
             return curr;
@@ -245,6 +1026,8 @@ static void free_mappings(pagemap_list * tmp) {
     proc_mapping * next;
     while (tmp->pid_table.mappings) {
         next = tmp->pid_table.mappings->next;
+        free(tmp->pid_table.mappings->pfns);
+        free(tmp->pid_table.mappings->path);
         free(tmp->pid_table.mappings);
         tmp->pid_table.mappings = next;
     }
@@ -263,7 +1046,7 @@ static pagemap_list * delete_pid(int n_pid, pagemap_tbl * table) {
         free(curr);
         return table->start;
     }
-    while (!curr->next) {
+    while (curr->next) {
         if (curr->next->pid_table.pid == n_pid) {
             guilty = curr->next;
             curr->next = curr->next->next;
@@ -277,73 +1060,105 @@ static pagemap_list * delete_pid(int n_pid, pagemap_tbl * table) {
 }
 
 ////////////////////////////////////////////////////////////////
-static int read_cmd(process_pagemap_t * p_t) {
-    FILE * cmdline_file;
+static int read_cmd(pgmap_io * io, process_pagemap_t * p_t) {
     char path[sizeof("/proc/%d/status") + sizeof(int)*3];
-    char name[SMALLBUF];
-    char * name_start;
+    char * status;
+    char * name_start, * end;
 
     sprintf(path,"/proc/%d/status",p_t->pid);
-    cmdline_file = fopen(path,"r");
-    if (!cmdline_file)
-        return RD_ERROR;
-    if (!(fgets(name, SMALLBUF-1, cmdline_file))) {
-        fclose(cmdline_file);
+    status = io_read_all(io, path, NULL);
+    if (!status)
         return RD_ERROR;
-    }
-    name_start = strchr(name,':');
+    name_start = strchr(status,':');
     if (!name_start) {
-        fclose(cmdline_file);
+        free(status);
         return RD_ERROR;
     }
     name_start++;
     while (isspace(*name_start) && *name_start != '\n')
         name_start++;
-    strcpy(p_t->cmdline,name_start);
-    fclose(cmdline_file);
+    // only first line, with its newline
+    end = strchr(name_start,'\n');
+    if (end)
+        end[1] = '\0';
+    snprintf(p_t->cmdline,SMALLBUF-1,"%s",name_start);
+    free(status);
     return OK;
 }
 
+// start time is 22nd item of /proc/[pid]/stat, (pid, starttime) identifies process
+static int read_start(pgmap_io * io, process_pagemap_t * p_t) {
+    char path[sizeof("/proc/%d/stat") + sizeof(int)*3];
+    char * line;
+    char * p;
+    int ret = OK;
+
+    sprintf(path,"/proc/%d/stat",p_t->pid);
+    line = io_read_all(io, path, NULL);
+    if (!line)
+        return RD_ERROR;
+    // comm may contain spaces and brackets
+    p = strrchr(line,')');
+    if (!p || sscanf(p + 1," %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                &p_t->starttime) != 1)
+        ret = RD_ERROR;
+    free(line);
+    return ret;
+}
+
 static pagemap_tbl * fill_cmdlines(pagemap_tbl * table) {
     pagemap_list * tmp;
+    uint64_t start = stat_clock();
 
     reset_pos(table);
     while ((tmp = pid_iter(table))) {
-        if (read_cmd(&(tmp->pid_table)) != OK)
+        if (read_cmd(table->io, &(tmp->pid_table)) != OK)
             trace("read_cmd() error");
+        if (read_start(table->io, &(tmp->pid_table)) != OK)
+            trace("read_start() error");
     }
+    stat_phase(PGMAP_PHASE_CMDLINES, start);
     return table;
 }
 
-static int read_maps(process_pagemap_t * p_t) {
-    FILE * maps_fd;
+static int read_maps(pgmap_io * io, process_pagemap_t * p_t) {
     char path[BUFSIZE];
-    char line[BUFSIZE];
+    char * maps, * line, * next;
     char permiss[6];
+    int name_pos;
     proc_mapping * new, * p;
 
     snprintf(path,BUFSIZE,"/proc/%d/maps",p_t->pid);
-    maps_fd = fopen(path,"r");
-    if (!maps_fd) {
-        trace("error maps open ");
-        return RD_ERROR;
-    }
-    while (fgets(line,BUFSIZE,maps_fd)) {
+    maps = io_read_all(io, path, NULL);
+    if (!maps)
+        return RD_ERROR;    // errno is checked by fill_mappings()
+    for (line = maps; *line; line = next) {
+        next = strchr(line,'\n');
+        if (next)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
         new = malloc(sizeof(*new));
         if (!new) {
-            fclose(maps_fd);
+            free(maps);
             return ERROR;
         }
         memset(new, '\0', sizeof(*new));
-        sscanf(line,"%lx-%lx %5s %lx %*s %*d %*s",
+        name_pos = 0;
+        sscanf(line,"%lx-%lx %5s %lx %*s %lu %n",
                 &new->start,
                 &new->end,
                 permiss,
-                &new->offset);
+                &new->offset,
+                &new->inode,
+                &name_pos);
         if (!new->start || !new->end) {
-            fclose(maps_fd);
+            free(new);
+            free(maps);
             return ERROR;
         }
+        if (name_pos > 0 && line[name_pos] != '\0')
+            new->path = strdup(line + name_pos);
         if (strchr(permiss,'r'))
             new->perms |= PERM_READ;
         if (strchr(permiss,'w'))
@@ -364,18 +1179,34 @@ static int read_maps(process_pagemap_t * p_t) {
             p->next = new;
         }
     }
-    fclose(maps_fd);
+    free(maps);
     return OK;
 }
 
 static pagemap_tbl * fill_mappings(pagemap_tbl * table) {
-    pagemap_list * tmp;
+    pagemap_list * tmp, * next;
+    uint64_t start = stat_clock();
+    int ret, err, pid;
 
-    reset_pos(table);
-    while ((tmp = pid_iter(table))) {
-        if (read_maps(&(tmp->pid_table)) != OK)
-            trace("read_maps() error");
+    for (tmp = table->start; tmp; tmp = next) {
+        next = tmp->next;
+        ret = read_maps(table->io, &(tmp->pid_table));
+        err = errno;
+        if (ret == OK)
+            continue;
+        trace("read_maps() error");
+        if (ret != RD_ERROR)
+            continue;
+        // processes of other users and exited ones are dropped here,
+        // walk_procdir() does not probe them
+        if (err != EACCES && err != EPERM)
+            STAT_ADD(vanished,1);
+        pid = tmp->pid_table.pid;
+        delete_pid(pid, table);
+        table->size -= 1;
     }
+    reset_pos(table);
+    stat_phase(PGMAP_PHASE_MAPS, start);
     return table;
 }
 
@@ -393,23 +1224,21 @@ static inline void invalidate_pids(pagemap_tbl * table) {
 
     if (!table || !(table->start))
         return;
-    curr = table->start;
-    while (curr->next) {
+    for (curr = table->start; curr; curr = curr->next)
         curr->exists = 0;
-        curr = curr->next;
-    }
 }
 
 static inline void polish_table(pagemap_tbl * table) {
-    pagemap_list * curr;
+    pagemap_list * curr, * next;
 
     if (!table || !(table->start))
         return;
     curr = table->start;
-    while (curr->next) {
+    while (curr) {
+        next = curr->next;
         if (!curr->exists)
             delete_pid(curr->pid_table.pid, table);
-        curr = curr->next;
+        curr = next;
     }
     clean_mappings(table);
 }
@@ -441,46 +1270,211 @@ static inline void set_flags(process_pagemap_t * p_t, uint64_t datanum) {
     p_t->n_recycle += BIT_SET(datanum,9);
 }
 
-static inline int get_kpageflags(pagemap_tbl * table, uint64_t page, uint64_t * target)
+static long read_kpage_block(pgmap_io * io, int h, uint64_t * buf, uint64_t pfn, unsigned long count);
+
+// kpage_lookup - entries of one aligned block are read at once, because
+// neighbouring pages of processes are often physically contiguous
+static inline int kpage_lookup(kpage_cache * cache, pgmap_io * io, int h, uint64_t pfn, uint64_t * target)
 {
-    // kpageflags
-    if (lseek64(table->kpagemap->kpgm_flags_fd, page*8, SEEK_SET) == (off64_t) -1) {
-        return RD_ERROR;
+    uint64_t start;
+
+    STAT_ADD(pfn_lookups,1);
+    if (cache->n && pfn - cache->first < (uint64_t) cache->n) {
+        STAT_ADD(cache_hits,1);
+        *target = cache->buf[pfn - cache->first];
+        return OK;
     }
-    if (read(table->kpagemap->kpgm_flags_fd, target, 8) != 8) {
+    start = stat_clock();
+    cache->first = pfn & ~(uint64_t) (KPAGE_CACHE - 1);
+    cache->n = read_kpage_block(io, h, cache->buf, cache->first, KPAGE_CACHE);
+    stat_phase(PGMAP_PHASE_KPAGE, start);
+    if (cache->n <= (long) (pfn - cache->first)) {
+        cache->n = 0;
         return RD_ERROR;
     }
+    *target = cache->buf[pfn - cache->first];
     return OK;
 }
 
+static inline int get_kpageflags(pagemap_tbl * table, uint64_t page, uint64_t * target)
+{
+    return kpage_lookup(&table->kpagemap->flags_cache, table->io, table->kpagemap->kpgm_flags_fd, page, target);
+}
+
 static inline int get_kpagecount(pagemap_tbl * table, uint64_t page, uint64_t * target)
 {
-    // kpagecount's
-    if (lseek64(table->kpagemap->kpgm_count_fd, page*8, SEEK_SET) == (off64_t) -1) {
-        return RD_ERROR;
+    return kpage_lookup(&table->kpagemap->count_cache, table->io, table->kpagemap->kpgm_count_fd, page, target);
+}
+
+static int add_pfn(proc_mapping * map, unsigned long pfn) {
+    unsigned long * tmp;
+    unsigned long size;
+
+    if (map->n_pfns == map->pfns_size) {
+        size = map->pfns_size ? map->pfns_size*2 : 64;
+        tmp = realloc(map->pfns, size*sizeof(unsigned long));
+        if (!tmp)
+            return ERROR;
+        map->pfns = tmp;
+        map->pfns_size = size;
     }
-    if (read(table->kpagemap->kpgm_count_fd, target, 8) != 8) {
-        return RD_ERROR;
+    map->pfns[map->n_pfns++] = pfn;
+    return OK;
+}
+
+/////////// reverse map ////////////////////////////
+static int add_rmap(rmap_t * rmap, uint64_t pfn, unsigned long vaddr, int pid) {
+    pgmap_rmap_entry * tmp;
+    unsigned long size;
+
+    if (rmap->count == rmap->size) {
+        size = rmap->size ? rmap->size*2 : 4096;
+        tmp = realloc(rmap->items, size*sizeof(pgmap_rmap_entry));
+        if (!tmp)
+            return ERROR;
+        rmap->items = tmp;
+        rmap->size = size;
     }
+    rmap->items[rmap->count].pfn = pfn;
+    rmap->items[rmap->count].vaddr = vaddr;
+    rmap->items[rmap->count].pid = pid;
+    rmap->count++;
+    if (pfn > rmap->max_pfn)
+        rmap->max_pfn = pfn;
     return OK;
 }
 
-static int walk_proc_mem(process_pagemap_t * p_t, pagemap_tbl * table) {
-    int pagemap_fd;
-    char data[8];
-    char pagemap_p[sizeof("/proc/%d/pagemap") + sizeof(int)*3];
-    off64_t lseek_ret;
-    uint64_t datanum,pfn;
-    double pss = 0.0;
+static int cmp_rmap(const void * a, const void * b) {
+    const pgmap_rmap_entry * x = a;
+    const pgmap_rmap_entry * y = b;
+    return (x->pfn > y->pfn) - (x->pfn < y->pfn);
+}
 
-    sprintf(pagemap_p,"/proc/%d/pagemap",p_t->pid);
-    pagemap_fd = open(pagemap_p,O_RDONLY);
-    if (pagemap_fd < 0) {
-        trace("error pagemap open");
-        return ERROR;
+// stable LSD radix sort by pfn, only as many passes as max_pfn needs
+static void sort_rmap(rmap_t * rmap) {
+    pgmap_rmap_entry * tmp, * src, * dst, * swp;
+    unsigned long pos[RMAP_RADIX];
+    unsigned long sum, c;
+
+    if (rmap->count < 2)
+        return;
+    tmp = malloc(rmap->count*sizeof(pgmap_rmap_entry));
+    if (!tmp) {
+        qsort(rmap->items, rmap->count, sizeof(pgmap_rmap_entry), cmp_rmap);
+        return;
     }
-    p_t->res = 0;
-    p_t->uss = 0;
+    src = rmap->items;
+    dst = tmp;
+    for (int shift = 0; shift < 64 && (rmap->max_pfn >> shift); shift += RMAP_RADIX_BITS) {
+        memset(pos, 0, sizeof(pos));
+        for (unsigned long i = 0; i < rmap->count; i++)
+            pos[(src[i].pfn >> shift) & (RMAP_RADIX - 1)]++;
+        sum = 0;
+        for (int d = 0; d < RMAP_RADIX; d++) {
+            c = pos[d];
+            pos[d] = sum;
+            sum += c;
+        }
+        for (unsigned long i = 0; i < rmap->count; i++)
+            dst[pos[(src[i].pfn >> shift) & (RMAP_RADIX - 1)]++] = src[i];
+        swp = src;
+        src = dst;
+        dst = swp;
+    }
+    if (src != rmap->items)
+        memcpy(rmap->items, src, rmap->count*sizeof(pgmap_rmap_entry));
+    free(tmp);
+}
+
+// index of first entry with given pfn or rmap->count
+static unsigned long find_rmap(rmap_t * rmap, uint64_t pfn) {
+    unsigned long lo = 0, hi = rmap->count;
+
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo)/2;
+        if (rmap->items[mid].pfn < pfn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void free_rmap(rmap_t * rmap) {
+    if (!rmap)
+        return;
+    free(rmap->items);
+    free(rmap);
+}
+
+typedef struct rmap_pid {
+    int pid;
+    int idx;
+} rmap_pid;
+
+static int cmp_rmap_pid(const void * a, const void * b) {
+    return ((const rmap_pid *) a)->pid - ((const rmap_pid *) b)->pid;
+}
+
+// shared pages are counted per group of entries with the same pfn, so
+// nothing bigger than reverse map itself is ever allocated
+static int share_matrix(rmap_t * rmap, const int * pids, int n, unsigned long * matrix) {
+    rmap_pid * sorted, key, * res;
+    unsigned long * seen;   // last group of pid, groups are not truncated
+    int * members;
+    unsigned long i = 0, j, group = 0;
+    int k;
+
+    sorted = malloc(n*sizeof(rmap_pid));
+    seen = malloc(n*sizeof(unsigned long));
+    members = malloc(n*sizeof(int));
+    if (!sorted || !seen || !members) {
+        free(sorted);
+        free(seen);
+        free(members);
+        return ERROR;
+    }
+    for (k = 0; k < n; k++) {
+        sorted[k].pid = pids[k];
+        sorted[k].idx = k;
+        seen[k] = (unsigned long) -1;
+    }
+    qsort(sorted, n, sizeof(rmap_pid), cmp_rmap_pid);
+    memset(matrix, 0, (unsigned long) n*n*sizeof(unsigned long));
+    while (i < rmap->count) {
+        k = 0;
+        for (j = i; j < rmap->count && rmap->items[j].pfn == rmap->items[i].pfn; j++) {
+            key.pid = rmap->items[j].pid;
+            res = bsearch(&key, sorted, n, sizeof(rmap_pid), cmp_rmap_pid);
+            if (!res || seen[res->idx] == group)
+                continue;
+            seen[res->idx] = group;
+            members[k++] = res->idx;
+        }
+        for (int a = 0; a < k; a++) {
+            matrix[(unsigned long) members[a]*n + members[a]] += 1;
+            for (int b = a + 1; b < k; b++) {
+                matrix[(unsigned long) members[a]*n + members[b]] += 1;
+                matrix[(unsigned long) members[b]*n + members[a]] += 1;
+            }
+        }
+        group++;
+        i = j;
+    }
+    free(sorted);
+    free(seen);
+    free(members);
+    return OK;
+}
+
+static inline int log2_order(unsigned long n) {
+    int order = 8*sizeof(unsigned long) - 1 - __builtin_clzl(n);
+    return order < PGMAP_ORDERS ? order : PGMAP_ORDERS - 1;
+}
+
+static inline void clear_counters(process_pagemap_t * p_t) {
+    p_t->res = 0;
+    p_t->uss = 0;
     p_t->pss = 0;
     p_t->swap = 0;
     p_t->shr = 0;
@@ -506,295 +1500,4260 @@ static int walk_proc_mem(process_pagemap_t * p_t, pagemap_tbl * table) {
     p_t->n_unevctb = 0;
     p_t->n_referenced = 0;
     p_t->n_recycle = 0;
+    p_t->n_hot = 0;
+    p_t->n_cold = 0;
+    p_t->n_sdirty = 0;
+    p_t->n_file = 0;
+}
+
+// count_excl - uss, shr and n_anon of resident page by pagemap bits only
+static inline void count_excl(process_pagemap_t * p_t, uint64_t datanum) {
+    if (datanum & PM_MMAP_EXCLUSIVE)
+        p_t->uss += 1;
+    else
+        p_t->shr += 1;
+    if (!(datanum & PM_FILE))
+        p_t->n_anon += 1;
+}
+
+// count_kpage - uss, shr, pss and kpageflags of one resident page
+static inline void count_kpage(process_pagemap_t * p_t, uint64_t count, uint64_t flags, double * pss) {
+    if (count == 0x1)
+        p_t->uss += 1;
+    else
+        p_t->shr += 1;
+    if (count) //for sure
+        *pss += 1/(double)count;
+    set_flags(p_t, flags);
+}
+
+/////////// throttled walk ////////////////////////////
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void throttle_sleep(uint64_t ns) {
+    struct timespec ts;
+
+    ts.tv_sec = ns/1000000000ULL;
+    ts.tv_nsec = ns%1000000000ULL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+    STAT_ADD(throttle_ns,ns);
+}
+
+// psi_avg10 - "some avg10" of memory pressure file, -1 if it cannot be read
+static double psi_avg10(const char * path) {
+    char buf[BUFSIZE];
+    double avg = -1.0;
+    ssize_t got;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1.0;
+    got = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (got <= 0)
+        return -1.0;
+    buf[got] = '\0';
+    if (sscanf(buf, "some avg10=%lf", &avg) != 1)
+        return -1.0;
+    return avg;
+}
+
+// psi_path - memory.pressure of cgroup v2 of pid, system one without it
+static void psi_path(int pid, char * path, size_t size) {
+    char line[BUFSIZE];
+    FILE * f;
+
+    path[0] = '\0';
+    sprintf(line, "/proc/%d/cgroup", pid);
+    f = fopen(line, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3))
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, size, "/sys/fs/cgroup%s/memory.pressure", strcmp(line + 3, "/") ? line + 3 : "");
+        break;
+    }
+    if (f)
+        fclose(f);
+    if (!path[0] || access(path, R_OK) != 0)
+        snprintf(path, size, "/proc/pressure/memory");
+    if (access(path, R_OK) != 0)
+        path[0] = '\0';
+}
+
+// throttle_begin - starts CPU budget of scan
+static inline void throttle_begin(pagemap_tbl * table) {
+    throttle_t * th = table->throttle;
+
+    if (!th)
+        return;
+    th->wall0 = clock_ns(CLOCK_MONOTONIC);
+    th->cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// throttle_cpu - sleeps until scanning thread is within its CPU share
+static void throttle_cpu(throttle_t * th) {
+    uint64_t cpu, wall, need;
+
+    if (!th->lim.cpu || th->lim.cpu >= 100)
+        return;
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - th->cpu0;
+    wall = clock_ns(CLOCK_MONOTONIC) - th->wall0;
+    need = cpu/th->lim.cpu*100;
+    if (need > wall)
+        throttle_sleep(need - wall);
+}
+
+// throttle_proc - starts byte budget of process and finds its pressure file
+static inline void throttle_proc(pagemap_tbl * table, int pid) {
+    throttle_t * th = table->throttle;
+
+    if (!th)
+        return;
+    th->proc0 = clock_ns(CLOCK_MONOTONIC);
+    th->proc_bytes = 0;
+    th->psi_next = 0;
+    th->psi_path[0] = '\0';
+    if (th->lim.psi > 0 && table->io->live)
+        psi_path(pid, th->psi_path, sizeof(th->psi_path));
+}
+
+// throttle_read - keeps budgets after bytes of pagemap were read, backs off
+// while memory pressure of process is too high
+static void throttle_read(pagemap_tbl * table, long bytes) {
+    throttle_t * th = table->throttle;
+    uint64_t now, due, pause, waited = 0;
+
+    if (!th)
+        return;
+    if (bytes > 0)
+        th->proc_bytes += bytes;
+    if (th->lim.rate) {
+        due = th->proc0 + th->proc_bytes*1000000000ULL/th->lim.rate;
+        now = clock_ns(CLOCK_MONOTONIC);
+        if (due > now)
+            throttle_sleep(due - now);
+    }
+    throttle_cpu(th);
+    if (!th->psi_path[0])
+        return;
+    now = clock_ns(CLOCK_MONOTONIC);
+    if (now < th->psi_next)
+        return;
+    for (pause = PSI_BACKOFF; waited < PSI_WAIT_MAX && psi_avg10(th->psi_path) > th->lim.psi; pause *= 2) {
+        if (pause > PSI_BACKOFF_MAX)
+            pause = PSI_BACKOFF_MAX;
+        STAT_ADD(backoffs,1);
+        throttle_sleep(pause);
+        waited += pause;
+    }
+    now = clock_ns(CLOCK_MONOTONIC);
+    th->psi_next = now + PSI_PERIOD;
+    if (waited) {
+        // no burst to catch up with rate after backoff
+        th->proc0 = now;
+        th->proc_bytes = 0;
+    }
+}
+
+// throttle_vma - lets other users of address space in between mappings
+static inline void throttle_vma(pagemap_tbl * table) {
+    throttle_t * th = table->throttle;
+
+    if (!th)
+        return;
+    if (th->lim.pause_us)
+        throttle_sleep(th->lim.pause_us*1000ULL);
+    else
+        sched_yield();
+}
+
+static int walk_proc_mem(process_pagemap_t * p_t, pagemap_tbl * table, unsigned long * contig) {
+    int pagemap_h;
+    char pagemap_p[sizeof("/proc/%d/pagemap") + sizeof(int)*3];
+    uint64_t * buf = table->kpagemap->pm_buf;
+    uint64_t datanum,count,pfn,vpn,last,base;
+    uint64_t run_pfn = 0, run_vpn = 0, run_len = 0;
+    uint64_t start;
+    long got;
+    size_t n;
+    double pss = 0.0;
+
+    sprintf(pagemap_p,"/proc/%d/pagemap",p_t->pid);
+    pagemap_h = io_open(table->io, pagemap_p);
+    if (pagemap_h < 0) {
+        // kernel threads without memory fail too
+        pagemap_p[strlen(pagemap_p) - sizeof("/pagemap") + 1] = '\0';
+        if (cur_stats && (errno == ENOENT || (table->io->live && access(pagemap_p, F_OK) != 0)))
+            STAT_ADD(vanished,1);
+        trace("error pagemap open");
+        return ERROR;
+    }
+    clear_counters(p_t);
+    memset(contig, 0, PGMAP_ORDERS*sizeof(unsigned long));
+    throttle_proc(table, p_t->pid);
 
     for (proc_mapping * cur = p_t->mappings; cur != NULL; cur = cur->next) {
-        for (uint64_t addr = cur->start; addr < cur->end; addr += table->kpagemap->pagesize) {
-            if ((lseek_ret = lseek64(pagemap_fd, (addr/table->kpagemap->pagesize)*8, SEEK_SET)) == (off64_t) -1) {
-                close(pagemap_fd);
-                trace("pagemap seek error");
-                return RD_ERROR;
-            }
-            if (read(pagemap_fd, data, 8) != 8) /* for vsyscall pages */
-            {
-                continue;
-                //return RD_ERROR;
-            }
-            memcpy(&datanum, data, 8);
-            // Swap or physical frame?
-            if (datanum & PM_SWAP) {
-                p_t->swap += 1;
-                continue;
-            }
-            if (!(datanum & PM_PRESENT)) {
-                continue;
-            }
-            pfn = PM_PFRAME(datanum);
-            p_t->res += 1;
+        if (cur != p_t->mappings)
+            throttle_vma(table);
+        cur->n_pfns = 0;
+        cur->n_sdirty = 0;
+        if (run_len)
+            contig[log2_order(run_len)] += 1;
+        run_len = 0;
+        vpn = cur->start/table->kpagemap->pagesize;
+        last = cur->end/table->kpagemap->pagesize;
+        while (vpn < last) {
+            n = (last - vpn > PM_CHUNK) ? PM_CHUNK : last - vpn;
+            start = stat_clock();
+            got = io_pread(table->io, pagemap_h, buf, n*PM_ENTRY_BYTES, vpn*PM_ENTRY_BYTES);
+            stat_phase(PGMAP_PHASE_PAGEMAP, start);
+            throttle_read(table, got);
+            if (got < (long) PM_ENTRY_BYTES) /* for vsyscall pages */
+                break;
+            n = got/PM_ENTRY_BYTES;
+            STAT_ADD(pages,n);
+            base = vpn;
+            vpn += n;
+            for (size_t i = 0; i < n; i++) {
+                datanum = buf[i];
+                // Swap or physical frame?
+                if (datanum & PM_SWAP) {
+                    p_t->swap += 1;
+                    continue;
+                }
+                if (!(datanum & PM_PRESENT)) {
+                    continue;
+                }
+                pfn = PM_PFRAME(datanum);
+                p_t->res += 1;
+                if (datanum & PM_FILE)
+                    p_t->n_file += 1;
+                if (table->flags & PAGEMAP_EXCL)
+                    count_excl(p_t, datanum);
 
-            if (table->kpagemap->under_root == 1) {
-                if (get_kpagecount(table, pfn ,&datanum) != OK)
-                    return RD_ERROR;
-                if (datanum == 0x1) {
-                    p_t->uss += 1;
+                if (table->kpagemap->under_root == 1) {
+                    // physical contiguity of virtually contiguous pages
+                    if (run_len && run_pfn == pfn && run_vpn == base + i) {
+                        run_len++;
+                    } else {
+                        if (run_len)
+                            contig[log2_order(run_len)] += 1;
+                        run_len = 1;
+                    }
+                    run_pfn = pfn + 1;
+                    run_vpn = base + i + 1;
+                    if ((table->flags & PAGEMAP_PFNS) && add_pfn(cur, pfn) != OK) {
+                        io_close(table->io, pagemap_h);
+                        return ERROR;
+                    }
+                    if (table->rmap && add_rmap(table->rmap, pfn,
+                                (base + i)*table->kpagemap->pagesize, p_t->pid) != OK) {
+                        io_close(table->io, pagemap_h);
+                        return ERROR;
+                    }
+                    if (table->flags & PAGEMAP_EXCL)
+                        continue;
+                    if (get_kpagecount(table, pfn ,&count) != OK ||
+                            get_kpageflags(table, pfn ,&datanum) != OK) {
+                        io_close(table->io, pagemap_h);
+                        return RD_ERROR;
+                    }
+                    count_kpage(p_t, count, datanum, &pss);
                 }
-                else
-                    p_t->shr += 1;
-                if (datanum) //for sure
-                    pss += 1/(double)datanum;
-                // kpageflags's
-                if (get_kpageflags(table, pfn ,&datanum) != OK)
-                    return RD_ERROR;
-                // flags stuff
-                set_flags(p_t, datanum);
             }
         }
    }
+   if (run_len)
+       contig[log2_order(run_len)] += 1;
    p_t->pss = (uint64_t)pss;
-   close(pagemap_fd);
+   io_close(table->io, pagemap_h);
    return OK;
 }
 
-static pagemap_tbl * walk_procs(pagemap_tbl * table, int pid) {
+/////////// batched walk ////////////////////////////
+static int cmp_u64(const void * a, const void * b);
+
+// process of batched walk, its reads may span several windows
+typedef struct batch_proc {
     pagemap_list * p;
+    int h;                  // pagemap handle
+    int failed;
+    proc_mapping * skip;    // mapping with failed read
+    double pss;
+    uint64_t run_pfn, run_vpn, run_len;
+} batch_proc;
 
-    if (!table) {
-        trace("no table in da house");
-        return NULL;
+// pagemap read of part of one mapping
+typedef struct batch_read {
+    batch_proc * proc;
+    proc_mapping * map;
+    uint64_t vpn;
+    int first;              // first read of mapping
+    int last;               // last read of process
+} batch_read;
+
+typedef struct batch_win {
+    uint64_t * buf;         // BATCH_ENTRIES pagemap entries
+    unsigned long n;
+    batch_read reads[BATCH_READS];
+    io_req reqs[BATCH_READS];
+    io_set set;
+} batch_win;
+
+// entries of kpagecount and kpageflags read by one pair of reads
+typedef struct batch_run {
+    uint64_t pfn;
+    unsigned long n;        // entries valid in both files
+    unsigned long pos;      // in cnt and flg
+} batch_run;
+
+typedef struct batch_walk {
+    pagemap_tbl * table;
+    int pid;
+    batch_proc * procs;
+    unsigned long n_procs;
+    batch_proc * proc;      // process being split into reads
+    proc_mapping * map;
+    uint64_t vpn;
+    batch_win win[2];
+    uint64_t * blocks;      // KPAGE_CACHE aligned blocks needed by window
+    unsigned long n_blocks, size_blocks;
+    batch_run * runs;
+    unsigned long n_runs, size_runs;
+    uint64_t * cnt, * flg;
+    unsigned long size_kpage;
+    io_req * kreqs;         // two per run
+    unsigned long size_kreqs;
+    io_set kset;
+} batch_walk;
+
+static void batch_end_proc(batch_walk * w, batch_proc * proc) {
+    if (!proc->failed) {
+        if (proc->run_len)
+            proc->p->contig[log2_order(proc->run_len)] += 1;
+        proc->p->pid_table.pss = (uint64_t) proc->pss;
     }
-    reset_pos(table);
-    while ((p = pid_iter(table))) {
-        if (pid > 0 && p->pid_table.pid != pid)
+    io_close(w->table->io, proc->h);
+    proc->h = -1;
+}
+
+// batch_next_proc - opens pagemap of next process of walk
+static batch_proc * batch_next_proc(batch_walk * w) {
+    char path[sizeof("/proc/%d/pagemap") + sizeof(int)*3];
+    batch_proc * proc;
+    pagemap_list * p;
+
+    while ((p = pid_iter(w->table))) {
+        if (w->pid > 0 && p->pid_table.pid != w->pid)
+            continue;
+        proc = &w->procs[w->n_procs];
+        memset(proc, 0, sizeof(*proc));
+        sprintf(path,"/proc/%d/pagemap",p->pid_table.pid);
+        proc->h = io_open(w->table->io, path);
+        if (proc->h < 0) {
+            // kernel threads without memory fail too
+            path[strlen(path) - sizeof("/pagemap") + 1] = '\0';
+            if (cur_stats && (errno == ENOENT || (w->table->io->live && access(path, F_OK) != 0)))
+                STAT_ADD(vanished,1);
+            trace("error pagemap open");
             continue;
-        if ((walk_proc_mem(&p->pid_table,table)) != OK) {
-            trace("walk_proc_mem ERROR");
         }
+        w->n_procs++;
+        proc->p = p;
+        clear_counters(&p->pid_table);
+        memset(p->contig, 0, PGMAP_ORDERS*sizeof(unsigned long));
+        return proc;
     }
-    return table;
+    return NULL;
 }
 
-static int walk_phys_mem(pagemap_tbl * table, unsigned long * shared, unsigned long * free, unsigned long * nonshared)
-{
-    uint64_t datanum;
+// batch_fill - splits mappings of processes into reads of window and
+// starts them
+static void batch_fill(batch_walk * w, batch_win * win) {
+    unsigned long used = 0, n;
+    uint64_t last;
+    batch_read * rd;
 
-    for (uint64_t seek = 0; seek <= table->kpagemap->phys_p_count; seek++) {
-        if (get_kpagecount(table, seek , &datanum) != OK)
-            return RD_ERROR;
-        // kpagecount's
-        if (datanum == 0x1)
-            *nonshared += 1;
-        if (datanum > 0x1)
-            *shared += 1;
-        if (datanum == 0x0)
-            *free += 1;
+    win->n = 0;
+    while (win->n < BATCH_READS && used < BATCH_ENTRIES) {
+        if (!w->proc) {
+            w->proc = batch_next_proc(w);
+            if (!w->proc)
+                break;
+            w->map = w->proc->p->pid_table.mappings;
+            if (w->map)
+                w->vpn = w->map->start/w->table->kpagemap->pagesize;
+        }
+        if (!w->map) {
+            // process without mappings
+            batch_end_proc(w, w->proc);
+            w->proc = NULL;
+            continue;
+        }
+        last = w->map->end/w->table->kpagemap->pagesize;
+        n = last - w->vpn;
+        if (n > PM_CHUNK)
+            n = PM_CHUNK;
+        if (n > BATCH_ENTRIES - used)
+            n = BATCH_ENTRIES - used;
+        rd = &win->reads[win->n];
+        rd->proc = w->proc;
+        rd->map = w->map;
+        rd->vpn = w->vpn;
+        rd->first = w->vpn == w->map->start/w->table->kpagemap->pagesize;
+        rd->last = 0;
+        if (rd->first) {
+            w->map->n_pfns = 0;
+            w->map->n_sdirty = 0;
+        }
+        win->reqs[win->n].h = w->proc->h;
+        win->reqs[win->n].buf = win->buf + used;
+        win->reqs[win->n].len = n*PM_ENTRY_BYTES;
+        win->reqs[win->n].off = w->vpn*PM_ENTRY_BYTES;
+        win->n++;
+        used += n;
+        w->vpn += n;
+        if (w->vpn < last)
+            continue;
+        w->map = w->map->next;
+        if (w->map) {
+            w->vpn = w->map->start/w->table->kpagemap->pagesize;
+        } else {
+            rd->last = 1;
+            w->proc = NULL;
+        }
     }
-    return OK;
-}
-
-static void clean_tables(pagemap_tbl * table) {
-    if (!table)
-        return ;
-    clean_mappings(table);
-    close_kpagemap(table->kpagemap);
-    destroy_list(table);
-    free(table->kpagemap);
-    free(table);
+    io_start(w->table, &win->set, win->reqs, win->n);
 }
 
-static int pgmap_ver(void) {
-    char buffer[SMALLBUF];
-    int fd = 0;
-    int major,minor,patch;
+// batch_kpage - reads kpagecount and kpageflags of resident pages of window,
+// needed blocks of KPAGE_CACHE entries are joined into runs read at once
+static int batch_kpage(batch_walk * w, batch_win * win) {
+    kpagemap_t * kpagemap = w->table->kpagemap;
+    uint64_t * buf, * tmp, pfn, block, last = UINT64_MAX;
+    unsigned long n, total = 0, lookups = 0, distinct = 0;
+    batch_run * run;
+    io_req * req;
 
-    fd = open("/proc/sys/kernel/osrelease",O_RDONLY);
-    if (fd < 0)
-        return ERROR;
-    if (read(fd,buffer,SMALLBUF) < 0) {
-        close(fd);
-        return ERROR;
+    w->n_blocks = 0;
+    w->n_runs = 0;
+    for (unsigned long r = 0; r < win->n; r++) {
+        if (win->reqs[r].res < (long) PM_ENTRY_BYTES)
+            continue;
+        buf = win->reqs[r].buf;
+        n = win->reqs[r].res/PM_ENTRY_BYTES;
+        for (unsigned long i = 0; i < n; i++) {
+            if ((buf[i] & PM_SWAP) || !(buf[i] & PM_PRESENT))
+                continue;
+            lookups++;
+            block = PM_PFRAME(buf[i])/KPAGE_CACHE;
+            if (block == last)
+                continue;
+            if (grow_array((void **) &w->blocks, &w->size_blocks, w->n_blocks, sizeof(uint64_t)) != OK)
+                return ERROR;
+            w->blocks[w->n_blocks++] = last = block;
+        }
     }
-    close(fd);
-    major = atoi(strtok(buffer,"."));
-    minor = atoi(strtok(NULL,"."));
-    patch = atoi(strtok(NULL,"."));
-    if ((major >= 3) || (major == 2 && minor == 6 && patch >= 25))
-        return OK;
-    return ERROR;
+    qsort(w->blocks, w->n_blocks, sizeof(uint64_t), cmp_u64);
+    for (unsigned long i = 0; i < w->n_blocks; i++) {
+        pfn = w->blocks[i]*KPAGE_CACHE;
+        run = w->n_runs ? &w->runs[w->n_runs - 1] : NULL;
+        if (run && pfn < run->pfn + run->n)
+            continue;
+        distinct++;
+        if (run && pfn <= run->pfn + run->n + KPAGE_GAP && pfn + KPAGE_CACHE - run->pfn <= KPAGE_RUN) {
+            total += pfn + KPAGE_CACHE - (run->pfn + run->n);
+            run->n = pfn + KPAGE_CACHE - run->pfn;
+            continue;
+        }
+        if (grow_array((void **) &w->runs, &w->size_runs, w->n_runs, sizeof(batch_run)) != OK)
+            return ERROR;
+        run = &w->runs[w->n_runs++];
+        run->pfn = pfn;
+        run->n = KPAGE_CACHE;
+        run->pos = total;
+        total += KPAGE_CACHE;
+    }
+    STAT_ADD(pfn_lookups,lookups);
+    STAT_ADD(cache_hits,lookups - distinct);
+    if (total > w->size_kpage) {
+        tmp = realloc(w->cnt, total*sizeof(uint64_t));
+        if (tmp)
+            w->cnt = tmp;
+        tmp = tmp ? realloc(w->flg, total*sizeof(uint64_t)) : NULL;
+        if (!tmp)
+            return ERROR;
+        w->flg = tmp;
+        w->size_kpage = total;
+    }
+    if (2*w->n_runs > w->size_kreqs) {
+        req = realloc(w->kreqs, 2*w->n_runs*sizeof(io_req));
+        if (!req)
+            return ERROR;
+        w->kreqs = req;
+        w->size_kreqs = 2*w->n_runs;
+    }
+    for (unsigned long i = 0; i < w->n_runs; i++) {
+        run = &w->runs[i];
+        req = &w->kreqs[2*i];
+        req[0].h = kpagemap->kpgm_count_fd;
+        req[0].buf = w->cnt + run->pos;
+        req[1].h = kpagemap->kpgm_flags_fd;
+        req[1].buf = w->flg + run->pos;
+        req[0].len = req[1].len = run->n*sizeof(uint64_t);
+        req[0].off = req[1].off = run->pfn*sizeof(uint64_t);
+    }
+    io_start(w->table, &w->kset, w->kreqs, 2*w->n_runs);
+    io_finish(w->table, &w->kset);
+    for (unsigned long i = 0; i < w->n_runs; i++) {
+        req = &w->kreqs[2*i];
+        n = req[0].res < req[1].res ? req[0].res : req[1].res;
+        w->runs[i].n = req[0].res < 0 || req[1].res < 0 ? 0 : n/sizeof(uint64_t);
+    }
+    return OK;
 }
 
-static inline int is_accessible(char * path)
-{
-    if (access(path,R_OK) != 0) 
-        return ERROR;
+static inline int batch_lookup(batch_walk * w, uint64_t pfn, uint64_t * count, uint64_t * flags) {
+    unsigned long lo = 0, hi = w->n_runs, mid;
+    batch_run * run;
+
+    while (lo < hi) {
+        mid = (lo + hi)/2;
+        if (w->runs[mid].pfn <= pfn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return RD_ERROR;
+    run = &w->runs[lo - 1];
+    if (pfn - run->pfn >= run->n)
+        return RD_ERROR;
+    *count = w->cnt[run->pos + pfn - run->pfn];
+    *flags = w->flg[run->pos + pfn - run->pfn];
     return OK;
 }
 
-static pagemap_tbl * walk_procdir(pagemap_tbl * table) {
-    DIR * proc_dir = NULL;
-    char path[BUFSIZE];
-    struct dirent * proc_ent;
-    int curr_pid;
+// batch_decode - counts pages of window in order of reads, like walk_proc_mem()
+static void batch_decode(batch_walk * w, batch_win * win) {
+    pagemap_tbl * table = w->table;
+    unsigned long pagesize = table->kpagemap->pagesize;
+    uint64_t datanum, count, flags, pfn, * buf;
+    process_pagemap_t * p_t;
+    batch_proc * proc;
+    batch_read * rd;
+    unsigned long n;
 
-    proc_dir = opendir("/proc");
-    if (!proc_dir)
-        return NULL;
-    table->size = 0;
-    invalidate_pids(table);
-    while ((proc_ent = readdir(proc_dir))) {
-        if (sscanf(proc_ent->d_name,"%d",&curr_pid) == 1) {
-            sprintf(path,"/proc/%d/pagemap",curr_pid);
-            if (is_accessible(path) == OK) {
-                add_pid(curr_pid,table);
-                table->size += 1;
+    for (unsigned long r = 0; r < win->n; r++) {
+        rd = &win->reads[r];
+        proc = rd->proc;
+        p_t = &proc->p->pid_table;
+        if (proc->failed || rd->map == proc->skip)
+            goto read_end;
+        if (rd->first) {
+            if (proc->run_len)
+                proc->p->contig[log2_order(proc->run_len)] += 1;
+            proc->run_len = 0;
+        }
+        if (win->reqs[r].res < (long) PM_ENTRY_BYTES) { /* for vsyscall pages */
+            proc->skip = rd->map;
+            goto read_end;
+        }
+        buf = win->reqs[r].buf;
+        n = win->reqs[r].res/PM_ENTRY_BYTES;
+        STAT_ADD(pages,n);
+        for (unsigned long i = 0; i < n; i++) {
+            datanum = buf[i];
+            if (datanum & PM_SWAP) {
+                p_t->swap += 1;
+                continue;
+            }
+            if (!(datanum & PM_PRESENT))
+                continue;
+            pfn = PM_PFRAME(datanum);
+            p_t->res += 1;
+            if (datanum & PM_FILE)
+                p_t->n_file += 1;
+            if (table->flags & PAGEMAP_EXCL)
+                count_excl(p_t, datanum);
+            if (table->kpagemap->under_root != 1)
+                continue;
+            if (proc->run_len && proc->run_pfn == pfn && proc->run_vpn == rd->vpn + i) {
+                proc->run_len++;
+            } else {
+                if (proc->run_len)
+                    proc->p->contig[log2_order(proc->run_len)] += 1;
+                proc->run_len = 1;
+            }
+            proc->run_pfn = pfn + 1;
+            proc->run_vpn = rd->vpn + i + 1;
+            if (((table->flags & PAGEMAP_PFNS) && add_pfn(rd->map, pfn) != OK) ||
+                    (table->rmap && add_rmap(table->rmap, pfn, (rd->vpn + i)*pagesize, p_t->pid) != OK)) {
+                proc->failed = ERROR;
+                break;
             }
+            if (table->flags & PAGEMAP_EXCL)
+                continue;
+            if (batch_lookup(w, pfn, &count, &flags) != OK) {
+                proc->failed = RD_ERROR;
+                break;
+            }
+            count_kpage(p_t, count, flags, &proc->pss);
         }
+read_end:
+        if (rd->last)
+            batch_end_proc(w, proc);
     }
-    closedir(proc_dir);
-    polish_table(table);
-    return table;
 }
 
-static inline uint64_t ram_count(pagemap_tbl * table)
-{
-    return table->kpagemap->phys_p_count;
+// walk_procs_batch - walk_proc_mem() of all processes, pagemap reads of
+// next window and kpage reads of current one are in flight together
+static int walk_procs_batch(pagemap_tbl * table, int pid) {
+    batch_walk w;
+    pagemap_list * p;
+    unsigned long n = 0;
+    uint64_t start;
+    int cur = 0, ret = OK;
+
+    memset(&w, 0, sizeof(w));
+    w.table = table;
+    w.pid = pid;
+    reset_pos(table);
+    while ((p = pid_iter(table)))
+        n++;
+    w.procs = malloc((n ? n : 1)*sizeof(batch_proc));
+    w.win[0].buf = malloc(BATCH_ENTRIES*PM_ENTRY_BYTES);
+    w.win[1].buf = malloc(BATCH_ENTRIES*PM_ENTRY_BYTES);
+    if (!w.procs || !w.win[0].buf || !w.win[1].buf) {
+        ret = ERROR;
+        goto batch_out;
+    }
+    reset_pos(table);
+    batch_fill(&w, &w.win[cur]);
+    while (w.win[cur].n) {
+        start = stat_clock();
+        io_finish(table, &w.win[cur].set);
+        stat_phase(PGMAP_PHASE_PAGEMAP, start);
+        batch_fill(&w, &w.win[!cur]);
+        if (table->kpagemap->under_root == 1 && !(table->flags & PAGEMAP_EXCL)) {
+            start = stat_clock();
+            if (batch_kpage(&w, &w.win[cur]) != OK) {
+                w.n_runs = 0;
+                ret = ERROR;
+            }
+            stat_phase(PGMAP_PHASE_KPAGE, start);
+        }
+        if (table->kpagemap->ring_leak)
+            goto batch_leak;
+        batch_decode(&w, &w.win[cur]);
+        cur = !cur;
+    }
+    goto batch_out;
+batch_leak:
+    // kernel may still complete reads into buffers of windows and kpage
+    // runs, they are never freed and walk_procs() starts again without them
+    for (unsigned long k = 0; k < w.n_procs; k++)
+        if (w.procs[k].h >= 0)
+            io_close(table->io, w.procs[k].h);
+    w.win[0].buf = w.win[1].buf = NULL;
+    w.cnt = w.flg = NULL;
+    table->kpagemap->ring_leak = 0;
+    ret = RD_ERROR;
+batch_out:
+    free(w.procs);
+    free(w.win[0].buf);
+    free(w.win[1].buf);
+    free(w.blocks);
+    free(w.runs);
+    free(w.cnt);
+    free(w.flg);
+    free(w.kreqs);
+    return ret;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////
-// external interface ////////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////////////////////////////////
-pagemap_tbl * init_pgmap_table(pagemap_tbl * table) {
-    // for new table - it is necessary to give NULL pointer at first call
+static pagemap_tbl * walk_procs(pagemap_tbl * table, int pid) {
+    pagemap_list * p;
+    uint64_t start = stat_clock();
+    int batch, ret = OK;
+
     if (!table) {
-        if (pgmap_ver() == ERROR)
-            return NULL;
-        trace("pgmap_ver()");
-        table = malloc(sizeof(pagemap_tbl));
-        if (!table)
-            return NULL;
-        trace("allocating of table");
-        table->kpagemap = malloc(sizeof(kpagemap_t));
-        if (open_kpagemap(table->kpagemap) != OK) {
-            free(table);
-            return NULL;
+        trace("no table in da house");
+        return NULL;
+    }
+    if (table->flags & PAGEMAP_RMAP) {
+        if (!table->rmap)
+            table->rmap = calloc(1, sizeof(rmap_t));
+        if (table->rmap) {
+            table->rmap->count = 0;
+            table->rmap->max_pfn = 0;
         }
-        trace("open_kpagemap");
+    } else if (table->rmap) {
+        free_rmap(table->rmap);
+        table->rmap = NULL;
     }
-    if(!walk_procdir(table)) {
-        free(table);
-        return NULL;
+    throttle_begin(table);
+    batch = (table->flags & PAGEMAP_BATCH) && !table->throttle;
+    if (batch && (ret = walk_procs_batch(table, pid)) != OK)
+        trace("walk_procs_batch ERROR");
+    // reads lost in aborted io_uring are done again one by one
+    if (ret == RD_ERROR && table->rmap) {
+        table->rmap->count = 0;
+        table->rmap->max_pfn = 0;
     }
-    trace("walk_procdir");
+    if (!batch || ret == RD_ERROR) {
+        reset_pos(table);
+        while ((p = pid_iter(table))) {
+            if (pid > 0 && p->pid_table.pid != pid)
+                continue;
+            if ((walk_proc_mem(&p->pid_table,table,p->contig)) != OK) {
+                trace("walk_proc_mem ERROR");
+            }
+        }
+    }
+    if (table->rmap)
+        sort_rmap(table->rmap);
+    stat_phase(PGMAP_PHASE_WALK, start);
     return table;
 }
 
-pagemap_tbl * open_pgmap_table(pagemap_tbl * table, int pid) {
-    fill_mappings(table);
-    trace("fill_mappings");
-    fill_cmdlines(table);
-    trace("fill_cmdlines");
-    walk_procs(table,pid);
-    trace("walk_procs");
-    return table;
-}
+// reads count entries of kpageflags/kpagecount from pfn, returns number of read entries
+static long read_kpage_block(pgmap_io * io, int h, uint64_t * buf, uint64_t pfn, unsigned long count) {
+    long got;
 
-void free_pgmap_table(pagemap_tbl * table) {
-    clean_tables(table);
-    trace("kill tables");
+    got = io_read_full(io, h, buf, count*sizeof(uint64_t), pfn*sizeof(uint64_t));
+    return got < 0 ? -1 : got/(long) sizeof(uint64_t);
 }
 
-// must be used with initialised table
-process_pagemap_t * get_single_pgmap(pagemap_tbl * table, int pid)
-{
-    process_pagemap_t * tmp;
+enum { PHYS_SHARED, PHYS_FREE, PHYS_NONSHARED, PHYS_SUMS };
 
-    if (!table)
-        return NULL;
-    if (reset_table_pos(table) == NULL)
-        return NULL;
-    while ((tmp = iterate_over_all(table)) != NULL) {
-        if (tmp->pid == pid)
-            return tmp;
+// count_phys - kpagecount's of n entries into PHYS_* sums
+static inline void count_phys(const uint64_t * buf, long n, unsigned long * sums) {
+    for (long i = 0; i < n; i++) {
+        if (buf[i] == 0x1)
+            sums[PHYS_NONSHARED] += 1;
+        if (buf[i] > 0x1)
+            sums[PHYS_SHARED] += 1;
+        if (buf[i] == 0x0)
+            sums[PHYS_FREE] += 1;
     }
-    return NULL;
 }
 
-// user is responsible for cleaning-up by freeing returned vector
-process_pagemap_t ** get_all_pgmap(pagemap_tbl * table, int * size)
+static int walk_phys_mem(pagemap_tbl * table, unsigned long * shared, unsigned long * free_pg, unsigned long * nonshared)
 {
-    process_pagemap_t ** arr = NULL;
-    process_pagemap_t * p = NULL;
-    int cnt = 0;
-    if (!table || !size)
-        return NULL;
+    uint64_t * buf;
+    uint64_t count = table->kpagemap->phys_p_count + 1;
+    unsigned long sums[PHYS_SUMS] = {0}, blk[PHYS_SUMS];
+    uint16_t * old;
+    uint64_t hash;
+    incr_t * incr;
+    long n, m;
+
+    buf = malloc(KPAGE_BLOCK*sizeof(uint64_t));
+    if (!buf)
+        return ERROR;
+    incr = incr_prepare(table, &table->kpagemap->incr_phys, PHYS_SUMS, 0);
+    throttle_begin(table);
+    for (uint64_t seek = 0; seek < count; seek += n) {
+        if (table->throttle)
+            throttle_cpu(table->throttle);
+        n = read_kpage_block(table->io, table->kpagemap->kpgm_count_fd, buf, seek,
+                count - seek > KPAGE_BLOCK ? KPAGE_BLOCK : count - seek);
+        if (n <= 0) {
+            free(buf);
+            return RD_ERROR;
+        }
+        if (!incr) {
+            count_phys(buf, n, sums);
+            continue;
+        }
+        // only blocks changed since the last walk are classified
+        for (long i = 0; i < n; i += m) {
+            m = n - i < INCR_BLOCK ? n - i : INCR_BLOCK;
+            hash = block_hash(buf + i, m, m);
+            old = incr_lookup(incr, (seek + i)/INCR_BLOCK, hash);
+            for (int s = 0; old && s < PHYS_SUMS; s++)
+                sums[s] += old[s];
+            if (old)
+                continue;
+            memset(blk, 0, sizeof(blk));
+            count_phys(buf + i, m, blk);
+            incr_store(incr, (seek + i)/INCR_BLOCK, hash, blk);
+            for (int s = 0; s < PHYS_SUMS; s++)
+                sums[s] += blk[s];
+        }
+    }
+    *shared += sums[PHYS_SHARED];
+    *free_pg += sums[PHYS_FREE];
+    *nonshared += sums[PHYS_NONSHARED];
+    free(buf);
+    return OK;
+}
+
+/////////// fragmentation ////////////////////////////
+// free page = buddy head or unused page right after it (tails are not marked);
+// buddy block never crosses FRAG_BUDDY_MAX aligned pfn, unused pages behind
+// it are allocated without flags (vmalloc, stacks, alloc_pages() users)
+static inline int frag_free(uint64_t flags, uint64_t count, uint64_t pfn, int in_free_run) {
+    if (BIT_SET(flags,KPF_BUDDY))
+        return 1;
+    return in_free_run && pfn % FRAG_BUDDY_MAX && flags == 0 && count == 0;
+}
+
+// movable = free or on LRU and neither unevictable nor locked in memory
+static inline int frag_movable(uint64_t flags) {
+    return BIT_SET(flags,KPF_LRU) && !BIT_SET(flags,KPF_UNEVICTABLE) &&
+        !BIT_SET(flags,KPF_MLOCKED) && !BIT_SET(flags,KPF_SLAB) &&
+        !BIT_SET(flags,KPF_RESERVED);
+}
+
+typedef struct frag_block {
+    unsigned long size;     // pages per block
+    unsigned long n_free;   // free pages in current block
+    unsigned long n_movbl;  // free or movable pages in current block
+    int huge;               // block starts by compound head of huge page
+} frag_block;
+
+static inline void frag_block_end(frag_block * blk, unsigned long * total,
+        unsigned long * free, unsigned long * movable, unsigned long * huge) {
+    *total += 1;
+    if (blk->n_free == blk->size)
+        *free += 1;
+    else if (blk->huge && huge)
+        *huge += 1;
+    else if (blk->n_movbl == blk->size)
+        *movable += 1;
+    blk->n_free = 0;
+    blk->n_movbl = 0;
+    blk->huge = 0;
+}
+
+// summary of one KPAGE_BLOCK of walk_frag_mem(), blocks start at
+// FRAG_BUDDY_MAX aligned pfns so freeness of their pages does not depend
+// on previous block; runs and 1 GB blocks crossing them are joined in order
+typedef struct frag_chunk {
+    uint64_t idx;           // pfn/KPAGE_BLOCK
+    long n;                 // pfns in block
+    unsigned long lead;     // free run from the first pfn, n = whole block is free
+    unsigned long trail;    // free run ending by the last pfn
+    unsigned long g_free;   // free and movable pages of 1 GB blocks larger than
+    unsigned long g_movbl;  //  KPAGE_BLOCK, they are ended by merge
+    pgmap_frag_t frag;      // pages, inner runs and 2 MB (1 GB) blocks ended inside
+} frag_chunk;
+
+// shared state of threads of walk_frag_mem()
+typedef struct frag_walk_t {
+    pagemap_tbl * table;
+    uint64_t next_block;
+    int eof;
+    int error;
+    unsigned long size_2m, size_1g;
+} frag_walk_t;
+
+typedef struct frag_worker_t {
+    frag_walk_t * walk;
+    pthread_t thread;
+    int started;
+    int counted;
+    pgmap_stats_t stats;
+    frag_chunk * chunks;
+    unsigned long n_chunks, size;
+} frag_worker_t;
+
+static void count_frag(frag_walk_t * walk, frag_chunk * ch,
+        const uint64_t * flg, const uint64_t * cnt, uint64_t pfn)
+{
+    pgmap_frag_t * frag = &ch->frag;
+    frag_block b2m, b1g;
+    unsigned long run = 0;
+    int is_free, lead = 1;
+
+    memset(&b2m, 0, sizeof(b2m));
+    memset(&b1g, 0, sizeof(b1g));
+    b2m.size = walk->size_2m;
+    b1g.size = walk->size_1g;
+    for (long i = 0; i < ch->n; i++, pfn++) {
+        if (BIT_SET(flg[i],KPF_NOPAGE)) {
+            is_free = 0;
+        } else {
+            frag->pages += 1;
+            is_free = frag_free(flg[i], cnt[i], pfn, run > 0);
+        }
+        if (is_free) {
+            frag->free_pages += 1;
+            run++;
+        } else {
+            if (lead)
+                ch->lead = run;
+            else if (run)
+                frag->free_runs[log2_order(run)] += 1;
+            lead = 0;
+            run = 0;
+        }
+        if (pfn % b2m.size == 0)
+            b2m.huge = BIT_SET(flg[i],KPF_COMPOUND_HEAD) &&
+                (BIT_SET(flg[i],KPF_THP) || BIT_SET(flg[i],KPF_HUGE));
+        b2m.n_free += is_free;
+        b2m.n_movbl += is_free || frag_movable(flg[i]);
+        b1g.n_free += is_free;
+        b1g.n_movbl += is_free || frag_movable(flg[i]);
+        if ((pfn + 1) % b2m.size == 0)
+            frag_block_end(&b2m, &frag->blocks_2m, &frag->free_2m,
+                    &frag->movable_2m, &frag->huge_2m);
+        if (b1g.size <= KPAGE_BLOCK && (pfn + 1) % b1g.size == 0)
+            frag_block_end(&b1g, &frag->blocks_1g, &frag->free_1g,
+                    &frag->movable_1g, NULL);
+    }
+    ch->lead = lead ? (unsigned long) ch->n : ch->lead;
+    ch->trail = run;
+    ch->g_free = b1g.n_free;
+    ch->g_movbl = b1g.n_movbl;
+}
+
+// walk_frag_worker - takes blocks of pfns like walk_pages_worker() and keeps
+// their summaries for ordered merge
+static void * walk_frag_worker(void * arg)
+{
+    frag_worker_t * worker = arg;
+    frag_walk_t * walk = worker->walk;
+    kpagemap_t * kpagemap = walk->table->kpagemap;
+    uint64_t * flg, * cnt;
+    frag_chunk * ch;
+    uint64_t idx;
+    long n, c = 0;
+
+    cur_stats = worker->counted ? &worker->stats : NULL;
+    flg = malloc(KPAGE_BLOCK*sizeof(uint64_t));
+    cnt = malloc(KPAGE_BLOCK*sizeof(uint64_t));
+    if (!flg || !cnt) {
+        __atomic_store_n(&walk->error, ERROR, __ATOMIC_RELAXED);
+        __atomic_store_n(&walk->eof, 1, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_load_n(&walk->eof, __ATOMIC_RELAXED)) {
+        idx = __atomic_fetch_add(&walk->next_block, 1, __ATOMIC_RELAXED);
+        n = read_kpage_block(walk->table->io, kpagemap->kpgm_flags_fd, flg, idx*KPAGE_BLOCK, KPAGE_BLOCK);
+        if (n > 0)
+            c = read_kpage_block(walk->table->io, kpagemap->kpgm_count_fd, cnt, idx*KPAGE_BLOCK, n);
+        if (n < 0 || (n > 0 && c < n))
+            __atomic_store_n(&walk->error, RD_ERROR, __ATOMIC_RELAXED);
+        if (n < KPAGE_BLOCK)
+            __atomic_store_n(&walk->eof, 1, __ATOMIC_RELAXED);
+        if (n <= 0 || c < n)
+            break;
+        if (worker->n_chunks == worker->size) {
+            worker->size = worker->size ? 2*worker->size : 16;
+            ch = realloc(worker->chunks, worker->size*sizeof(frag_chunk));
+            if (!ch) {
+                __atomic_store_n(&walk->error, ERROR, __ATOMIC_RELAXED);
+                __atomic_store_n(&walk->eof, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            worker->chunks = ch;
+        }
+        ch = &worker->chunks[worker->n_chunks++];
+        memset(ch, 0, sizeof(*ch));
+        ch->idx = idx;
+        ch->n = n;
+        count_frag(walk, ch, flg, cnt, idx*KPAGE_BLOCK);
+    }
+    free(flg);
+    free(cnt);
+    return NULL;
+}
+
+static int cmp_chunk(const void * a, const void * b) {
+    const frag_chunk * x = a, * y = b;
+    return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+// merge_frag - joins sorted summaries, runs crossing blocks are counted once
+static int merge_frag(frag_walk_t * walk, frag_chunk * chunks, unsigned long n_chunks, pgmap_frag_t * frag) {
+    frag_block b1g;
+    unsigned long run = 0;
+    pgmap_frag_t * f;
+
+    memset(&b1g, 0, sizeof(b1g));
+    b1g.size = walk->size_1g;
+    for (unsigned long k = 0; k < n_chunks; k++) {
+        // hole in blocks means that some read failed
+        if (chunks[k].idx != k)
+            return RD_ERROR;
+        f = &chunks[k].frag;
+        frag->pages += f->pages;
+        frag->free_pages += f->free_pages;
+        for (int o = 0; o < PGMAP_ORDERS; o++)
+            frag->free_runs[o] += f->free_runs[o];
+        frag->blocks_2m += f->blocks_2m;
+        frag->free_2m += f->free_2m;
+        frag->movable_2m += f->movable_2m;
+        frag->huge_2m += f->huge_2m;
+        frag->blocks_1g += f->blocks_1g;
+        frag->free_1g += f->free_1g;
+        frag->movable_1g += f->movable_1g;
+        if (chunks[k].lead == (unsigned long) chunks[k].n) {
+            run += chunks[k].n;
+        } else {
+            if (run + chunks[k].lead)
+                frag->free_runs[log2_order(run + chunks[k].lead)] += 1;
+            run = chunks[k].trail;
+        }
+        if (b1g.size > KPAGE_BLOCK) {
+            b1g.n_free += chunks[k].g_free;
+            b1g.n_movbl += chunks[k].g_movbl;
+            if ((k*KPAGE_BLOCK + chunks[k].n) % b1g.size == 0)
+                frag_block_end(&b1g, &frag->blocks_1g, &frag->free_1g,
+                        &frag->movable_1g, NULL);
+        }
+    }
+    if (run)
+        frag->free_runs[log2_order(run)] += 1;
+    return OK;
+}
+
+static int walk_frag_mem(pagemap_tbl * table, pgmap_frag_t * frag)
+{
+    frag_walk_t walk;
+    frag_worker_t * workers;
+    frag_chunk * chunks = NULL;
+    pgmap_stats_t * stats = cur_stats;
+    unsigned long n_chunks = 0;
+    long n_threads;
+    int ret;
+
+    memset(frag, 0, sizeof(*frag));
+    memset(&walk, 0, sizeof(walk));
+    walk.table = table;
+    walk.size_2m = (2UL << 20)/table->kpagemap->pagesize;
+    walk.size_1g = (1UL << 30)/table->kpagemap->pagesize;
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > PAGES_THREADS)
+        n_threads = PAGES_THREADS;
+    workers = calloc(n_threads, sizeof(frag_worker_t));
+    if (!workers)
+        return ERROR;
+    for (long t = 0; t < n_threads; t++) {
+        workers[t].walk = &walk;
+        workers[t].counted = stats != NULL;
+        if (t > 0)
+            workers[t].started = pthread_create(&workers[t].thread, NULL,
+                    walk_frag_worker, &workers[t]) == 0;
+    }
+    walk_frag_worker(&workers[0]);
+    cur_stats = stats;
+    for (long t = 0; t < n_threads; t++) {
+        if (workers[t].started)
+            pthread_join(workers[t].thread, NULL);
+        n_chunks += workers[t].n_chunks;
+        STAT_ADD(syscalls,workers[t].stats.syscalls);
+        STAT_ADD(bytes_read,workers[t].stats.bytes_read);
+    }
+    ret = walk.error;
+    if (ret == OK && n_chunks && !(chunks = malloc(n_chunks*sizeof(frag_chunk))))
+        ret = ERROR;
+    n_chunks = 0;
+    for (long t = 0; t < n_threads; t++) {
+        if (chunks)
+            memcpy(chunks + n_chunks, workers[t].chunks, workers[t].n_chunks*sizeof(frag_chunk));
+        n_chunks += workers[t].n_chunks;
+        free(workers[t].chunks);
+    }
+    free(workers);
+    if (ret == OK) {
+        qsort(chunks, n_chunks, sizeof(frag_chunk), cmp_chunk);
+        ret = merge_frag(&walk, chunks, n_chunks, frag);
+    }
+    free(chunks);
+    return ret;
+}
+
+/////////// page flags and mapcounts ////////////////////////////
+static const char * kpf_names[PGMAP_KPF_BITS] = {
+    "locked", "error", "referenced", "uptodate", "dirty", "lru", "active",
+    "slab", "writeback", "reclaim", "buddy", "mmap", "anon", "swapcache",
+    "swapbacked", "compound_head", "compound_tail", "huge", "unevictable",
+    "hwpoison", "nopage", "ksm", "thp", "offline", "zero_page", "idle",
+    "pgtable", NULL, NULL, NULL, NULL, NULL,
+    "reserved", "mlocked", "mappedtodisk", "private", "private_2",
+    "owner_private", "arch", "uncached", "softdirty", "arch_2", "arch_3",
+};
+
+// shared state of threads of walk_pages_mem()
+typedef struct pages_walk_t {
+    pagemap_tbl * table;
+    uint64_t next_block;    // next KPAGE_BLOCK of pfns to take
+    int eof;                // some thread reached end of kpageflags
+    int error;
+    int combo_bits[PGMAP_COMBO_BITS];
+    int n_combo;
+    incr_t * incr;          // only with PAGEMAP_INCR
+} pages_walk_t;
+
+typedef struct pages_worker_t {
+    pages_walk_t * walk;
+    pthread_t thread;
+    int started;
+    int counted;            // count into stats
+    pgmap_stats_t stats;
+    pgmap_pages_t pages;    // partial counts of blocks taken by this thread
+} pages_worker_t;
+
+static void count_pages(pages_walk_t * walk, pgmap_pages_t * pages,
+        const uint64_t * flg, const uint64_t * cnt, long n)
+{
+    uint64_t f;
+    unsigned long idx;
+
+    for (long i = 0; i < n; i++) {
+        if ((flg[i] >> KPF_NOPAGE) & 1) {
+            pages->flags[KPF_NOPAGE] += 1;
+            continue;
+        }
+        pages->pages += 1;
+        for (f = flg[i]; f; f &= f - 1)
+            pages->flags[__builtin_ctzll(f)] += 1;
+        pages->mapcount[cnt[i] < PGMAP_MAPCOUNTS ? cnt[i] : PGMAP_MAPCOUNTS - 1] += 1;
+        if (walk->n_combo) {
+            idx = 0;
+            for (int b = 0; b < walk->n_combo; b++)
+                idx |= ((flg[i] >> walk->combo_bits[b]) & 1) << b;
+            pages->combos[idx] += 1;
+        }
+    }
+}
+
+// layout of block summary of walk_pages_mem(): pages, flags, mapcount, combos
+#define PAGES_SUM_FLAGS     1
+#define PAGES_SUM_MAPCOUNT  (PAGES_SUM_FLAGS + PGMAP_KPF_BITS)
+#define PAGES_SUM_COMBOS    (PAGES_SUM_MAPCOUNT + PGMAP_MAPCOUNTS)
+
+// count_pages_incr - count_pages() of blocks changed since the last walk,
+// summaries of the others are added; blk is scratch of stride items
+static void count_pages_incr(pages_walk_t * walk, pgmap_pages_t * pages, const uint64_t * flg,
+        const uint64_t * cnt, long n, uint64_t pfn, pgmap_pages_t * blk)
+{
+    incr_t * incr = walk->incr;
+    unsigned long sums[PAGES_SUM_COMBOS + (1 << PGMAP_COMBO_BITS)];
+    int n_combos = 1 << walk->n_combo;
+    uint16_t * old;
+    uint64_t hash;
+    long m;
+
+    for (long i = 0; i < n; i += m) {
+        m = n - i < INCR_BLOCK ? n - i : INCR_BLOCK;
+        hash = block_hash(cnt + i, m, block_hash(flg + i, m, m));
+        old = incr_lookup(incr, (pfn + i)/INCR_BLOCK, hash);
+        if (old) {
+            pages->pages += old[0];
+            for (int b = 0; b < PGMAP_KPF_BITS; b++)
+                pages->flags[b] += old[PAGES_SUM_FLAGS + b];
+            for (int c = 0; c < PGMAP_MAPCOUNTS; c++)
+                pages->mapcount[c] += old[PAGES_SUM_MAPCOUNT + c];
+            for (int c = 0; c < n_combos; c++)
+                pages->combos[c] += old[PAGES_SUM_COMBOS + c];
+            continue;
+        }
+        blk->pages = 0;
+        memset(blk->flags, 0, sizeof(blk->flags));
+        memset(blk->mapcount, 0, sizeof(blk->mapcount));
+        memset(blk->combos, 0, n_combos*sizeof(unsigned long));
+        count_pages(walk, blk, flg + i, cnt + i, m);
+        sums[0] = blk->pages;
+        memcpy(sums + PAGES_SUM_FLAGS, blk->flags, sizeof(blk->flags));
+        memcpy(sums + PAGES_SUM_MAPCOUNT, blk->mapcount, sizeof(blk->mapcount));
+        memcpy(sums + PAGES_SUM_COMBOS, blk->combos, n_combos*sizeof(unsigned long));
+        incr_store(incr, (pfn + i)/INCR_BLOCK, hash, sums);
+        pages->pages += blk->pages;
+        for (int b = 0; b < PGMAP_KPF_BITS; b++)
+            pages->flags[b] += blk->flags[b];
+        for (int c = 0; c < PGMAP_MAPCOUNTS; c++)
+            pages->mapcount[c] += blk->mapcount[c];
+        for (int c = 0; c < n_combos; c++)
+            pages->combos[c] += blk->combos[c];
+    }
+}
+
+// walk_pages_worker - takes blocks of pfns until the end of kpageflags,
+// pread() keeps threads independent on shared descriptors
+static void * walk_pages_worker(void * arg)
+{
+    pages_worker_t * worker = arg;
+    pages_walk_t * walk = worker->walk;
+    kpagemap_t * kpagemap = walk->table->kpagemap;
+    uint64_t * flg, * cnt;
+    pgmap_pages_t * blk = NULL;
+    uint64_t pfn;
+    long n, c = 0;
+
+    cur_stats = worker->counted ? &worker->stats : NULL;
+    flg = malloc(KPAGE_BLOCK*sizeof(uint64_t));
+    cnt = malloc(KPAGE_BLOCK*sizeof(uint64_t));
+    if (walk->incr)
+        blk = malloc(sizeof(pgmap_pages_t));
+    if (!flg || !cnt || (walk->incr && !blk)) {
+        __atomic_store_n(&walk->error, ERROR, __ATOMIC_RELAXED);
+        __atomic_store_n(&walk->eof, 1, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_load_n(&walk->eof, __ATOMIC_RELAXED)) {
+        pfn = __atomic_fetch_add(&walk->next_block, 1, __ATOMIC_RELAXED)*KPAGE_BLOCK;
+        n = read_kpage_block(walk->table->io, kpagemap->kpgm_flags_fd, flg, pfn, KPAGE_BLOCK);
+        if (n > 0)
+            c = read_kpage_block(walk->table->io, kpagemap->kpgm_count_fd, cnt, pfn, n);
+        if (n < 0 || (n > 0 && c < n))
+            __atomic_store_n(&walk->error, RD_ERROR, __ATOMIC_RELAXED);
+        if (n < KPAGE_BLOCK)
+            __atomic_store_n(&walk->eof, 1, __ATOMIC_RELAXED);
+        if (n <= 0 || c < n)
+            break;
+        if (walk->incr)
+            count_pages_incr(walk, &worker->pages, flg, cnt, n, pfn, blk);
+        else
+            count_pages(walk, &worker->pages, flg, cnt, n);
+    }
+    free(flg);
+    free(cnt);
+    free(blk);
+    return NULL;
+}
+
+static int walk_pages_mem(pagemap_tbl * table, uint64_t combo_mask, pgmap_pages_t * pages)
+{
+    pages_walk_t walk;
+    pages_worker_t * workers;
+    pgmap_stats_t * stats = cur_stats;
+    long n_threads;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.table = table;
+    for (int bit = 0; bit < PGMAP_KPF_BITS; bit++) {
+        if (!((combo_mask >> bit) & 1))
+            continue;
+        if (walk.n_combo == PGMAP_COMBO_BITS)
+            return ERROR;
+        walk.combo_bits[walk.n_combo++] = bit;
+    }
+    walk.incr = incr_prepare(table, &table->kpagemap->incr_pages,
+            PAGES_SUM_COMBOS + (1 << walk.n_combo), combo_mask);
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > PAGES_THREADS)
+        n_threads = PAGES_THREADS;
+    workers = calloc(n_threads, sizeof(pages_worker_t));
+    if (!workers)
+        return ERROR;
+    // blocks are taken dynamically, so threads which failed to start
+    // only leave more work to the others
+    for (long t = 0; t < n_threads; t++) {
+        workers[t].walk = &walk;
+        workers[t].counted = stats != NULL;
+        if (t > 0)
+            workers[t].started = pthread_create(&workers[t].thread, NULL,
+                    walk_pages_worker, &workers[t]) == 0;
+    }
+    walk_pages_worker(&workers[0]);
+    cur_stats = stats;
+    memset(pages, 0, sizeof(*pages));
+    pages->combo_mask = combo_mask;
+    for (long t = 0; t < n_threads; t++) {
+        if (workers[t].started)
+            pthread_join(workers[t].thread, NULL);
+        pages->pages += workers[t].pages.pages;
+        for (int i = 0; i < PGMAP_KPF_BITS; i++)
+            pages->flags[i] += workers[t].pages.flags[i];
+        for (int i = 0; i < PGMAP_MAPCOUNTS; i++)
+            pages->mapcount[i] += workers[t].pages.mapcount[i];
+        for (int i = 0; i < (1 << walk.n_combo); i++)
+            pages->combos[i] += workers[t].pages.combos[i];
+        STAT_ADD(syscalls,workers[t].stats.syscalls);
+        STAT_ADD(bytes_read,workers[t].stats.bytes_read);
+        STAT_ADD(reused_blocks,workers[t].stats.reused_blocks);
+    }
+    free(workers);
+    return walk.error;
+}
+
+/////////// idle page tracking ////////////////////////////
+static int cmp_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// fills sorted array of unique bitmap words (pfn/64) covering selected pids
+static uint64_t * collect_idle_words(pagemap_tbl * table, int pid, unsigned long * count) {
+    pagemap_list * p;
+    proc_mapping * map;
+    uint64_t * words;
+    unsigned long n = 0, u = 0;
+
+    for (p = table->start; p; p = p->next) {
+        if (pid > 0 && p->pid_table.pid != pid)
+            continue;
+        for (map = p->pid_table.mappings; map; map = map->next)
+            n += map->n_pfns;
+    }
+    words = malloc((n ? n : 1)*sizeof(uint64_t));
+    if (!words)
+        return NULL;
+    n = 0;
+    for (p = table->start; p; p = p->next) {
+        if (pid > 0 && p->pid_table.pid != pid)
+            continue;
+        for (map = p->pid_table.mappings; map; map = map->next)
+            for (unsigned long i = 0; i < map->n_pfns; i++)
+                words[n++] = map->pfns[i] >> 6;
+    }
+    qsort(words, n, sizeof(uint64_t), cmp_u64);
+    for (unsigned long i = 0; i < n; i++) {
+        if (u == 0 || words[u-1] != words[i])
+            words[u++] = words[i];
+    }
+    *count = u;
+    return words;
+}
+
+static inline unsigned long find_word(uint64_t * words, unsigned long count, uint64_t word) {
+    unsigned long lo = 0, hi = count;
+
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo)/2;
+        if (words[mid] < word)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// reads or writes bits[] for all words[], consecutive words share one syscall
+static int idle_bitmap_io(int fd, uint64_t * words, uint64_t * bits, unsigned long count, int wr) {
+    unsigned long i = 0, j;
+    ssize_t len;
+
+    while (i < count) {
+        j = i + 1;
+        while (j < count && words[j] == words[j-1] + 1 && j - i < IDLE_RUN)
+            j++;
+        len = (j - i)*sizeof(uint64_t);
+        if (wr) {
+            if (pwrite64(fd, bits + i, len, words[i]*sizeof(uint64_t)) != len)
+                return RD_ERROR;
+        } else {
+            if (pread64(fd, bits + i, len, words[i]*sizeof(uint64_t)) != len)
+                return RD_ERROR;
+        }
+        i = j;
+    }
+    return OK;
+}
+
+static int walk_idle_mem(pagemap_tbl * table, int pid, unsigned int interval) {
+    pagemap_list * p;
+    proc_mapping * map;
+    uint64_t * words, * bits, * marked;
+    unsigned long count, idx;
+    struct timespec ts;
+    int ret = ERROR;
+
+    if (table->kpagemap->idle_fd < 0) {
+        table->kpagemap->idle_fd = open(IDLE_BITMAP, O_RDWR);
+        if (table->kpagemap->idle_fd < 0) {
+            trace("page_idle bitmap open");
+            return ERROR;
+        }
+    }
+    words = collect_idle_words(table, pid, &count);
+    if (!words)
+        return ERROR;
+    bits = calloc(count ? count : 1, sizeof(uint64_t));
+    marked = calloc(count ? count : 1, sizeof(uint64_t));
+    if (!bits || !marked)
+        goto idle_out;
+    // marking - write only bits of our own pages
+    for (p = table->start; p; p = p->next) {
+        if (pid > 0 && p->pid_table.pid != pid)
+            continue;
+        for (map = p->pid_table.mappings; map; map = map->next)
+            for (unsigned long i = 0; i < map->n_pfns; i++) {
+                idx = find_word(words, count, map->pfns[i] >> 6);
+                bits[idx] |= 1ULL << (map->pfns[i] & 63);
+            }
+    }
+    if (idle_bitmap_io(table->kpagemap->idle_fd, words, bits, count, 1) != OK) {
+        trace("page_idle bitmap write");
+        goto idle_out;
+    }
+    // kernel marks only user LRU pages, the others (zero page, isolated or
+    // driver pages) never get idle bit and would look accessed
+    if (idle_bitmap_io(table->kpagemap->idle_fd, words, marked, count, 0) != OK) {
+        trace("page_idle bitmap read");
+        goto idle_out;
+    }
+    ts.tv_sec = interval/1000;
+    ts.tv_nsec = (interval%1000)*1000000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+    if (idle_bitmap_io(table->kpagemap->idle_fd, words, bits, count, 0) != OK) {
+        trace("page_idle bitmap read");
+        goto idle_out;
+    }
+    // still idle bit == page was not touched during interval, pages which
+    // were not marked are not counted
+    for (p = table->start; p; p = p->next) {
+        if (pid > 0 && p->pid_table.pid != pid)
+            continue;
+        p->pid_table.n_hot = 0;
+        p->pid_table.n_cold = 0;
+        for (map = p->pid_table.mappings; map; map = map->next)
+            for (unsigned long i = 0; i < map->n_pfns; i++) {
+                idx = find_word(words, count, map->pfns[i] >> 6);
+                if (!(marked[idx] & (1ULL << (map->pfns[i] & 63))))
+                    continue;
+                if (bits[idx] & (1ULL << (map->pfns[i] & 63)))
+                    p->pid_table.n_cold += 1;
+                else
+                    p->pid_table.n_hot += 1;
+            }
+    }
+    ret = OK;
+idle_out:
+    free(marked);
+    free(bits);
+    free(words);
+    return ret;
+}
+
+/////////// soft-dirty tracking ////////////////////////////
+static int clear_soft_dirty(int pid) {
+    char path[sizeof("/proc/%d/clear_refs") + sizeof(int)*3];
+    int fd;
+
+    sprintf(path,"/proc/%d/clear_refs",pid);
+    fd = open(path,O_WRONLY);
+    if (fd < 0)
+        return ERROR;
+    if (write(fd,CLEAR_SOFT_DIRTY,strlen(CLEAR_SOFT_DIRTY)) < 0) {
+        close(fd);
+        return ERROR;
+    }
+    close(fd);
+    return OK;
+}
+
+// counts pages written since last clear_soft_dirty() per mapping, RD_ERROR
+// when some read failed and counts are partial
+static int walk_dirty_mem(process_pagemap_t * p_t, pagemap_tbl * table) {
+    int pagemap_h, ret = OK;
+    char pagemap_p[sizeof("/proc/%d/pagemap") + sizeof(int)*3];
+    uint64_t * buf = table->kpagemap->pm_buf;
+    uint64_t vpn,last;
+    long got;
+    size_t n;
+
+    sprintf(pagemap_p,"/proc/%d/pagemap",p_t->pid);
+    pagemap_h = io_open(table->io, pagemap_p);
+    if (pagemap_h < 0) {
+        trace("error pagemap open");
+        return ERROR;
+    }
+    p_t->n_sdirty = 0;
+    for (proc_mapping * cur = p_t->mappings; cur != NULL && ret == OK; cur = cur->next) {
+        cur->n_sdirty = 0;
+        vpn = cur->start/table->kpagemap->pagesize;
+        last = cur->end/table->kpagemap->pagesize;
+        while (vpn < last) {
+            n = (last - vpn > PM_CHUNK) ? PM_CHUNK : last - vpn;
+            got = io_read_full(table->io, pagemap_h, buf, n*PM_ENTRY_BYTES, vpn*PM_ENTRY_BYTES);
+            if (got < 0) {
+                ret = RD_ERROR;
+                break;
+            }
+            if (got < (long) PM_ENTRY_BYTES) /* for vsyscall pages */
+                break;
+            n = got/PM_ENTRY_BYTES;
+            vpn += n;
+            for (size_t i = 0; i < n; i++) {
+                if ((buf[i] & PM_SOFT_DIRTY) && (buf[i] & (PM_PRESENT | PM_SWAP)))
+                    cur->n_sdirty += 1;
+            }
+        }
+        p_t->n_sdirty += cur->n_sdirty;
+    }
+    io_close(table->io, pagemap_h);
+    return ret;
+}
+
+// zero_dirty - process without valid interval, its bits were not cleared
+// or it could not be read
+static void zero_dirty(process_pagemap_t * p_t) {
+    p_t->n_sdirty = 0;
+    for (proc_mapping * cur = p_t->mappings; cur != NULL; cur = cur->next)
+        cur->n_sdirty = 0;
+}
+
+static int walk_dirty_procs(pagemap_tbl * table, int pid, unsigned int interval) {
+    pagemap_list * p;
+    struct timespec ts;
+    unsigned long n = 0, i, n_cleared = 0;
+    char * cleared;
+
+    for (p = table->start; p; p = p->next)
+        n++;
+    cleared = calloc(n ? n : 1, sizeof(char));
+    if (!cleared)
+        return ERROR;
+    for (p = table->start, i = 0; p; p = p->next, i++) {
+        if (pid > 0 && p->pid_table.pid != pid)
+            continue;
+        if (clear_soft_dirty(p->pid_table.pid) != OK) {
+            // other user's or exited process, its bits are set since
+            // it was mapped and do not say anything about interval
+            trace("clear_refs error");
+            zero_dirty(&p->pid_table);
+            continue;
+        }
+        cleared[i] = 1;
+        n_cleared++;
+    }
+    if (!n_cleared) {
+        free(cleared);
+        return ERROR;
+    }
+    ts.tv_sec = interval/1000;
+    ts.tv_nsec = (interval%1000)*1000000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+    for (p = table->start, i = 0; p; p = p->next, i++) {
+        if (!cleared[i])
+            continue;
+        if (walk_dirty_mem(&p->pid_table, table) != OK) {
+            trace("walk_dirty_mem error");
+            zero_dirty(&p->pid_table);
+        }
+    }
+    free(cleared);
+    return OK;
+}
+
+/////////// duplicate pages ////////////////////////////
+typedef struct ksm_hash {
+    uint64_t hash;
+    pagemap_list * owner;
+} ksm_hash;
+
+typedef struct ksm_state {
+    ksm_hash * items;
+    unsigned long count;
+    unsigned long size;
+    char * data;                // KSM_CHUNK pages of /proc/[pid]/mem
+    pgmap_ksm_t * total;
+} ksm_state;
+
+// 4 independent lanes, so compiler can keep them in vector registers
+static inline uint64_t hash_page(const uint64_t * page, size_t words, int * zero) {
+    uint64_t h[4] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+                     0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL};
+    uint64_t acc[4] = {0, 0, 0, 0};
+
+    for (size_t i = 0; i < words; i += 4) {
+        for (int l = 0; l < 4; l++) {
+            acc[l] |= page[i+l];
+            h[l] = (h[l] ^ page[i+l])*0x100000001b3ULL;
+            h[l] ^= h[l] >> 29;
+        }
+    }
+    *zero = !(acc[0] | acc[1] | acc[2] | acc[3]);
+    return (h[0] ^ (h[1]*31)) + ((h[2] ^ (h[3]*31)) << 1);
+}
+
+static int cmp_ksm_hash(const void * a, const void * b) {
+    uint64_t x = ((const ksm_hash *) a)->hash;
+    uint64_t y = ((const ksm_hash *) b)->hash;
+    return (x > y) - (x < y);
+}
+
+// only private anonymous memory can be merged by KSM
+static inline int ksm_mergeable(proc_mapping * map) {
+    if ((map->perms & PERM_SHARE) || map->inode)
+        return 0;
+    if (!map->path)
+        return 1;
+    return !strcmp(map->path,"[heap]") || !strncmp(map->path,"[stack",6);
+}
+
+// page must be present and mapped only here, otherwise it is already shared
+static inline int ksm_candidate(pagemap_tbl * table, uint64_t entry) {
+    uint64_t cnt;
+
+    if (!(entry & PM_PRESENT) || (entry & PM_SWAP))
+        return 0;
+    if (table->kpagemap->under_root == 1) {
+        if (get_kpagecount(table, PM_PFRAME(entry), &cnt) != OK)
+            return 0;
+        return cnt == 1;
+    }
+    return (entry & PM_MMAP_EXCLUSIVE) != 0;
+}
+
+static int add_ksm_hash(ksm_state * st, uint64_t hash, pagemap_list * owner) {
+    ksm_hash * tmp;
+    unsigned long size;
+
+    if (st->count == st->size) {
+        size = st->size ? st->size*2 : 4096;
+        tmp = realloc(st->items, size*sizeof(ksm_hash));
+        if (!tmp)
+            return ERROR;
+        st->items = tmp;
+        st->size = size;
+    }
+    st->items[st->count].hash = hash;
+    st->items[st->count].owner = owner;
+    st->count++;
+    return OK;
+}
+
+static int walk_ksm_mem(pagemap_list * p, pagemap_tbl * table, ksm_state * st) {
+    char path[sizeof("/proc/%d/pagemap") + sizeof(int)*3];
+    int pagemap_fd, mem_fd;
+    uint64_t * buf = table->kpagemap->pm_buf;
+    unsigned int pagesize = table->kpagemap->pagesize;
+    uint64_t vpn,last,base;
+    ssize_t got;
+    size_t n, i, j;
+    int zero;
+
+    sprintf(path,"/proc/%d/pagemap",p->pid_table.pid);
+    pagemap_fd = open(path,O_RDONLY);
+    if (pagemap_fd < 0)
+        return ERROR;
+    sprintf(path,"/proc/%d/mem",p->pid_table.pid);
+    mem_fd = open(path,O_RDONLY);
+    if (mem_fd < 0) {
+        close(pagemap_fd);
+        return ERROR;
+    }
+    p->pid_table.n_zero = 0;
+    p->pid_table.n_dup = 0;
+    for (proc_mapping * cur = p->pid_table.mappings; cur != NULL; cur = cur->next) {
+        if (!ksm_mergeable(cur))
+            continue;
+        vpn = cur->start/pagesize;
+        last = cur->end/pagesize;
+        while (vpn < last) {
+            n = (last - vpn > PM_CHUNK) ? PM_CHUNK : last - vpn;
+            got = pread64(pagemap_fd, buf, n*PM_ENTRY_BYTES, vpn*PM_ENTRY_BYTES);
+            if (got < (ssize_t) PM_ENTRY_BYTES)
+                break;
+            n = got/PM_ENTRY_BYTES;
+            base = vpn;
+            vpn += n;
+            // one read of /proc/[pid]/mem for every run of candidate pages
+            for (i = 0; i < n; i = j) {
+                if (!ksm_candidate(table, buf[i])) {
+                    if (buf[i] & PM_PRESENT)
+                        st->total->skipped += 1;
+                    j = i + 1;
+                    continue;
+                }
+                for (j = i + 1; j < n && j - i < KSM_CHUNK && ksm_candidate(table, buf[j]); j++)
+                    ;
+                got = pread64(mem_fd, st->data, (j - i)*pagesize, (base + i)*pagesize);
+                if (got < (ssize_t) pagesize)
+                    continue;
+                for (size_t k = 0; k < got/pagesize; k++) {
+                    uint64_t hash = hash_page((uint64_t *) (st->data + k*pagesize),
+                            pagesize/sizeof(uint64_t), &zero);
+                    st->total->scanned += 1;
+                    if (zero) {
+                        p->pid_table.n_zero += 1;
+                        st->total->zero += 1;
+                    } else if (add_ksm_hash(st, hash, p) != OK) {
+                        close(mem_fd);
+                        close(pagemap_fd);
+                        return ERROR;
+                    }
+                }
+            }
+        }
+    }
+    close(mem_fd);
+    close(pagemap_fd);
+    return OK;
+}
+
+static int walk_ksm_procs(pagemap_tbl * table, int pid, pgmap_ksm_t * total) {
+    ksm_state st;
+    pagemap_list * p;
+    unsigned long i, j;
+
+    memset(&st, '\0', sizeof(st));
+    memset(total, '\0', sizeof(*total));
+    st.total = total;
+    st.data = malloc(KSM_CHUNK*table->kpagemap->pagesize);
+    if (!st.data)
+        return ERROR;
+    reset_pos(table);
+    while ((p = pid_iter(table))) {
+        if (pid > 0 && p->pid_table.pid != pid)
+            continue;
+        if (walk_ksm_mem(p, table, &st) != OK)
+            trace("walk_ksm_mem error");
+    }
+    // the first page of every group of equal hashes stays, the rest is saved
+    qsort(st.items, st.count, sizeof(ksm_hash), cmp_ksm_hash);
+    for (i = 0; i < st.count; i = j) {
+        for (j = i + 1; j < st.count && st.items[j].hash == st.items[i].hash; j++) {
+            st.items[j].owner->pid_table.n_dup += 1;
+            total->dup += 1;
+        }
+    }
+    free(st.items);
+    free(st.data);
+    return OK;
+}
+
+/////////// snapshots ////////////////////////////
+static int cmp_pid_ptr(const void * a, const void * b) {
+    const process_pagemap_t * x = *(process_pagemap_t * const *) a;
+    const process_pagemap_t * y = *(process_pagemap_t * const *) b;
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static int write_zeros(FILE * f, uint64_t pos) {
+    while (pos % 8) {
+        if (fputc(0, f) == EOF)
+            return ERROR;
+        pos++;
+    }
+    return OK;
+}
+
+// computes header of snapshot of table, rows are its processes sorted by
+// pid - caller frees them
+static process_pagemap_t ** snap_layout(pagemap_tbl * table, int sections, pgmap_snap_hdr * hdr) {
+    process_pagemap_t ** rows;
+    pagemap_list * p;
+    proc_mapping * map;
+    uint64_t strs = 1, n = 0;
+
+    if (!(sections & PGMAP_SNAP_VMAS))
+        sections &= ~PGMAP_SNAP_PFNS;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, PGMAP_SNAP_MAGIC, sizeof(hdr->magic));
+    hdr->version = PGMAP_SNAP_VERSION;
+    hdr->pagesize = table->kpagemap->pagesize;
+    hdr->time = time(NULL);
+    hdr->ram_pages = table->kpagemap->phys_p_count;
+    hdr->n_cols = PGMAP_COLS;
+    hdr->sections = sections;
+    for (p = table->start; p; p = p->next) {
+        n++;
+        for (map = p->pid_table.mappings; map; map = map->next) {
+            hdr->n_vmas++;
+            hdr->n_pfns += map->n_pfns;
+            if (map->path)
+                strs += strlen(map->path) + 1;
+        }
+    }
+    if (!(sections & PGMAP_SNAP_VMAS)) {
+        hdr->n_vmas = 0;
+        strs = 0;
+    }
+    if (!(sections & PGMAP_SNAP_PFNS))
+        hdr->n_pfns = 0;
+    hdr->n_procs = n;
+    hdr->off_cols = SNAP_ALIGN(sizeof(*hdr));
+    hdr->off_cmds = SNAP_ALIGN(hdr->off_cols + hdr->n_cols*n*sizeof(uint32_t));
+    hdr->off_vmas = SNAP_ALIGN(hdr->off_cmds + n*SMALLBUF);
+    hdr->off_strs = hdr->off_vmas + hdr->n_vmas*sizeof(pgmap_snap_vma);
+    hdr->off_pfns = SNAP_ALIGN(hdr->off_strs + strs);
+    hdr->off_starts = hdr->off_pfns + hdr->n_pfns*sizeof(uint64_t);
+    hdr->size = hdr->off_starts + n*sizeof(uint64_t);
+
+    // rows sorted by pid, so snapshots can be merged by pid
+    rows = malloc((n ? n : 1)*sizeof(process_pagemap_t *));
+    if (!rows)
+        return NULL;
+    n = 0;
+    for (p = table->start; p; p = p->next)
+        rows[n++] = &p->pid_table;
+    qsort(rows, n, sizeof(process_pagemap_t *), cmp_pid_ptr);
+    return rows;
+}
+
+// writes snapshot laid out by snap_layout() into f
+static int write_snap_stream(FILE * f, pgmap_snap_hdr * hdr, process_pagemap_t ** rows) {
+    pgmap_snap_vma vma;
+    proc_mapping * map;
+    uint32_t * col;
+    uint64_t strs, pfn_first = 0, n = hdr->n_procs;
+    int ret = ERROR;
+
+    col = malloc((n ? n : 1)*sizeof(uint32_t));
+    if (!col)
+        return ERROR;
+    if (fwrite(hdr, sizeof(*hdr), 1, f) != 1 || write_zeros(f, sizeof(*hdr)) != OK)
+        goto stream_out;
+    for (int c = 0; c < PGMAP_COLS; c++) {
+        for (uint64_t r = 0; r < n; r++)
+            col[r] = COL_VALUE(rows[r], c);
+        if (n && fwrite(col, sizeof(uint32_t), n, f) != n)
+            goto stream_out;
+    }
+    if (write_zeros(f, hdr->off_cols + hdr->n_cols*n*sizeof(uint32_t)) != OK)
+        goto stream_out;
+    for (uint64_t r = 0; r < n; r++)
+        if (fwrite(rows[r]->cmdline, SMALLBUF, 1, f) != 1)
+            goto stream_out;
+    if (hdr->sections & PGMAP_SNAP_VMAS) {
+        strs = 1;
+        for (uint64_t r = 0; r < n; r++) {
+            for (map = rows[r]->mappings; map; map = map->next) {
+                memset(&vma, 0, sizeof(vma));
+                vma.start = map->start;
+                vma.end = map->end;
+                vma.offset = map->offset;
+                vma.inode = map->inode;
+                vma.n_sdirty = map->n_sdirty;
+                vma.proc = r;
+                vma.perms = map->perms;
+                if (hdr->sections & PGMAP_SNAP_PFNS) {
+                    vma.pfn_first = pfn_first;
+                    vma.n_pfns = map->n_pfns;
+                    pfn_first += map->n_pfns;
+                }
+                if (map->path) {
+                    vma.path = strs;
+                    strs += strlen(map->path) + 1;
+                }
+                if (fwrite(&vma, sizeof(vma), 1, f) != 1)
+                    goto stream_out;
+            }
+        }
+        if (fputc(0, f) == EOF)
+            goto stream_out;
+        for (uint64_t r = 0; r < n; r++)
+            for (map = rows[r]->mappings; map; map = map->next)
+                if (map->path && fwrite(map->path, strlen(map->path) + 1, 1, f) != 1)
+                    goto stream_out;
+        if (write_zeros(f, hdr->off_strs + strs) != OK)
+            goto stream_out;
+    }
+    if (hdr->sections & PGMAP_SNAP_PFNS) {
+        for (uint64_t r = 0; r < n; r++)
+            for (map = rows[r]->mappings; map; map = map->next)
+                for (unsigned long i = 0; i < map->n_pfns; i++) {
+                    uint64_t pfn = map->pfns[i];
+                    if (fwrite(&pfn, sizeof(pfn), 1, f) != 1)
+                        goto stream_out;
+                }
+    }
+    for (uint64_t r = 0; r < n; r++) {
+        uint64_t start = rows[r]->starttime;
+        if (fwrite(&start, sizeof(start), 1, f) != 1)
+            goto stream_out;
+    }
+    ret = OK;
+stream_out:
+    free(col);
+    return ret;
+}
+
+static int write_snapshot(pagemap_tbl * table, const char * path, int sections) {
+    pgmap_snap_hdr hdr;
+    process_pagemap_t ** rows;
+    char * tmp_path;
+    FILE * f;
+    int ret = ERROR;
+
+    rows = snap_layout(table, sections, &hdr);
+    tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (!rows || !tmp_path)
+        goto snap_out;
+
+    // written aside and renamed, readers never see half of snapshot
+    sprintf(tmp_path, "%s.tmp", path);
+    f = fopen(tmp_path, "wb");
+    if (!f)
+        goto snap_out;
+    if (write_snap_stream(f, &hdr, rows) != OK) {
+        fclose(f);
+        unlink(tmp_path);
+        goto snap_out;
+    }
+    if (fclose(f) != 0) {
+        unlink(tmp_path);
+        goto snap_out;
+    }
+    if (rename(tmp_path, path) == 0)
+        ret = OK;
+    else
+        unlink(tmp_path);
+snap_out:
+    free(tmp_path);
+    free(rows);
+    return ret;
+}
+
+// every section must lie inside of mapped file
+// check_snapshot - sections of hdr lie in len bytes of base, header fields
+// come from file so sizes are checked by division, not by sums which wrap
+static int check_snapshot(const pgmap_snap_hdr * hdr, const char * base, uint64_t len) {
+    const pgmap_snap_vma * vmas;
+
+    if (len < sizeof(pgmap_snap_hdr) || memcmp(hdr->magic, PGMAP_SNAP_MAGIC, sizeof(hdr->magic)))
+        return ERROR;
+    if (hdr->version > PGMAP_SNAP_VERSION || hdr->size > len)
+        return ERROR;
+    if (hdr->off_cols % 4 || hdr->off_cols > len ||
+            (hdr->n_procs && hdr->n_cols > (len - hdr->off_cols)/sizeof(uint32_t)/hdr->n_procs))
+        return ERROR;
+    if (hdr->off_cmds > len || hdr->n_procs > (len - hdr->off_cmds)/SMALLBUF)
+        return ERROR;
+    if (hdr->off_vmas % 8 || hdr->off_vmas > len || hdr->n_vmas > (len - hdr->off_vmas)/sizeof(pgmap_snap_vma))
+        return ERROR;
+    if (hdr->off_pfns % 8 || hdr->off_pfns > len || hdr->n_pfns > (len - hdr->off_pfns)/sizeof(uint64_t))
+        return ERROR;
+    // strings lie before pfns, the last one ends the section by NUL
+    if (hdr->off_strs > hdr->off_pfns ||
+            (hdr->n_vmas && (hdr->off_strs == hdr->off_pfns || base[hdr->off_pfns - 1] != '\0')))
+        return ERROR;
+    if (hdr->version >= 2 && (hdr->off_starts % 8 || hdr->off_starts > len ||
+                hdr->n_procs > (len - hdr->off_starts)/sizeof(uint64_t)))
+        return ERROR;
+    // snap_vma_range() searches mappings by proc
+    vmas = (const pgmap_snap_vma *) (base + hdr->off_vmas);
+    for (uint64_t i = 0; i < hdr->n_vmas; i++) {
+        if (vmas[i].proc >= hdr->n_procs || (i && vmas[i].proc < vmas[i - 1].proc))
+            return ERROR;
+    }
+    return OK;
+}
+
+/////////// shared memory ////////////////////////////
+#define SHM_ALIGN(x, page)  (((x) + (page) - 1) & ~((uint64_t) (page) - 1))
+
+// shm_open() wants name starting by slash
+static char * shm_name(const char * name) {
+    char * ret = malloc(strlen(name) + 2);
+
+    if (ret)
+        sprintf(ret, "%s%s", name[0] == '/' ? "" : "/", name);
+    return ret;
+}
+
+static void shm_unpublish(shm_pub_t * pub) {
+    if (!pub)
+        return;
+    munmap(pub->base, pub->len);
+    close(pub->fd);
+    shm_unlink(pub->name);
+    free(pub->name);
+    free(pub);
+}
+
+static shm_pub_t * shm_create(const char * name, long pagesize) {
+    shm_pub_t * pub;
+    pgmap_shm_hdr * sh;
+
+    pub = calloc(1, sizeof(shm_pub_t));
+    if (!pub)
+        return NULL;
+    pub->name = shm_name(name);
+    if (!pub->name)
+        goto create_err;
+    pub->fd = shm_open(pub->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (pub->fd < 0)
+        goto create_err;
+    pub->len = SHM_ALIGN(sizeof(pgmap_shm_hdr), pagesize);
+    if (ftruncate(pub->fd, pub->len) != 0)
+        goto unlink_err;
+    pub->base = mmap(NULL, pub->len, PROT_READ | PROT_WRITE, MAP_SHARED, pub->fd, 0);
+    if (pub->base == MAP_FAILED)
+        goto unlink_err;
+    sh = pub->base;
+    memcpy(sh->magic, PGMAP_SHM_MAGIC, sizeof(sh->magic));
+    sh->version = PGMAP_SHM_VERSION;
+    return pub;
+unlink_err:
+    close(pub->fd);
+    shm_unlink(pub->name);
+create_err:
+    free(pub->name);
+    free(pub);
+    return NULL;
+}
+
+// seqlock writer of slot which is not current, segment only grows so
+// readers' mappings stay valid
+static int shm_publish(shm_pub_t * pub, pagemap_tbl * table, int sections) {
+    pgmap_shm_hdr * sh = pub->base;
+    pgmap_snap_hdr hdr;
+    process_pagemap_t ** rows;
+    long pagesize = table->kpagemap->pagesize;
+    uint64_t off, cap;
+    void * base;
+    FILE * f;
+    int s, ret = ERROR;
+
+    rows = snap_layout(table, sections, &hdr);
+    if (!rows)
+        return ERROR;
+    s = !(sh->gen & 1);
+    __atomic_store_n(&sh->seq[s], sh->seq[s] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (sh->cap[s] < hdr.size) {
+        off = pub->len;
+        cap = SHM_ALIGN(hdr.size + hdr.size/2, pagesize);
+        if (ftruncate(pub->fd, off + cap) != 0)
+            goto publish_out;
+        base = mremap(pub->base, pub->len, off + cap, MREMAP_MAYMOVE);
+        if (base == MAP_FAILED)
+            goto publish_out;
+        pub->base = sh = base;
+        pub->len = off + cap;
+        sh->off[s] = off;
+        sh->cap[s] = cap;
+    }
+    sh->len[s] = 0;
+    f = fmemopen((char *) pub->base + sh->off[s], sh->cap[s], "w");
+    if (!f)
+        goto publish_out;
+    if (write_snap_stream(f, &hdr, rows) == OK && fclose(f) == 0) {
+        sh->len[s] = hdr.size;
+        ret = OK;
+    }
+    else
+        fclose(f);
+publish_out:
+    __atomic_store_n(&sh->seq[s], sh->seq[s] + 1, __ATOMIC_RELEASE);
+    if (ret == OK)
+        __atomic_store_n(&sh->gen, sh->gen + 1, __ATOMIC_RELEASE);
+    free(rows);
+    return ret;
+}
+
+// follows growth of segment
+static int shm_remap(pgmap_shm * shm) {
+    struct stat st;
+    void * base;
+
+    if (fstat(shm->fd, &st) != 0 || (size_t) st.st_size < shm->len)
+        return ERROR;
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, shm->fd, 0);
+    if (base == MAP_FAILED)
+        return ERROR;
+    munmap(shm->base, shm->len);
+    shm->base = base;
+    shm->len = st.st_size;
+    return OK;
+}
+
+#define SHM_RETRIES     100
+
+// seqlock reader - slot is pinned when its header was copied without
+// concurrent write
+static pgmap_snap * shm_pin(pgmap_shm * shm) {
+    pgmap_shm_hdr * sh;
+    uint64_t gen, seq, off, len;
+    int s;
+
+    shm->slot = -1;
+    for (int i = 0; i < SHM_RETRIES; i++) {
+        sh = shm->base;
+        gen = __atomic_load_n(&sh->gen, __ATOMIC_ACQUIRE);
+        s = gen & 1;
+        seq = __atomic_load_n(&sh->seq[s], __ATOMIC_ACQUIRE);
+        off = sh->off[s];
+        len = sh->len[s];
+        if (!gen || !len)
+            return NULL;
+        if (seq & 1)
+            continue;
+        if (off + len > shm->len) {
+            if (shm_remap(shm) != OK)
+                return NULL;
+            continue;
+        }
+        memcpy(&shm->hdr, (char *) shm->base + off, sizeof(pgmap_snap_hdr));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->seq[s], __ATOMIC_RELAXED) != seq)
+            continue;
+        if (check_snapshot(&shm->hdr, (char *) shm->base + off, len) != OK)
+            return NULL;
+        shm->slot = s;
+        shm->seq = seq;
+        shm->row = 0;
+        shm->snap.base = (char *) shm->base + off;
+        shm->snap.len = len;
+        shm->snap.hdr = &shm->hdr;
+        return &shm->snap;
+    }
+    return NULL;
+}
+
+static int shm_check(pgmap_shm * shm) {
+    pgmap_shm_hdr * sh = shm->base;
+
+    if (shm->slot < 0)
+        return ERROR;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&sh->seq[shm->slot], __ATOMIC_RELAXED) != shm->seq)
+        return ERROR;
+    return OK;
+}
+
+/////////// diffs ////////////////////////////
+// arg points to sort column, negative -(col+1) for ascending order
+static int cmp_diff(const void * x, const void * y, void * arg) {
+    const pgmap_diff_t * d1 = x;
+    const pgmap_diff_t * d2 = y;
+    int sort_col = *(int *) arg;
+    int col = sort_col < 0 ? -sort_col - 1 : sort_col;
+    int ret = (d1->delta[col] < d2->delta[col]) - (d1->delta[col] > d2->delta[col]);
+
+    if (sort_col < 0)
+        ret = -ret;
+    if (!ret)
+        ret = (d1->pid > d2->pid) - (d1->pid < d2->pid);
+    return ret;
+}
+
+static inline uint64_t snap_start(const uint64_t * starts, long row) {
+    return starts ? starts[row] : 0;
+}
+
+// order of rows by pid and start time, unknown start (0 of older files or
+// of failed stat read) matches any, so such rows are matched by pid alone
+static inline int cmp_snap_row(int pid_a, uint64_t start_a, int pid_b, uint64_t start_b) {
+    if (pid_a != pid_b)
+        return (pid_a > pid_b) - (pid_a < pid_b);
+    if (!start_a || !start_b)
+        return 0;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+// merge join of two pid sorted snapshots, rows with different start time
+// are different processes (reused pid)
+static pgmap_diff_t * diff_snapshots(pgmap_snap * a, pgmap_snap * b, int sort_col, unsigned long * count) {
+    const uint32_t * cols_a[PGMAP_COLS], * cols_b[PGMAP_COLS];
+    const uint64_t * st_a = get_snap_starts(a), * st_b = get_snap_starts(b);
+    uint64_t n_a = a->hdr->n_procs, n_b = b->hdr->n_procs;
+    pgmap_diff_t * res, * d;
+    uint64_t i = 0, j = 0;
+    unsigned long n = 0;
+    int changed, ord;
+
+    for (int c = 0; c < PGMAP_COLS; c++) {
+        cols_a[c] = get_snap_column(a, c);
+        cols_b[c] = get_snap_column(b, c);
+    }
+    if (!cols_a[PGMAP_COL_pid] || !cols_b[PGMAP_COL_pid])
+        return NULL;
+    res = malloc((n_a + n_b + 1)*sizeof(pgmap_diff_t));
+    if (!res)
+        return NULL;
+    while (i < n_a || j < n_b) {
+        d = &res[n];
+        memset(d, 0, sizeof(*d));
+        if (j >= n_b)
+            ord = -1;
+        else if (i >= n_a)
+            ord = 1;
+        else
+            ord = cmp_snap_row(cols_a[PGMAP_COL_pid][i], snap_start(st_a, i),
+                    cols_b[PGMAP_COL_pid][j], snap_start(st_b, j));
+        if (ord < 0) {
+            d->status = PGMAP_DIFF_GONE;
+            d->pid = cols_a[PGMAP_COL_pid][i];
+            d->row_a = i++;
+            d->row_b = -1;
+        } else if (ord > 0) {
+            d->status = PGMAP_DIFF_NEW;
+            d->pid = cols_b[PGMAP_COL_pid][j];
+            d->row_a = -1;
+            d->row_b = j++;
+        } else {
+            d->status = PGMAP_DIFF_BOTH;
+            d->pid = cols_a[PGMAP_COL_pid][i];
+            d->row_a = i++;
+            d->row_b = j++;
+        }
+        changed = d->status != PGMAP_DIFF_BOTH;
+        for (int c = PGMAP_COL_pid + 1; c < PGMAP_COLS; c++) {
+            int64_t va = (d->row_a >= 0 && cols_a[c]) ? cols_a[c][d->row_a] : 0;
+            int64_t vb = (d->row_b >= 0 && cols_b[c]) ? cols_b[c][d->row_b] : 0;
+            d->delta[c] = vb - va;
+            changed |= d->delta[c] != 0;
+        }
+        if (changed)
+            n++;
+    }
+    if (sort_col >= PGMAP_COLS || sort_col < -PGMAP_COLS)
+        sort_col = PGMAP_COL_res;
+    qsort_r(res, n, sizeof(pgmap_diff_t), cmp_diff, &sort_col);
+    *count = n;
+    return res;
+}
+
+// first and past-the-end index of mappings of row
+static void snap_vma_range(pgmap_snap * snap, long row, unsigned long * first, unsigned long * last) {
+    const pgmap_snap_vma * vmas;
+    unsigned long count, lo = 0, hi;
+
+    *first = *last = 0;
+    vmas = get_snap_vmas(snap, &count);
+    if (!vmas || row < 0)
+        return;
+    hi = count;
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo)/2;
+        if (vmas[mid].proc < (uint32_t) row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *first = lo;
+    while (lo < count && vmas[lo].proc == (uint32_t) row)
+        lo++;
+    *last = lo;
+}
+
+static inline void vma_delta(pgmap_vma_diff_t * d, const pgmap_snap_vma * va,
+        const pgmap_snap_vma * vb, unsigned int pagesize) {
+    d->d_size = (int64_t) (vb ? (vb->end - vb->start)/pagesize : 0) -
+        (int64_t) (va ? (va->end - va->start)/pagesize : 0);
+    d->d_res = (int64_t) (vb ? vb->n_pfns : 0) - (int64_t) (va ? va->n_pfns : 0);
+    d->d_sdirty = (int64_t) (vb ? vb->n_sdirty : 0) - (int64_t) (va ? va->n_sdirty : 0);
+}
+
+// mappings are sorted by address in both snapshots - merge by start, the
+// rest is matched by same file and offset (e.g. remapped library)
+static pgmap_vma_diff_t * diff_vmas(pgmap_snap * a, long row_a, pgmap_snap * b, long row_b, unsigned long * count) {
+    const pgmap_snap_vma * va, * vb;
+    unsigned long fa, la, fb, lb, i, j, n = 0;
+    unsigned long dummy;
+    pgmap_vma_diff_t * res, * d;
+
+    va = get_snap_vmas(a, &dummy);
+    vb = get_snap_vmas(b, &dummy);
+    if (!va || !vb)
+        return NULL;
+    snap_vma_range(a, row_a, &fa, &la);
+    snap_vma_range(b, row_b, &fb, &lb);
+    res = malloc((la - fa + lb - fb + 1)*sizeof(pgmap_vma_diff_t));
+    if (!res)
+        return NULL;
+    i = fa;
+    j = fb;
+    while (i < la || j < lb) {
+        d = &res[n];
+        memset(d, 0, sizeof(*d));
+        if (i < la && j < lb && (va[i].start == vb[j].start ||
+                    (va[i].inode && va[i].inode == vb[j].inode && va[i].offset == vb[j].offset))) {
+            d->status = PGMAP_DIFF_BOTH;
+            d->vma_a = i;
+            d->vma_b = j;
+            vma_delta(d, &va[i++], &vb[j++], b->hdr->pagesize);
+        } else if (j >= lb || (i < la && va[i].start < vb[j].start)) {
+            d->status = PGMAP_DIFF_GONE;
+            d->vma_a = i;
+            d->vma_b = -1;
+            vma_delta(d, &va[i++], NULL, a->hdr->pagesize);
+        } else {
+            d->status = PGMAP_DIFF_NEW;
+            d->vma_a = -1;
+            d->vma_b = j;
+            vma_delta(d, NULL, &vb[j++], b->hdr->pagesize);
+        }
+        if (d->status != PGMAP_DIFF_BOTH || d->d_size || d->d_res || d->d_sdirty)
+            n++;
+    }
+    *count = n;
+    return res;
+}
+
+/////////// time series ring ////////////////////////////
+// record = varint(time delta), varint(mask of changed columns) and
+// zigzag varint of change of every column in mask
+static inline unsigned int put_varint(unsigned char * buf, uint64_t v) {
+    unsigned int n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+static inline uint64_t get_ring_varint(ring_proc * rp, unsigned int size, unsigned int * pos) {
+    uint64_t v = 0;
+    unsigned char c;
+    int shift = 0;
+
+    do {
+        c = rp->data[*pos];
+        *pos = (*pos + 1) % size;
+        v |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static unsigned int encode_sample(unsigned char * buf, ring_proc * rp, uint64_t time, const uint32_t * values) {
+    uint64_t mask = 0;
+    unsigned int n;
+
+    for (int c = 0; c < PGMAP_COLS; c++)
+        if (values[c] != rp->last[c])
+            mask |= 1ULL << c;
+    n = put_varint(buf, time - rp->last_time);
+    n += put_varint(buf + n, mask);
+    for (int c = 0; c < PGMAP_COLS; c++)
+        if (mask & (1ULL << c))
+            n += put_varint(buf + n, zigzag((int64_t) values[c] - rp->last[c]));
+    return n;
+}
+
+// applies record at *pos to time/values and moves *pos behind it
+static void decode_sample(ring_proc * rp, unsigned int size, unsigned int * pos, uint64_t * time, uint32_t * values) {
+    uint64_t mask;
+
+    *time += get_ring_varint(rp, size, pos);
+    mask = get_ring_varint(rp, size, pos);
+    for (int c = 0; c < PGMAP_COLS; c++)
+        if (mask & (1ULL << c))
+            values[c] += unzigzag(get_ring_varint(rp, size, pos));
+}
+
+static int ring_add(ring_proc * rp, unsigned int size, uint64_t time, const uint32_t * values) {
+    unsigned char rec[RING_REC_MAX];
+    unsigned int len, pos;
+
+    if (!rp->samples) {
+        rp->base_time = rp->last_time = time;
+        memcpy(rp->base, values, sizeof(rp->base));
+        memcpy(rp->last, values, sizeof(rp->last));
+        rp->samples = 1;
+        return OK;
+    }
+    len = encode_sample(rec, rp, time, values);
+    if (len > size)
+        return ERROR;
+    // the oldest records are folded into base until new one fits
+    while (rp->used + len > size) {
+        pos = rp->head;
+        decode_sample(rp, size, &pos, &rp->base_time, rp->base);
+        rp->used -= (pos + size - rp->head) % size ? (pos + size - rp->head) % size : size;
+        rp->head = pos;
+        rp->samples--;
+    }
+    pos = (rp->head + rp->used) % size;
+    for (unsigned int i = 0; i < len; i++)
+        rp->data[(pos + i) % size] = rec[i];
+    rp->used += len;
+    rp->samples++;
+    rp->last_time = time;
+    memcpy(rp->last, values, sizeof(rp->last));
+    return OK;
+}
+
+static int cmp_ring_proc(const void * a, const void * b) {
+    const ring_proc * x = a;
+    const ring_proc * y = b;
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+// merge of pid sorted table with pid sorted history, histories of gone
+// processes are dropped
+static int ring_sample(pgmap_ring * ring, pagemap_tbl * table, uint64_t time) {
+    ring_proc * procs, * rp;
+    pagemap_list * p;
+    unsigned long n = 0, i = 0, j;
+    uint32_t values[PGMAP_COLS];
+    uint64_t start;
+
+    for (p = table->start; p; p = p->next)
+        n++;
+    procs = calloc(n ? n : 1, sizeof(ring_proc));
+    if (!procs)
+        return ERROR;
+    n = 0;
+    for (p = table->start; p; p = p->next) {
+        procs[n].pid = p->pid_table.pid;
+        procs[n].start = p->pid_table.starttime;
+        n++;
+    }
+    qsort(procs, n, sizeof(ring_proc), cmp_ring_proc);
+    for (j = 0; j < n; j++) {
+        rp = &procs[j];
+        while (i < ring->count && ring->procs[i].pid < rp->pid)
+            free(ring->procs[i++].data);
+        if (i < ring->count && cmp_snap_row(ring->procs[i].pid, ring->procs[i].start,
+                    rp->pid, rp->start) == 0) {
+            // unknown start of either sample is taken from the other one
+            start = rp->start ? rp->start : ring->procs[i].start;
+            *rp = ring->procs[i++];
+            rp->start = start;
+        } else {
+            rp->data = malloc(ring->size);
+            if (!rp->data)
+                goto ring_err;
+        }
+    }
+    while (i < ring->count)
+        free(ring->procs[i++].data);
+    free(ring->procs);
+    ring->procs = procs;
+    ring->count = n;
+    for (p = table->start; p; p = p->next) {
+        ring_proc key;
+        key.pid = p->pid_table.pid;
+        rp = bsearch(&key, procs, n, sizeof(ring_proc), cmp_ring_proc);
+        if (!rp)
+            continue;
+        for (int c = 0; c < PGMAP_COLS; c++)
+            values[c] = COL_VALUE(&p->pid_table, c);
+        ring_add(rp, ring->size, time, values);
+    }
+    return OK;
+ring_err:
+    // already moved histories stay valid in procs, the rest is in ring
+    for (unsigned long k = 0; k < j; k++)
+        free(procs[k].data);
+    while (i < ring->count)
+        free(ring->procs[i++].data);
+    free(ring->procs);
+    free(procs);
+    ring->procs = NULL;
+    ring->count = 0;
+    return ERROR;
+}
+
+/////////// record and replay ////////////////////////////
+/*
+ * Recording is one file, all offsets are from its start:
+ *   io_rec_hdr
+ *   data blocks, every at most IO_BLOCK bytes long
+ *   for every file its path, block offsets and extents
+ *   io_rec_file items sorted by path
+ *   pids
+ * Items are 8 bytes aligned, so mapped recording is read in place.
+ */
+#define IO_REC_MAGIC    "PGMAPIO"
+#define IO_REC_VERSION  1
+#define IO_BLOCK        4096    // zero blocks are not stored
+
+typedef struct io_rec_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t pagesize;
+    uint64_t n_files;
+    uint64_t off_files;
+    uint64_t n_pids;
+    uint64_t off_pids;      // int32_t items
+} io_rec_hdr;
+
+typedef struct io_rec_file {
+    uint64_t off_path;      // '\0' terminated
+    uint32_t path_len;
+    int32_t err;            // errno of failed open, 0 = opened
+    uint64_t n_ext;
+    uint64_t off_ext;       // io_rec_ext items sorted by off, not overlapping
+} io_rec_file;
+
+typedef struct io_rec_ext {
+    uint64_t off;           // recorded range of file
+    uint64_t len;
+    uint64_t off_blocks;    // uint64_t offsets of its blocks, 0 = zero block
+} io_rec_ext;
+
+// read of recorded file, adjacent reads are joined
+typedef struct rec_extent {
+    uint64_t off;
+    uint64_t len;
+    uint64_t size;
+    unsigned long seq;      // order of reads
+    unsigned char * data;
+} rec_extent;
+
+typedef struct rec_file {
+    char * path;
+    int err;                // errno of open while it never succeeded
+    int opened;
+    rec_extent * ext;
+    unsigned long n_ext;
+    unsigned long size_ext;
+} rec_file;
+
+typedef struct rec_handle {
+    int fd;                 // -1 = closed
+    unsigned long file;     // index of files
+} rec_handle;
+
+typedef struct rec_ctx {
+    char * out;             // path of recording
+    pthread_mutex_t lock;
+    rec_file * files;
+    unsigned long n_files;
+    unsigned long size_files;
+    rec_handle * handles;
+    unsigned long n_handles;
+    unsigned long size_handles;
+    int * pids;             // of first listing
+    int n_pids;
+} rec_ctx;
+
+// recording being written
+typedef struct rec_writer {
+    FILE * f;
+    uint64_t pos;
+    uint64_t * blocks;      // of current file
+    unsigned long n_blocks;
+    unsigned long size_blocks;
+    io_rec_ext * ext;       // off_blocks is index to blocks until written
+    unsigned long n_ext;
+    unsigned long size_ext;
+} rec_writer;
+
+typedef struct replay_ctx {
+    void * base;
+    size_t len;
+    io_rec_hdr * hdr;
+    io_rec_file * files;
+} replay_ctx;
+
+static long rec_find_file(rec_ctx * rec, const char * path) {
+    for (unsigned long i = rec->n_files; i > 0; i--)
+        if (!strcmp(rec->files[i - 1].path, path))
+            return i - 1;
+    if (grow_array((void **) &rec->files, &rec->size_files, rec->n_files, sizeof(rec_file)) != OK)
+        return -1;
+    memset(&rec->files[rec->n_files], 0, sizeof(rec_file));
+    rec->files[rec->n_files].path = strdup(path);
+    if (!rec->files[rec->n_files].path)
+        return -1;
+    return rec->n_files++;
+}
+
+static int rec_open(void * ctx, const char * path) {
+    rec_ctx * rec = ctx;
+    long file;
+    int fd, err, h = -1;
+
+    fd = open(path, O_RDONLY);
+    err = errno;
+    pthread_mutex_lock(&rec->lock);
+    file = rec_find_file(rec, path);
+    if (file < 0 || fd < 0) {
+        if (file >= 0 && !rec->files[file].opened)
+            rec->files[file].err = err;
+        goto open_out;
+    }
+    if (grow_array((void **) &rec->handles, &rec->size_handles, rec->n_handles, sizeof(rec_handle)) != OK)
+        goto open_out;
+    rec->files[file].opened = 1;
+    rec->files[file].err = 0;
+    h = rec->n_handles++;
+    rec->handles[h].fd = fd;
+    rec->handles[h].file = file;
+open_out:
+    pthread_mutex_unlock(&rec->lock);
+    if (h < 0 && fd >= 0) {
+        close(fd);
+        err = ENOMEM;
+    }
+    errno = err;
+    return h;
+}
+
+// rec_add - keeps copy of read data, reads right after previous one extend it
+static int rec_add(rec_file * file, uint64_t off, const void * data, uint64_t len) {
+    rec_extent * last = file->n_ext ? &file->ext[file->n_ext - 1] : NULL;
+    unsigned char * tmp;
+
+    if (!last || last->off + last->len != off) {
+        if (grow_array((void **) &file->ext, &file->size_ext, file->n_ext, sizeof(rec_extent)) != OK)
+            return ERROR;
+        last = &file->ext[file->n_ext];
+        memset(last, 0, sizeof(*last));
+        last->off = off;
+        last->seq = file->n_ext++;
+    }
+    if (last->len + len > last->size) {
+        tmp = realloc(last->data, 2*(last->len + len));
+        if (!tmp)
+            return ERROR;
+        last->data = tmp;
+        last->size = 2*(last->len + len);
+    }
+    memcpy(last->data + last->len, data, len);
+    last->len += len;
+    return OK;
+}
+
+static long rec_pread(void * ctx, int h, void * buf, unsigned long len, uint64_t off) {
+    rec_ctx * rec = ctx;
+    int fd;
+    long got;
+
+    pthread_mutex_lock(&rec->lock);
+    fd = rec->handles[h].fd;
+    pthread_mutex_unlock(&rec->lock);
+    got = pread64(fd, buf, len, off);
+    if (got <= 0)
+        return got;
+    pthread_mutex_lock(&rec->lock);
+    if (rec_add(&rec->files[rec->handles[h].file], off, buf, got) != OK) {
+        got = -1;
+        errno = ENOMEM;
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return got;
+}
+
+static void rec_close(void * ctx, int h) {
+    rec_ctx * rec = ctx;
+    int fd;
+
+    pthread_mutex_lock(&rec->lock);
+    fd = rec->handles[h].fd;
+    rec->handles[h].fd = -1;
+    pthread_mutex_unlock(&rec->lock);
+    close(fd);
+}
+
+static int rec_pids(void * ctx, int ** pids) {
+    rec_ctx * rec = ctx;
+    int n;
+
+    n = sys_pids(NULL, pids);
+    if (n < 0 || rec->pids)
+        return n;
+    rec->pids = malloc((n ? n : 1)*sizeof(int));
+    if (!rec->pids) {
+        free(*pids);
+        return -1;
+    }
+    memcpy(rec->pids, *pids, n*sizeof(int));
+    rec->n_pids = n;
+    return n;
+}
+
+static int rec_pad(rec_writer * w) {
+    for (; w->pos % 8; w->pos++)
+        if (fputc(0, w->f) == EOF)
+            return ERROR;
+    return OK;
+}
+
+static inline int zero_block(const unsigned char * p, size_t n) {
+    return p[0] == 0 && !memcmp(p, p + 1, n - 1);
+}
+
+// rec_put - writes data of range of current file
+static int rec_put(rec_writer * w, uint64_t off, const unsigned char * data, uint64_t len) {
+    io_rec_ext * ext;
+    uint64_t n;
+
+    if (grow_array((void **) &w->ext, &w->size_ext, w->n_ext, sizeof(io_rec_ext)) != OK)
+        return ERROR;
+    ext = &w->ext[w->n_ext++];
+    ext->off = off;
+    ext->len = len;
+    ext->off_blocks = w->n_blocks;
+    for (uint64_t b = 0; b < len; b += IO_BLOCK) {
+        n = len - b > IO_BLOCK ? IO_BLOCK : len - b;
+        if (grow_array((void **) &w->blocks, &w->size_blocks, w->n_blocks, sizeof(uint64_t)) != OK)
+            return ERROR;
+        if (zero_block(data + b, n)) {
+            w->blocks[w->n_blocks++] = 0;
+            continue;
+        }
+        w->blocks[w->n_blocks++] = w->pos;
+        if (fwrite(data + b, n, 1, w->f) != 1)
+            return ERROR;
+        w->pos += n;
+        if (rec_pad(w) != OK)
+            return ERROR;
+    }
+    return OK;
+}
+
+// rec_put_gap - writes range of file read now, up to limit or its end
+static int rec_put_gap(rec_writer * w, int fd, uint64_t off, uint64_t limit, unsigned char * buf) {
+    long got;
+
+    while (off < limit) {
+        got = pread64(fd, buf, limit - off > KPAGE_BLOCK ? KPAGE_BLOCK : limit - off, off);
+        if (got <= 0)
+            break;
+        if (rec_put(w, off, buf, got) != OK)
+            return ERROR;
+        off += got;
+    }
+    return OK;
+}
+
+static int cmp_rec_extent(const void * a, const void * b) {
+    const rec_extent * x = a, * y = b;
+
+    if (x->off != y->off)
+        return (x->off > y->off) - (x->off < y->off);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int cmp_rec_file(const void * a, const void * b) {
+    return strcmp(((const rec_file *) a)->path, ((const rec_file *) b)->path);
+}
+
+static inline int seq_before(rec_extent * ext, unsigned long a, unsigned long b) {
+    return ext[a].seq < ext[b].seq;
+}
+
+// binary heap of extents by seq, oldest read on top
+static void heap_push(rec_extent * ext, unsigned long * heap, unsigned long * n, unsigned long e) {
+    unsigned long i = (*n)++, up;
+
+    for (; i && seq_before(ext, e, heap[up = (i - 1)/2]); i = up)
+        heap[i] = heap[up];
+    heap[i] = e;
+}
+
+static void heap_pop(rec_extent * ext, unsigned long * heap, unsigned long * n) {
+    unsigned long i = 0, c, last = heap[--(*n)];
+
+    while ((c = 2*i + 1) < *n) {
+        if (c + 1 < *n && seq_before(ext, heap[c + 1], heap[c]))
+            c++;
+        if (!seq_before(ext, heap[c], last))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+}
+
+// rec_write_file - writes data and metadata of file, where reads overlap
+// the earliest one wins; ranges of kpagecount and kpageflags which were
+// not read are taken now
+static int rec_write_file(rec_writer * w, rec_file * file, io_rec_file * out) {
+    rec_extent * ext = file->ext, * top, * cur = NULL;
+    unsigned char * buf = NULL;
+    unsigned long * heap;
+    unsigned long n_heap = 0, i = 0, n = file->n_ext;
+    uint64_t pos = 0, from = 0, next, blocks;
+    int fd = -1, ret = ERROR;
+
+    memset(out, 0, sizeof(*out));
+    out->err = file->err;
+    w->n_blocks = 0;
+    w->n_ext = 0;
+    heap = malloc((n ? n : 1)*sizeof(unsigned long));
+    if (!heap)
+        return ERROR;
+    if (file->opened && (!strcmp(file->path, KPAGECOUNT) || !strcmp(file->path, KPAGEFLAGS))) {
+        buf = malloc(KPAGE_BLOCK);
+        fd = open(file->path, O_RDONLY);
+        if (!buf)
+            goto file_out;
+    }
+    qsort(ext, n, sizeof(rec_extent), cmp_rec_extent);
+    for (;;) {
+        while (i < n && ext[i].off <= pos)
+            heap_push(ext, heap, &n_heap, i++);
+        while (n_heap && ext[heap[0]].off + ext[heap[0]].len <= pos)
+            heap_pop(ext, heap, &n_heap);
+        top = n_heap ? &ext[heap[0]] : NULL;
+        if (cur && cur != top) {
+            if (rec_put(w, from, cur->data + (from - cur->off), pos - from) != OK)
+                goto file_out;
+            cur = NULL;
+        }
+        if (!top) {
+            next = i < n ? ext[i].off : UINT64_MAX;
+            if (fd >= 0 && rec_put_gap(w, fd, pos, next, buf) != OK)
+                goto file_out;
+            if (i == n)
+                break;
+            pos = next;
+            continue;
+        }
+        // oldest read covering pos is used up to its end or next read
+        if (!cur) {
+            cur = top;
+            from = pos;
+        }
+        next = top->off + top->len;
+        if (i < n && ext[i].off < next)
+            next = ext[i].off;
+        pos = next;
+    }
+
+    out->off_path = w->pos;
+    out->path_len = strlen(file->path);
+    if (fwrite(file->path, out->path_len + 1, 1, w->f) != 1)
+        goto file_out;
+    w->pos += out->path_len + 1;
+    if (rec_pad(w) != OK)
+        goto file_out;
+    blocks = w->pos;
+    if (w->n_blocks && fwrite(w->blocks, sizeof(uint64_t), w->n_blocks, w->f) != w->n_blocks)
+        goto file_out;
+    w->pos += w->n_blocks*sizeof(uint64_t);
+    for (unsigned long i = 0; i < w->n_ext; i++)
+        w->ext[i].off_blocks = blocks + w->ext[i].off_blocks*sizeof(uint64_t);
+    out->n_ext = w->n_ext;
+    out->off_ext = w->pos;
+    if (w->n_ext && fwrite(w->ext, sizeof(io_rec_ext), w->n_ext, w->f) != w->n_ext)
+        goto file_out;
+    w->pos += w->n_ext*sizeof(io_rec_ext);
+    ret = OK;
+file_out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(heap);
+    return ret;
+}
+
+static int rec_write(rec_ctx * rec) {
+    io_rec_hdr hdr;
+    io_rec_file * files;
+    rec_writer w;
+    char * tmp_path;
+    int ret = ERROR;
+
+    memset(&w, 0, sizeof(w));
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IO_REC_MAGIC, sizeof(hdr.magic));
+    hdr.version = IO_REC_VERSION;
+    hdr.pagesize = sysconf(_SC_PAGESIZE);
+    hdr.n_files = rec->n_files;
+    hdr.n_pids = rec->n_pids;
+    qsort(rec->files, rec->n_files, sizeof(rec_file), cmp_rec_file);
+    files = calloc(rec->n_files ? rec->n_files : 1, sizeof(io_rec_file));
+    tmp_path = malloc(strlen(rec->out) + sizeof(".tmp"));
+    if (!files || !tmp_path)
+        goto write_out;
+
+    // written aside and renamed like snapshots
+    sprintf(tmp_path, "%s.tmp", rec->out);
+    w.f = fopen(tmp_path, "wb");
+    if (!w.f)
+        goto write_out;
+    w.pos = sizeof(hdr);
+    if (fwrite(&hdr, sizeof(hdr), 1, w.f) != 1)
+        goto write_err;
+    for (unsigned long i = 0; i < rec->n_files; i++)
+        if (rec_write_file(&w, &rec->files[i], &files[i]) != OK)
+            goto write_err;
+    hdr.off_files = w.pos;
+    if (rec->n_files && fwrite(files, sizeof(io_rec_file), rec->n_files, w.f) != rec->n_files)
+        goto write_err;
+    w.pos += rec->n_files*sizeof(io_rec_file);
+    hdr.off_pids = w.pos;
+    for (int i = 0; i < rec->n_pids; i++) {
+        int32_t pid = rec->pids[i];
+        if (fwrite(&pid, sizeof(pid), 1, w.f) != 1)
+            goto write_err;
+    }
+    if (fseeko(w.f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, w.f) != 1)
+        goto write_err;
+    if (fclose(w.f) != 0) {
+        unlink(tmp_path);
+        goto write_out;
+    }
+    if (rename(tmp_path, rec->out) == 0)
+        ret = OK;
+    else
+        unlink(tmp_path);
+    goto write_out;
+write_err:
+    fclose(w.f);
+    unlink(tmp_path);
+write_out:
+    free(w.blocks);
+    free(w.ext);
+    free(tmp_path);
+    free(files);
+    return ret;
+}
+
+static int rec_release(void * ctx) {
+    rec_ctx * rec = ctx;
+    int ret;
+
+    ret = rec_write(rec);
+    for (unsigned long i = 0; i < rec->n_handles; i++)
+        if (rec->handles[i].fd >= 0)
+            close(rec->handles[i].fd);
+    for (unsigned long i = 0; i < rec->n_files; i++) {
+        for (unsigned long e = 0; e < rec->files[i].n_ext; e++)
+            free(rec->files[i].ext[e].data);
+        free(rec->files[i].ext);
+        free(rec->files[i].path);
+    }
+    pthread_mutex_destroy(&rec->lock);
+    free(rec->files);
+    free(rec->handles);
+    free(rec->pids);
+    free(rec->out);
+    free(rec);
+    return ret;
+}
+
+static const pgmap_io_ops rec_ops = { rec_open, rec_pread, rec_close, rec_pids, rec_release };
+
+// replay backend, handles are indexes of recorded files
+typedef struct replay_key {
+    const char * path;
+    const char * base;
+} replay_key;
+
+static int replay_cmp_path(const void * key, const void * item) {
+    const replay_key * k = key;
+
+    return strcmp(k->path, k->base + ((const io_rec_file *) item)->off_path);
+}
+
+static int replay_open(void * ctx, const char * path) {
+    replay_ctx * r = ctx;
+    replay_key key = { path, r->base };
+    io_rec_file * file;
+
+    file = bsearch(&key, r->files, r->hdr->n_files, sizeof(io_rec_file), replay_cmp_path);
+    if (!file) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (file->err) {
+        errno = file->err;
+        return -1;
+    }
+    return file - r->files;
+}
+
+// stateless, so it is thread-safe
+static long replay_pread(void * ctx, int h, void * buf, unsigned long len, uint64_t off) {
+    replay_ctx * r = ctx;
+    io_rec_file * file = &r->files[h];
+    io_rec_ext * ext = (io_rec_ext *) ((char *) r->base + file->off_ext);
+    const uint64_t * blocks;
+    unsigned long lo = 0, hi = file->n_ext, i;
+    uint64_t pos, n, done = 0;
+
+    // last extent starting at or before off
+    while (lo < hi) {
+        i = (lo + hi)/2;
+        if (ext[i].off <= off)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    if (lo == 0)
+        return 0;
+    for (i = lo - 1; done < len && i < file->n_ext; i++) {
+        if (off + done < ext[i].off || off + done >= ext[i].off + ext[i].len)
+            break;
+        blocks = (const uint64_t *) ((char *) r->base + ext[i].off_blocks);
+        while (done < len && off + done < ext[i].off + ext[i].len) {
+            pos = off + done - ext[i].off;
+            n = IO_BLOCK - pos % IO_BLOCK;
+            if (n > ext[i].off + ext[i].len - (off + done))
+                n = ext[i].off + ext[i].len - (off + done);
+            if (n > len - done)
+                n = len - done;
+            if (blocks[pos/IO_BLOCK])
+                memcpy((char *) buf + done, (char *) r->base + blocks[pos/IO_BLOCK] + pos % IO_BLOCK, n);
+            else
+                memset((char *) buf + done, 0, n);
+            done += n;
+        }
+    }
+    return done;
+}
+
+static void replay_close(void * ctx, int h) {
+}
+
+static int replay_pids(void * ctx, int ** pids) {
+    replay_ctx * r = ctx;
+    uint64_t n = r->hdr->n_pids;
+
+    *pids = malloc((n ? n : 1)*sizeof(int));
+    if (!*pids)
+        return -1;
+    memcpy(*pids, (char *) r->base + r->hdr->off_pids, n*sizeof(int32_t));
+    return n;
+}
+
+static int replay_release(void * ctx) {
+    replay_ctx * r = ctx;
+
+    munmap(r->base, r->len);
+    free(r);
+    return OK;
+}
+
+static const pgmap_io_ops replay_ops = { replay_open, replay_pread, replay_close, replay_pids, replay_release };
+
+// every item of recording must lie inside of mapped file
+static int check_replay(replay_ctx * r) {
+    io_rec_hdr * hdr = r->hdr;
+    io_rec_file * file;
+    io_rec_ext * ext;
+    const uint64_t * blocks;
+    uint64_t len = r->len, n, size;
+
+    if (len < sizeof(io_rec_hdr) || memcmp(hdr->magic, IO_REC_MAGIC, sizeof(hdr->magic)))
+        return ERROR;
+    if (hdr->version > IO_REC_VERSION || hdr->pagesize == 0 || hdr->n_pids > INT32_MAX)
+        return ERROR;
+    if (hdr->off_files % 8 || hdr->off_files > len || hdr->n_files > (len - hdr->off_files)/sizeof(io_rec_file))
+        return ERROR;
+    if (hdr->off_pids % 4 || hdr->off_pids > len || hdr->n_pids > (len - hdr->off_pids)/sizeof(int32_t))
+        return ERROR;
+    r->files = (io_rec_file *) ((char *) r->base + hdr->off_files);
+    for (uint64_t f = 0; f < hdr->n_files; f++) {
+        file = &r->files[f];
+        if (file->off_path >= len || file->path_len >= len - file->off_path ||
+                ((char *) r->base)[file->off_path + file->path_len] != '\0')
+            return ERROR;
+        if (file->off_ext % 8 || file->off_ext > len || file->n_ext > (len - file->off_ext)/sizeof(io_rec_ext))
+            return ERROR;
+        ext = (io_rec_ext *) ((char *) r->base + file->off_ext);
+        for (uint64_t e = 0; e < file->n_ext; e++) {
+            if (ext[e].off + ext[e].len < ext[e].off || (e && ext[e].off < ext[e - 1].off + ext[e - 1].len))
+                return ERROR;
+            // rounded up without addition which could wrap near UINT64_MAX
+            n = ext[e].len/IO_BLOCK + (ext[e].len % IO_BLOCK != 0);
+            if (ext[e].off_blocks % 8 || ext[e].off_blocks > len || n > (len - ext[e].off_blocks)/sizeof(uint64_t))
+                return ERROR;
+            blocks = (const uint64_t *) ((char *) r->base + ext[e].off_blocks);
+            for (uint64_t b = 0; b < n; b++) {
+                size = b + 1 < n ? IO_BLOCK : ext[e].len - b*IO_BLOCK;
+                if (blocks[b] && (blocks[b] > len || size > len - blocks[b]))
+                    return ERROR;
+            }
+        }
+    }
+    return OK;
+}
+
+/////////// process filter ////////////////////////////
+
+static void free_filter(filter_t * f) {
+    if (!f)
+        return;
+    free(f->cgroup);
+    free(f->pids);
+    free(f);
+}
+
+static int cmp_int(const void * a, const void * b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+// real uid is first number of "Uid:" line of /proc/[pid]/status
+static int filter_uid(pgmap_io * io, int pid) {
+    char path[sizeof("/proc/%d/status") + sizeof(int)*3];
+    char * status, * line;
+    int uid = -1;
+
+    sprintf(path,"/proc/%d/status",pid);
+    status = io_read_all(io, path, NULL);
+    if (!status)
+        return -1;
+    line = strstr(status,"\nUid:");
+    if (!line || sscanf(line + 5,"%d",&uid) != 1)
+        uid = -1;
+    free(status);
+    return uid;
+}
+
+// some line "hierarchy:controllers:path" of /proc/[pid]/cgroup lies
+// in cgroup of filter
+static int filter_cgroup(pgmap_io * io, filter_t * f, int pid) {
+    char path[sizeof("/proc/%d/cgroup") + sizeof(int)*3];
+    char * cgroups, * line, * end, * cg;
+    int found = 0;
+
+    sprintf(path,"/proc/%d/cgroup",pid);
+    cgroups = io_read_all(io, path, NULL);
+    if (!cgroups)
+        return 0;
+    for (line = cgroups; !found && *line; line = end + 1) {
+        end = strchr(line,'\n');
+        if (!end)
+            end = line + strlen(line);
+        cg = memchr(line,':',end - line);
+        cg = cg ? memchr(cg + 1,':',end - cg - 1) : NULL;
+        if (cg && (size_t) (end - cg - 1) >= f->cgroup_len
+                && !memcmp(cg + 1,f->cgroup,f->cgroup_len)) {
+            cg += 1 + f->cgroup_len;
+            // whole path components only, "/a" does not match "/ab"
+            found = cg == end || *cg == '/' || f->cgroup[f->cgroup_len - 1] == '/';
+        }
+        if (!*end)
+            break;
+    }
+    free(cgroups);
+    return found;
+}
+
+static int filter_pidns(filter_t * f, int pid) {
+    char path[sizeof("/proc/%d/ns/pid") + sizeof(int)*3];
+    struct stat st;
+
+    sprintf(path,"/proc/%d/ns/pid",pid);
+    STAT_ADD(syscalls,1);
+    if (stat(path,&st) != 0)
+        return 0;
+    return st.st_dev == f->ns_dev && st.st_ino == f->ns_ino;
+}
+
+// filter_match - pid passes filter, cheapest checks go first
+static int filter_match(pgmap_io * io, filter_t * f, int pid) {
+    if (f->pids && !bsearch(&pid, f->pids, f->n_pids, sizeof(int), cmp_int))
+        return 0;
+    if (f->pidns && !filter_pidns(f, pid))
+        return 0;
+    if (f->uid >= 0 && filter_uid(io, pid) != f->uid)
+        return 0;
+    if (f->cgroup && !filter_cgroup(io, f, pid))
+        return 0;
+    return 1;
+}
+
+static void clean_tables(pagemap_tbl * table) {
+    if (!table)
+        return ;
+    clean_mappings(table);
+    free_rmap(table->rmap);
+    free(table->stats);
+    free(table->throttle);
+    free_filter(table->filter);
+    shm_unpublish(table->shm);
+    close_kpagemap(table->kpagemap, table->io);
+    destroy_list(table);
+    free(table->kpagemap);
+    free(table);
+}
+
+static int pgmap_ver(pgmap_io * io) {
+    char * release;
+    int major,minor,patch = 0;
+    int fields;
+
+    release = io_read_all(io, "/proc/sys/kernel/osrelease", NULL);
+    if (!release)
+        return ERROR;
+    fields = sscanf(release,"%d.%d.%d",&major,&minor,&patch);
+    free(release);
+    if (fields < 2)
+        return ERROR;
+    if ((major >= 3) || (major == 2 && minor == 6 && patch >= 25))
+        return OK;
+    return ERROR;
+}
+
+static pagemap_tbl * walk_procdir(pagemap_tbl * table) {
+    int * pids;
+    int n;
+    uint64_t start = stat_clock();
+
+    n = table->io->ops->pids(table->io->ctx, &pids);
+    if (n < 0)
+        return NULL;
+    table->size = 0;
+    invalidate_pids(table);
+    for (int i = 0; i < n; i++) {
+        if (table->filter && !filter_match(table->io, table->filter, pids[i]))
+            continue;
+        add_pid(pids[i],table);
+        table->size += 1;
+    }
+    free(pids);
+    polish_table(table);
+    stat_phase(PGMAP_PHASE_PROCDIR, start);
+    return table;
+}
+
+static inline uint64_t ram_count(pagemap_tbl * table)
+{
+    return table->kpagemap->phys_p_count;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+// external interface ////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+pagemap_tbl * init_pgmap_table(pagemap_tbl * table) {
+    return init_pgmap_table_io(table, NULL);
+}
+
+pagemap_tbl * init_pgmap_table_io(pagemap_tbl * table, pgmap_io * io) {
+    // for new table - it is necessary to give NULL pointer at first call
+    if (!table) {
+        if (!io)
+            io = &sys_io;
+        if (pgmap_ver(io) == ERROR)
+            return NULL;
+        trace("pgmap_ver()");
+        table = calloc(1, sizeof(pagemap_tbl));
+        if (!table)
+            return NULL;
+        trace("allocating of table");
+        table->io = io;
+        table->kpagemap = malloc(sizeof(kpagemap_t));
+        table->stats = calloc(1, sizeof(pgmap_stats_t));
+        if (!table->kpagemap || !table->stats || open_kpagemap(table->kpagemap, io) != OK) {
+            free(table->kpagemap);
+            free(table->stats);
+            free(table);
+            return NULL;
+        }
+        trace("open_kpagemap");
+    }
+    // procdir is counted always, it is cheap
+    cur_stats = table->stats;
+    if(!walk_procdir(table)) {
+        cur_stats = NULL;
+        clean_tables(table);
+        return NULL;
+    }
+    cur_stats = NULL;
+    trace("walk_procdir");
+    return table;
+}
+
+pagemap_tbl * open_pgmap_table(pagemap_tbl * table, int pid) {
+    scan_begin(table);
+    fill_mappings(table);
+    trace("fill_mappings");
+    fill_cmdlines(table);
+    trace("fill_cmdlines");
+    walk_procs(table,pid);
+    trace("walk_procs");
+    scan_end(OK);
+    return table;
+}
+
+// set optional features (PAGEMAP_PFNS ...) used by next open_pgmap_table()
+void set_pgmap_flags(pagemap_tbl * table, int flags)
+{
+    if (!table)
+        return;
+    table->flags = (table->flags & ~PAGEMAP_PUBLIC) | (flags & PAGEMAP_PUBLIC);
+}
+
+int set_pgmap_throttle(pagemap_tbl * table, const pgmap_throttle_t * throttle)
+{
+    if (!table)
+        return ERROR;
+    if (!throttle) {
+        free(table->throttle);
+        table->throttle = NULL;
+        return OK;
+    }
+    if (!table->throttle)
+        table->throttle = calloc(1, sizeof(throttle_t));
+    if (!table->throttle)
+        return ERROR;
+    table->throttle->lim = *throttle;
+    return OK;
+}
+
+int set_pgmap_filter(pagemap_tbl * table, const pgmap_filter_t * filter)
+{
+    char path[sizeof("/proc/%d/ns/pid") + sizeof(int)*3];
+    struct stat st;
+    pagemap_list * tmp, * next;
+    filter_t * f;
+
+    if (!table)
+        return ERROR;
+    if (!filter) {
+        free_filter(table->filter);
+        table->filter = NULL;
+        return OK;
+    }
+    if ((filter->pidns && !table->io->live) || (filter->pids && filter->n_pids < 1) ||
+            (filter->use_uid && filter->uid < 0))
+        return ERROR;
+    f = calloc(1, sizeof(filter_t));
+    if (!f)
+        return ERROR;
+    f->uid = filter->use_uid ? filter->uid : -1;
+    f->pidns = filter->pidns;
+    if (filter->cgroup && *filter->cgroup) {
+        f->cgroup = strdup(filter->cgroup);
+        f->cgroup_len = strlen(filter->cgroup);
+        if (!f->cgroup) {
+            free_filter(f);
+            return ERROR;
+        }
+    }
+    if (filter->pids) {
+        f->pids = malloc(filter->n_pids*sizeof(int));
+        if (!f->pids) {
+            free_filter(f);
+            return ERROR;
+        }
+        memcpy(f->pids, filter->pids, filter->n_pids*sizeof(int));
+        qsort(f->pids, filter->n_pids, sizeof(int), cmp_int);
+        f->n_pids = filter->n_pids;
+    }
+    if (f->pidns) {
+        sprintf(path,"/proc/%d/ns/pid",f->pidns);
+        if (stat(path,&st) != 0) {
+            free_filter(f);
+            return ERROR;
+        }
+        f->ns_dev = st.st_dev;
+        f->ns_ino = st.st_ino;
+    }
+    free_filter(table->filter);
+    table->filter = f;
+    for (tmp = table->start; tmp; tmp = next) {
+        next = tmp->next;
+        if (filter_match(table->io, f, tmp->pid_table.pid))
+            continue;
+        delete_pid(tmp->pid_table.pid, table);
+        table->size -= 1;
+    }
+    reset_pos(table);
+    return OK;
+}
+
+void free_pgmap_table(pagemap_tbl * table) {
+    clean_tables(table);
+    trace("kill tables");
+}
+
+// must be used with initialised table, it does not move any position of
+// table so it is safe for concurrent readers
+process_pagemap_t * get_single_pgmap(pagemap_tbl * table, int pid)
+{
+    pagemap_list * tmp;
+
+    tmp = search_pid(pid, table);
+    return tmp ? &tmp->pid_table : NULL;
+}
+
+// user is responsible for cleaning-up by freeing returned vector
+process_pagemap_t ** get_all_pgmap(pagemap_tbl * table, int * size)
+{
+    process_pagemap_t ** arr = NULL;
+    pagemap_list * p;
+    int cnt = 0;
+    if (!table || !size)
+        return NULL;
     *size = table->size;
     arr = malloc(table->size*sizeof(process_pagemap_t*));
     if (!arr)
         return NULL;
-    reset_pos(table);
-    while ((p = &(pid_iter(table)->pid_table)) && cnt < table->size) {
-        arr[cnt] = p;
-        cnt++;
+    // own cursor, concurrent readers must not share table->curr
+    for (p = table->start; p && cnt < table->size; p = p->next)
+        arr[cnt++] = &p->pid_table;
+    return arr;
+}
+
+// Copy counters of all processes column by column
+int get_pgmap_columns(pagemap_tbl * table, pgmap_columns * columns)
+{
+    uint32_t * data;
+    pagemap_list * p;
+    unsigned long n = 0;
+
+    if (!table || !columns)
+        return ERROR;
+    memset(columns, 0, sizeof(*columns));
+    for (p = table->start; p; p = p->next)
+        n++;
+    data = malloc((n ? n : 1)*PGMAP_COLS*sizeof(uint32_t));
+    columns->rows = malloc((n ? n : 1)*sizeof(process_pagemap_t *));
+    if (!data || !columns->rows) {
+        free(data);
+        free(columns->rows);
+        columns->rows = NULL;
+        return ERROR;
+    }
+    n = 0;
+    for (p = table->start; p; p = p->next)
+        columns->rows[n++] = &p->pid_table;
+    columns->n = n;
+    for (int c = 0; c < PGMAP_COLS; c++) {
+        columns->cols[c] = data + c*n;
+        for (unsigned long r = 0; r < n; r++)
+            columns->cols[c][r] = COL_VALUE(columns->rows[r], c);
+    }
+    return OK;
+}
+
+void free_pgmap_columns(pgmap_columns * columns)
+{
+    if (!columns)
+        return;
+    free(columns->cols[0]);
+    free(columns->rows);
+    memset(columns, 0, sizeof(*columns));
+}
+
+// must be used for opened table
+int get_physical_pgmap(pagemap_tbl * table, unsigned long * shared, unsigned long * free, unsigned long * nonshared)
+{
+    uint64_t start;
+    int ret;
+
+    if (!table || !shared || !free || !nonshared)
+        return ERROR;
+    if (table->kpagemap->under_root != 1) 
+        return ERROR;
+    *shared = 0;
+    *free = 0;
+    *nonshared = 0;
+    scan_begin(table);
+    start = stat_clock();
+    ret = walk_phys_mem(table, shared, free, nonshared);
+    stat_phase(PGMAP_PHASE_PHYS, start);
+    return scan_end(ret);
+}
+
+// Every single-call return process_pagemap_t, NULL at the end
+// Use only for reading!
+process_pagemap_t * iterate_over_all(pagemap_tbl * table)
+{
+    pagemap_list * tmp;
+
+    if (!table)
+        return NULL;
+    if (!(table->curr_r))
+        return NULL;
+    tmp = table->curr_r;
+    table->curr_r = table->curr_r->next;
+    return &tmp->pid_table; // NULL works ok too because ->pid_table is the 1st member
+}
+
+// Reset position of pid table seeker
+process_pagemap_t * reset_table_pos(pagemap_tbl * table)
+{
+    if (!table || !(table->start))
+        return NULL;
+    table->curr_r = table->start;
+    return &(table->curr_r->pid_table);
+}
+
+void init_pgmap_iter(pagemap_tbl * table, pgmap_iter * it)
+{
+    if (!it)
+        return;
+    it->next = table ? table->start : NULL;
+}
+
+process_pagemap_t * next_pgmap_iter(pgmap_iter * it)
+{
+    pagemap_list * tmp;
+
+    if (!it || !it->next)
+        return NULL;
+    tmp = it->next;
+    it->next = tmp->next;
+    return &tmp->pid_table;
+}
+
+// Return amount of physical memory pages
+uint64_t get_ram_size_in_pages(pagemap_tbl * table)
+{
+    return ram_count(table);
+}
+
+// Return 8-byte value from kpageflags file
+uint64_t get_kpgflg(pagemap_tbl * table, uint64_t page)
+{
+    uint64_t value;
+
+    scan_begin(table);
+    if (scan_end(get_kpageflags(table,page,&value)) == OK)
+        return value;
+    return 0;
+}
+
+// Return 8-byte value from kpagecount file
+uint64_t get_kpgcnt(pagemap_tbl * table, uint64_t page)
+{
+    uint64_t value;
+
+    scan_begin(table);
+    if (scan_end(get_kpagecount(table,page,&value)) == OK)
+        return value;
+    return 0;
+}
+
+int get_pgmap_stats(pagemap_tbl * table, pgmap_stats_t * stats)
+{
+    if (!table || !stats)
+        return ERROR;
+    memcpy(stats, table->stats, sizeof(*stats));
+    return OK;
+}
+
+void reset_pgmap_stats(pagemap_tbl * table)
+{
+    if (table)
+        memset(table->stats, 0, sizeof(*table->stats));
+}
+
+const char * get_pgmap_phase_name(int phase)
+{
+    static const char * names[PGMAP_PHASES] = {"procdir", "maps", "cmdlines",
+        "walk", "pagemap", "kpage", "phys"};
+
+    if (phase < 0 || phase >= PGMAP_PHASES)
+        return NULL;
+    return names[phase];
+}
+
+long get_kpgflg_block(pagemap_tbl * table, uint64_t page, uint64_t * buf, unsigned long count)
+{
+    if (!table || !buf || table->kpagemap->under_root != 1)
+        return -1;
+    return read_kpage_block(table->io, table->kpagemap->kpgm_flags_fd, buf, page, count);
+}
+
+long get_kpgcnt_block(pagemap_tbl * table, uint64_t page, uint64_t * buf, unsigned long count)
+{
+    if (!table || !buf || table->kpagemap->under_root != 1)
+        return -1;
+    return read_kpage_block(table->io, table->kpagemap->kpgm_count_fd, buf, page, count);
+}
+
+// Mark pages of opened table idle, wait interval ms and count accessed ones
+// into n_hot/n_cold - table must be opened with PAGEMAP_PFNS flag
+int get_idle_pgmap(pagemap_tbl * table, int pid, unsigned int interval)
+{
+    if (!table || !(table->flags & PAGEMAP_PFNS))
+        return ERROR;
+    if (table->kpagemap->under_root != 1 || !table->io->live)
+        return ERROR;
+    scan_begin(table);
+    return scan_end(walk_idle_mem(table, pid, interval));
+}
+
+// Clear soft-dirty bits, wait interval ms and count pages written meanwhile
+// into n_sdirty of processes and their mappings
+int get_dirty_pgmap(pagemap_tbl * table, int pid, unsigned int interval)
+{
+    if (!table || !table->io->live)
+        return ERROR;
+    scan_begin(table);
+    return scan_end(walk_dirty_procs(table, pid, interval));
+}
+
+// Return entries of reverse map for given pfn - table must be opened
+// with PAGEMAP_RMAP flag, returned entries are valid until next open
+const pgmap_rmap_entry * get_pfn_users(pagemap_tbl * table, uint64_t pfn, unsigned long * count)
+{
+    unsigned long first, last;
+
+    if (!table || !table->rmap || !count)
+        return NULL;
+    first = find_rmap(table->rmap, pfn);
+    for (last = first; last < table->rmap->count && table->rmap->items[last].pfn == pfn; last++)
+        ;
+    *count = last - first;
+    if (!*count)
+        return NULL;
+    return table->rmap->items + first;
+}
+
+// Fill n*n matrix with numbers of pages shared by every pair of pids,
+// diagonal holds numbers of resident page frames of each pid
+int get_share_matrix(pagemap_tbl * table, const int * pids, int n, unsigned long * matrix)
+{
+    if (!table || !table->rmap || !pids || n < 1 || !matrix)
+        return ERROR;
+    return share_matrix(table->rmap, pids, n, matrix);
+}
+
+// Hash content of private anonymous pages not yet shared and count zero
+// and duplicate pages into n_zero/n_dup, whole system numbers go to total
+int get_ksm_pgmap(pagemap_tbl * table, int pid, pgmap_ksm_t * total)
+{
+    if (!table || !total || !table->io->live)
+        return ERROR;
+    scan_begin(table);
+    return scan_end(walk_ksm_procs(table, pid, total));
+}
+
+// Fill fragmentation report of physical memory - requires root
+int get_frag_pgmap(pagemap_tbl * table, pgmap_frag_t * frag)
+{
+    uint64_t start;
+    int ret;
+
+    if (!table || !frag)
+        return ERROR;
+    if (table->kpagemap->under_root != 1)
+        return ERROR;
+    scan_begin(table);
+    start = stat_clock();
+    ret = walk_frag_mem(table, frag);
+    stat_phase(PGMAP_PHASE_PHYS, start);
+    return scan_end(ret);
+}
+
+// Count flags and mapcounts of all page frames
+int get_pages_pgmap(pagemap_tbl * table, uint64_t combo_mask, pgmap_pages_t * pages)
+{
+    uint64_t start;
+    int ret;
+
+    if (!table || !pages)
+        return ERROR;
+    if (table->kpagemap->under_root != 1)
+        return ERROR;
+    scan_begin(table);
+    start = stat_clock();
+    ret = walk_pages_mem(table, combo_mask, pages);
+    stat_phase(PGMAP_PHASE_PHYS, start);
+    return scan_end(ret);
+}
+
+const char * get_kpf_name(int bit)
+{
+    if (bit < 0 || bit >= PGMAP_KPF_BITS)
+        return NULL;
+    return kpf_names[bit];
+}
+
+int find_kpf_bit(const char * name)
+{
+    for (int bit = 0; bit < PGMAP_KPF_BITS; bit++)
+        if (kpf_names[bit] && !strcmp(kpf_names[bit], name))
+            return bit;
+    return -1;
+}
+
+// Fill histogram of physically contiguous runs of pid by log2 of their length
+int get_contig_pgmap(pagemap_tbl * table, int pid, unsigned long * hist)
+{
+    pagemap_list * p;
+
+    if (!table || !hist || table->kpagemap->under_root != 1)
+        return ERROR;
+    for (p = table->start; p; p = p->next) {
+        if (p->pid_table.pid == pid) {
+            memcpy(hist, p->contig, PGMAP_ORDERS*sizeof(unsigned long));
+            return OK;
+        }
     }
-    reset_pos(table);
-    return arr;
+    return ERROR;
 }
 
-// must be used for opened table
-int get_physical_pgmap(pagemap_tbl * table, unsigned long * shared, unsigned long * free, unsigned long * nonshared)
+// Write binary snapshot of opened table
+int write_pgmap_snapshot(pagemap_tbl * table, const char * path, int sections)
 {
-    if (!table || !shared || !free || !nonshared)
+    if (!table || !path)
         return ERROR;
-    if (table->kpagemap->under_root != 1) 
+    return write_snapshot(table, path, sections);
+}
+
+// Map snapshot file to memory, data are never copied
+pgmap_snap * open_pgmap_snapshot(const char * path)
+{
+    pgmap_snap * snap;
+    struct stat st;
+    int fd;
+
+    if (!path)
+        return NULL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(pgmap_snap_hdr)) {
+        close(fd);
+        return NULL;
+    }
+    snap = malloc(sizeof(pgmap_snap));
+    if (!snap) {
+        close(fd);
+        return NULL;
+    }
+    snap->len = st.st_size;
+    snap->base = mmap(NULL, snap->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap->base == MAP_FAILED) {
+        free(snap);
+        return NULL;
+    }
+    snap->hdr = snap->base;
+    if (check_snapshot(snap->hdr, snap->base, snap->len) != OK) {
+        trace("bad snapshot");
+        munmap(snap->base, snap->len);
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+void close_pgmap_snapshot(pgmap_snap * snap)
+{
+    if (!snap)
+        return;
+    munmap(snap->base, snap->len);
+    free(snap);
+}
+
+const pgmap_snap_hdr * get_snap_header(pgmap_snap * snap)
+{
+    return snap ? snap->hdr : NULL;
+}
+
+// Return whole column of snapshot
+const uint32_t * get_snap_column(pgmap_snap * snap, int col)
+{
+    if (!snap || col < 0 || col >= (int) snap->hdr->n_cols)
+        return NULL;
+    return (uint32_t *) ((char *) snap->base + snap->hdr->off_cols) + (uint64_t) col*snap->hdr->n_procs;
+}
+
+const char * get_snap_cmdline(pgmap_snap * snap, unsigned long row)
+{
+    if (!snap || row >= snap->hdr->n_procs)
+        return NULL;
+    return (char *) snap->base + snap->hdr->off_cmds + row*SMALLBUF;
+}
+
+const pgmap_snap_vma * get_snap_vmas(pgmap_snap * snap, unsigned long * count)
+{
+    if (!snap || !count || !(snap->hdr->sections & PGMAP_SNAP_VMAS))
+        return NULL;
+    *count = snap->hdr->n_vmas;
+    return (pgmap_snap_vma *) ((char *) snap->base + snap->hdr->off_vmas);
+}
+
+const char * get_snap_path(pgmap_snap * snap, const pgmap_snap_vma * vma)
+{
+    // check_snapshot() made sure that strings section ends by NUL
+    if (!snap || !vma || !vma->path || vma->path >= snap->hdr->off_pfns - snap->hdr->off_strs)
+        return NULL;
+    return (char *) snap->base + snap->hdr->off_strs + vma->path;
+}
+
+const uint64_t * get_snap_pfns(pgmap_snap * snap, const pgmap_snap_vma * vma, unsigned long * count)
+{
+    if (!snap || !vma || !count || !(snap->hdr->sections & PGMAP_SNAP_PFNS))
+        return NULL;
+    if (vma->pfn_first > snap->hdr->n_pfns || vma->n_pfns > snap->hdr->n_pfns - vma->pfn_first)
+        return NULL;
+    *count = vma->n_pfns;
+    return (uint64_t *) ((char *) snap->base + snap->hdr->off_pfns) + vma->pfn_first;
+}
+
+const uint64_t * get_snap_starts(pgmap_snap * snap)
+{
+    if (!snap || snap->hdr->version < 2)
+        return NULL;
+    return (uint64_t *) ((char *) snap->base + snap->hdr->off_starts);
+}
+
+// Copy one row of snapshot into process_pagemap_t
+int get_snap_pgmap(pgmap_snap * snap, unsigned long row, process_pagemap_t * p_t)
+{
+    const uint32_t * col;
+
+    if (!snap || !p_t || row >= snap->hdr->n_procs)
         return ERROR;
-    *shared = 0;
-    *free = 0;
-    *nonshared = 0;
-    return walk_phys_mem(table, shared, free, nonshared);
+    memset(p_t, 0, sizeof(*p_t));
+    for (int c = 0; c < PGMAP_COLS; c++) {
+        col = get_snap_column(snap, c);
+        if (col)
+            COL_VALUE(p_t, c) = col[row];
+    }
+    memcpy(p_t->cmdline, get_snap_cmdline(snap, row), SMALLBUF);
+    p_t->cmdline[SMALLBUF-1] = '\0';
+    if (get_snap_starts(snap))
+        p_t->starttime = get_snap_starts(snap)[row];
+    return OK;
 }
 
-// Every single-call return process_pagemap_t, NULL at the end
-// Use only for reading!
-process_pagemap_t * iterate_over_all(pagemap_tbl * table)
+const char * get_pgmap_col_name(int col)
 {
-    pagemap_list * tmp;
+    if (col < 0 || col >= PGMAP_COLS)
+        return NULL;
+    return col_names[col];
+}
 
-    if (!table)
+int find_pgmap_col(const char * name)
+{
+    if (!name)
+        return -1;
+    for (int c = 0; c < PGMAP_COLS; c++)
+        if (!strcmp(col_names[c], name))
+            return c;
+    return -1;
+}
+
+// Compare two snapshots process by process
+pgmap_diff_t * diff_pgmap_snapshots(pgmap_snap * a, pgmap_snap * b, int sort_col, unsigned long * count)
+{
+    if (!a || !b || !count)
         return NULL;
-    if (!(table->curr_r))
+    return diff_snapshots(a, b, sort_col, count);
+}
+
+// Compare mappings of one process in two snapshots
+pgmap_vma_diff_t * diff_pgmap_vmas(pgmap_snap * a, long row_a, pgmap_snap * b, long row_b, unsigned long * count)
+{
+    if (!a || !b || !count)
         return NULL;
-    tmp = table->curr_r;
-    table->curr_r = table->curr_r->next;
-    return &tmp->pid_table; // NULL works ok too because ->pid_table is the 1st member
+    return diff_vmas(a, row_a, b, row_b, count);
 }
 
-// Reset position of pid table seeker
-process_pagemap_t * reset_table_pos(pagemap_tbl * table)
+// Create history of samples, every process gets size bytes of compressed records
+pgmap_ring * create_pgmap_ring(unsigned int size)
 {
-    if (!table || !(table->start))
+    pgmap_ring * ring;
+
+    if (size < RING_REC_MAX)
+        size = RING_REC_MAX;
+    ring = calloc(1, sizeof(pgmap_ring));
+    if (!ring)
         return NULL;
-    table->curr_r = table->start;
-    return &(table->curr_r->pid_table);
+    ring->size = size;
+    return ring;
 }
 
-// Return amount of physical memory pages
-uint64_t get_ram_size_in_pages(pagemap_tbl * table)
+// Append current values of all processes of opened table to history
+int add_pgmap_ring_sample(pgmap_ring * ring, pagemap_tbl * table, uint64_t time)
 {
-    return ram_count(table);
+    if (!ring || !table)
+        return ERROR;
+    return ring_sample(ring, table, time);
 }
 
-// Return 8-byte value from kpageflags file
-uint64_t get_kpgflg(pagemap_tbl * table, uint64_t page)
+unsigned long get_pgmap_ring_procs(pgmap_ring * ring)
 {
-    uint64_t value;
-    if (get_kpageflags(table,page,&value) == OK)
-        return value;
-    return 0;
+    return ring ? ring->count : 0;
 }
 
-// Return 8-byte value from kpagecount file
-uint64_t get_kpgcnt(pagemap_tbl * table, uint64_t page)
+// Decode history of idx-th process, oldest sample first
+int get_pgmap_ring_samples(pgmap_ring * ring, unsigned long idx, int * pid,
+        uint64_t * times, uint32_t * values, int max)
 {
-    uint64_t value;
-    if (get_kpagecount(table,page,&value) == OK)
-        return value;
-    return 0;
+    ring_proc * rp;
+    unsigned int pos;
+    uint64_t time;
+    uint32_t cur[PGMAP_COLS];
+    int n = 0;
+
+    if (!ring || idx >= ring->count)
+        return -1;
+    rp = &ring->procs[idx];
+    if (pid)
+        *pid = rp->pid;
+    if (!times || !values)
+        return rp->samples;
+    time = rp->base_time;
+    memcpy(cur, rp->base, sizeof(cur));
+    pos = rp->head;
+    for (unsigned int s = 0; s < rp->samples && n < max; s++) {
+        if (s)
+            decode_sample(rp, ring->size, &pos, &time, cur);
+        times[n] = time;
+        memcpy(values + (unsigned long) n*PGMAP_COLS, cur, sizeof(cur));
+        n++;
+    }
+    return n;
+}
+
+// Return number of bytes allocated by history
+unsigned long get_pgmap_ring_bytes(pgmap_ring * ring)
+{
+    if (!ring)
+        return 0;
+    return sizeof(pgmap_ring) + ring->count*(sizeof(ring_proc) + ring->size);
+}
+
+void free_pgmap_ring(pgmap_ring * ring)
+{
+    if (!ring)
+        return;
+    for (unsigned long i = 0; i < ring->count; i++)
+        free(ring->procs[i].data);
+    free(ring->procs);
+    free(ring);
+}
+
+// Publish opened table into shared memory segment
+int publish_pgmap_table(pagemap_tbl * table, const char * name, int sections)
+{
+    if (!table || !name)
+        return ERROR;
+    if (table->shm && strcmp(table->shm->name + 1, name + (name[0] == '/'))) {
+        shm_unpublish(table->shm);
+        table->shm = NULL;
+    }
+    if (!table->shm)
+        table->shm = shm_create(name, table->kpagemap->pagesize);
+    if (!table->shm)
+        return ERROR;
+    return shm_publish(table->shm, table, sections);
+}
+
+pgmap_shm * attach_pgmap_shm(const char * name)
+{
+    pgmap_shm * shm;
+    pgmap_shm_hdr * sh;
+    struct stat st;
+    char * path;
+
+    path = shm_name(name);
+    shm = calloc(1, sizeof(pgmap_shm));
+    if (!path || !shm)
+        goto attach_err;
+    shm->slot = -1;
+    shm->fd = shm_open(path, O_RDONLY, 0);
+    if (shm->fd < 0)
+        goto attach_err;
+    if (fstat(shm->fd, &st) != 0 || st.st_size < (off_t) sizeof(pgmap_shm_hdr))
+        goto close_err;
+    shm->len = st.st_size;
+    shm->base = mmap(NULL, shm->len, PROT_READ, MAP_SHARED, shm->fd, 0);
+    if (shm->base == MAP_FAILED)
+        goto close_err;
+    sh = shm->base;
+    if (memcmp(sh->magic, PGMAP_SHM_MAGIC, sizeof(sh->magic)) || sh->version != PGMAP_SHM_VERSION) {
+        trace("bad shared memory segment");
+        munmap(shm->base, shm->len);
+        goto close_err;
+    }
+    free(path);
+    return shm;
+close_err:
+    close(shm->fd);
+attach_err:
+    free(path);
+    free(shm);
+    return NULL;
+}
+
+pgmap_snap * pin_pgmap_shm(pgmap_shm * shm)
+{
+    if (!shm)
+        return NULL;
+    return shm_pin(shm);
+}
+
+int check_pgmap_shm(pgmap_shm * shm)
+{
+    if (!shm)
+        return ERROR;
+    return shm_check(shm);
+}
+
+// Copy next process of pinned publication, it is checked after every copy
+int iterate_pgmap_shm(pgmap_shm * shm, process_pagemap_t * p_t)
+{
+    if (!shm || !p_t)
+        return -1;
+    if (shm->slot < 0 && !shm_pin(shm))
+        return 0;
+    if (shm->row >= shm->hdr.n_procs) {
+        shm->slot = -1;
+        return 0;
+    }
+    get_snap_pgmap(&shm->snap, shm->row, p_t);
+    if (shm_check(shm) != OK) {
+        shm->slot = -1;
+        return -1;
+    }
+    shm->row++;
+    return 1;
+}
+
+void detach_pgmap_shm(pgmap_shm * shm)
+{
+    if (!shm)
+        return;
+    munmap(shm->base, shm->len);
+    close(shm->fd);
+    free(shm);
+}
+
+pgmap_rcu * create_pgmap_rcu(int flags)
+{
+    pgmap_rcu * rcu;
+
+    rcu = calloc(1, sizeof(pgmap_rcu));
+    if (!rcu)
+        return NULL;
+    rcu->flags = flags;
+    for (int i = 0; i < 2; i++) {
+        rcu->tables[i] = init_pgmap_table(NULL);
+        if (!rcu->tables[i]) {
+            free_pgmap_table(rcu->tables[0]);
+            free(rcu);
+            return NULL;
+        }
+        set_pgmap_flags(rcu->tables[i], flags);
+    }
+    return rcu;
+}
+
+// Build next generation in table without readers and make it current
+int refresh_pgmap_rcu(pgmap_rcu * rcu, int pid)
+{
+    struct timespec ts = {0, 1000000};
+    pagemap_tbl * table;
+    int back;
+
+    if (!rcu)
+        return ERROR;
+    back = rcu->gen ? !__atomic_load_n(&rcu->cur, __ATOMIC_ACQUIRE) : 0;
+    // readers which pinned back before the last switch go away, new ones
+    // see that it is not current and do not use it
+    while (__atomic_load_n(&rcu->refs[back], __ATOMIC_SEQ_CST))
+        nanosleep(&ts, NULL);
+    table = rcu->tables[back];
+    // init_pgmap_table() frees table on failure, it is recreated by
+    // the next refresh
+    if (table && !init_pgmap_table(table))
+        table = rcu->tables[back] = NULL;
+    if (!table) {
+        table = rcu->tables[back] = init_pgmap_table(NULL);
+        if (!table)
+            return ERROR;
+        set_pgmap_flags(table, rcu->flags);
+    }
+    if (!open_pgmap_table(table, pid))
+        return ERROR;
+    __atomic_store_n(&rcu->cur, back, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rcu->gen, rcu->gen + 1, __ATOMIC_RELEASE);
+    return OK;
+}
+
+pagemap_tbl * pin_pgmap_rcu(pgmap_rcu * rcu)
+{
+    int cur;
+
+    if (!rcu || !__atomic_load_n(&rcu->gen, __ATOMIC_ACQUIRE))
+        return NULL;
+    for (;;) {
+        cur = __atomic_load_n(&rcu->cur, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&rcu->refs[cur], 1, __ATOMIC_SEQ_CST);
+        // refresh could start rebuilding it meanwhile
+        if (__atomic_load_n(&rcu->cur, __ATOMIC_SEQ_CST) == cur && rcu->tables[cur])
+            return rcu->tables[cur];
+        if (!rcu->tables[cur]) {
+            __atomic_sub_fetch(&rcu->refs[cur], 1, __ATOMIC_SEQ_CST);
+            return NULL;
+        }
+        __atomic_sub_fetch(&rcu->refs[cur], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void unpin_pgmap_rcu(pgmap_rcu * rcu, pagemap_tbl * table)
+{
+    if (!rcu || !table)
+        return;
+    __atomic_sub_fetch(&rcu->refs[table == rcu->tables[1]], 1, __ATOMIC_RELEASE);
+}
+
+unsigned long get_pgmap_rcu_gen(pgmap_rcu * rcu)
+{
+    return rcu ? __atomic_load_n(&rcu->gen, __ATOMIC_ACQUIRE) : 0;
+}
+
+void free_pgmap_rcu(pgmap_rcu * rcu)
+{
+    if (!rcu)
+        return;
+    free_pgmap_table(rcu->tables[0]);
+    free_pgmap_table(rcu->tables[1]);
+    free(rcu);
+}
+
+
+pgmap_io * create_pgmap_io(const pgmap_io_ops * ops, void * ctx, long pagesize, int live)
+{
+    pgmap_io * io;
+
+    if (!ops || !ops->open || !ops->pread || !ops->close || !ops->pids)
+        return NULL;
+    io = malloc(sizeof(pgmap_io));
+    if (!io)
+        return NULL;
+    io->ops = ops;
+    io->ctx = ctx;
+    io->pagesize = pagesize;
+    io->live = live;
+    return io;
+}
+
+pgmap_io * open_pgmap_record(const char * path)
+{
+    rec_ctx * rec;
+    pgmap_io * io;
+
+    if (!path)
+        return NULL;
+    rec = calloc(1, sizeof(rec_ctx));
+    if (!rec)
+        return NULL;
+    rec->out = strdup(path);
+    if (!rec->out) {
+        free(rec);
+        return NULL;
+    }
+    pthread_mutex_init(&rec->lock, NULL);
+    io = create_pgmap_io(&rec_ops, rec, 0, 1);
+    if (!io)
+        rec_release(rec);
+    return io;
+}
+
+// Map recording to memory, data are copied only to buffers of reads
+pgmap_io * open_pgmap_replay(const char * path)
+{
+    replay_ctx * r;
+    pgmap_io * io;
+    struct stat st;
+    int fd;
+
+    if (!path)
+        return NULL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(io_rec_hdr)) {
+        close(fd);
+        return NULL;
+    }
+    r = malloc(sizeof(replay_ctx));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->len = st.st_size;
+    r->base = mmap(NULL, r->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->base == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    r->hdr = r->base;
+    if (check_replay(r) != OK) {
+        trace("bad recording");
+        replay_release(r);
+        return NULL;
+    }
+    io = create_pgmap_io(&replay_ops, r, r->hdr->pagesize, 0);
+    if (!io)
+        replay_release(r);
+    return io;
+}
+
+int close_pgmap_io(pgmap_io * io)
+{
+    int ret = OK;
+
+    if (!io || io == &sys_io)
+        return OK;
+    if (io->ops->release)
+        ret = io->ops->release(io->ctx);
+    free(io);
+    return ret;
+}
+
+pgmap_view * open_pgmap_view(int pid)
+{
+    char path[BUFSIZE];
+    pgmap_view * view;
+
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+    else
+        strcpy(path, "/proc/self/pagemap");
+    view = malloc(sizeof(pgmap_view));
+    if (!view)
+        return NULL;
+    view->buf = malloc(PM_CHUNK*PM_ENTRY_BYTES);
+    view->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (!view->buf || view->fd < 0) {
+        if (view->fd >= 0)
+            close(view->fd);
+        free(view->buf);
+        free(view);
+        return NULL;
+    }
+    view->pagesize = sysconf(_SC_PAGESIZE);
+    return view;
+}
+
+// Count page states of [start, end) by pagemap entries only, without maps
+int query_pgmap_view(pgmap_view * view, unsigned long start, unsigned long end, pgmap_residency_t * res)
+{
+    unsigned long first, last, n;
+    uint64_t e;
+    long got;
+
+    if (!view || !res || end < start)
+        return ERROR;
+    memset(res, 0, sizeof(pgmap_residency_t));
+    first = start / view->pagesize;
+    last = (end + view->pagesize - 1) / view->pagesize;
+    while (first < last) {
+        n = last - first < PM_CHUNK ? last - first : PM_CHUNK;
+        got = pread(view->fd, view->buf, n*PM_ENTRY_BYTES, first*PM_ENTRY_BYTES);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return RD_ERROR;
+        }
+        // end of address space
+        if (got < (long) PM_ENTRY_BYTES)
+            break;
+        n = got / PM_ENTRY_BYTES;
+        for (unsigned long i = 0; i < n; i++) {
+            e = view->buf[i];
+            res->resident += !!(e & PM_PRESENT);
+            res->swapped += !!(e & PM_SWAP);
+            res->exclusive += !!(e & PM_MMAP_EXCLUSIVE);
+            res->dirty += !!(e & PM_SOFT_DIRTY);
+        }
+        res->pages += n;
+        first += n;
+    }
+    return OK;
+}
+
+void close_pgmap_view(pgmap_view * view)
+{
+    if (!view)
+        return;
+    close(view->fd);
+    free(view->buf);
+    free(view);
 }
@@ -20,12 +20,89 @@
 #define LIBPAGEMAP_H
 
 #define SMALLBUF        128
+#define PGMAP_ORDERS    32      // size of log2 histograms, item k counts lengths [2^k, 2^(k+1))
+#define PGMAP_KPF_BITS  64      // bits of kpageflags
+#define PGMAP_MAPCOUNTS 256     // size of mapcount histogram, last item counts all higher
+#define PGMAP_COMBO_BITS 10     // max bits of flag combinations counted by get_pages_pgmap()
+
+// optional features of table, see set_pgmap_flags()
+#define PAGEMAP_PFNS    0x0100  // keep resident PFNs of all mappings after walk
+#define PAGEMAP_RMAP    0x0200  // build reverse map pfn -> (pid, vaddr) during walk
+#define PAGEMAP_STATS   0x0400  // count syscalls, pages and time of scan phases
+#define PAGEMAP_BATCH   0x0800  // walk keeps many reads in flight, by io_uring if available
+#define PAGEMAP_INCR    0x1000  // physical walks classify only blocks changed since the previous one
+#define PAGEMAP_EXCL    0x2000  // uss, shr and n_anon by pagemap exclusive and file bits, without
+                                //  kpagecount/kpageflags and root; no pss (kernel 4.2+)
+#define PAGEMAP_PUBLIC  0xff00  // mask of flags settable by user
 
 #include <stdint.h>
 
-struct proc_mapping;
+#define PERM_WRITE      0x0100
+#define PERM_READ       0x0200
+#define PERM_EXEC       0x0400
+#define PERM_SHARE      0x0800
+#define PERM_PRIV       0x1000
+
 struct pagemap_list;
 struct kpagemap_t;
+struct rmap_t;
+struct shm_pub_t;
+struct pgmap_io;
+struct throttle_t;
+struct filter_t;
+
+// phases of scans timed in pgmap_stats_t
+enum {
+    PGMAP_PHASE_PROCDIR,    // walk of /proc directory in init_pgmap_table()
+    PGMAP_PHASE_MAPS,       // reading of /proc/[pid]/maps
+    PGMAP_PHASE_CMDLINES,   // reading of /proc/[pid]/status and stat
+    PGMAP_PHASE_WALK,       // walk of processes' memory, includes next two
+    PGMAP_PHASE_PAGEMAP,    //  reads of /proc/[pid]/pagemap
+    PGMAP_PHASE_KPAGE,      //  kpagecount/kpageflags lookups of walked pages
+    PGMAP_PHASE_PHYS,       // walks of whole physical memory
+    PGMAP_PHASES
+};
+
+// scan counters of table, summed over calls since reset_pgmap_stats();
+typedef struct pgmap_stats_t {
+    uint64_t syscalls;              // issued syscalls (without getdents of /proc)
+    uint64_t bytes_read;
+    uint64_t pages;                 // visited pagemap entries
+    uint64_t pfn_lookups;           // kpagecount/kpageflags entries looked up for walked pages
+    uint64_t cache_hits;            //  served from last read block
+    uint64_t vanished;              // processes exited during scan
+    uint64_t throttle_ns;           // slept by throttled scans, see set_pgmap_throttle()
+    uint64_t backoffs;              //  of them pauses for memory pressure
+    uint64_t reused_blocks;         // unchanged blocks of physical walks with PAGEMAP_INCR
+    uint64_t phase_ns[PGMAP_PHASES];
+} pgmap_stats_t;
+
+// one line of /proc/[pid]/maps, valid until next init_pgmap_table()
+typedef struct proc_mapping {
+    unsigned long start, end, offset;
+    unsigned long inode;        // inode of mapped file, 0 for anonymous memory
+    char * path;                // mapped file or [heap], [stack].., NULL if anonymous
+    unsigned long * pfns;       // resident PFNs in address order, only with PAGEMAP_PFNS
+    unsigned long n_pfns;       // number of valid items in pfns
+    unsigned long pfns_size;    // allocated items of pfns
+    unsigned long n_sdirty;     // number of pages written during get_dirty_pgmap() interval
+    int perms;                  // PERM_* flags
+    struct proc_mapping * next;
+} proc_mapping;
+
+// all numeric items of process_pagemap_t, new ones must be appended
+// because order defines columns of snapshots
+#define PGMAP_COUNTERS(X) \
+    X(pid) X(uss) X(pss) X(swap) X(res) X(shr) \
+    X(n_drt) X(n_uptd) X(n_wback) X(n_err) \
+    X(n_lck) X(n_slab) X(n_buddy) X(n_cmpndh) X(n_cmpndt) X(n_ksm) X(n_hwpois) \
+    X(n_huge) X(n_npage) \
+    X(n_mmap) X(n_anon) X(n_swpche) X(n_swpbck) X(n_onlru) X(n_actlru) X(n_unevctb) \
+    X(n_referenced) X(n_recycle) \
+    X(n_hot) X(n_cold) X(n_sdirty) X(n_zero) X(n_dup) X(n_file)
+
+#define PGMAP_COL_ENUM(item) PGMAP_COL_ ## item,
+enum { PGMAP_COUNTERS(PGMAP_COL_ENUM) PGMAP_COLS };
 
 typedef struct process_pagemap_t {
     int pid;
@@ -64,8 +141,59 @@ typedef struct process_pagemap_t {
     unsigned int n_referenced; // number of pages which were referenced since last LRU
                                     // enqueue/requeue
     unsigned int n_recycle;   // number of pages which are assigned to recycling
+   // working set stats - filled by get_idle_pgmap()
+    unsigned int n_hot;       // number of pages accessed during last idle interval
+    unsigned int n_cold;      // number of pages untouched during last idle interval
+   // write rate stats - filled by get_dirty_pgmap()
+    unsigned int n_sdirty;    // number of pages written during last soft-dirty interval
+   // KSM merge potential - filled by get_ksm_pgmap()
+    unsigned int n_zero;      // number of not shared anonymous pages filled by zeros
+    unsigned int n_dup;       // number of not shared anonymous pages with content
+                              //  equal to some other scanned page
+   // pagemap bits
+    unsigned int n_file;      // number of resident pages of files or shared anonymous memory
+   // identity - new members are appended to keep layout of older ones
+    unsigned long long starttime; // start of process in clock ticks after boot
 } process_pagemap_t;
 
+// one item of reverse map, see get_pfn_users()
+typedef struct pgmap_rmap_entry {
+    uint64_t pfn;
+    unsigned long vaddr;
+    int pid;
+} pgmap_rmap_entry;
+
+// totals of get_ksm_pgmap()
+typedef struct pgmap_ksm_t {
+    unsigned long scanned;  // number of hashed pages
+    unsigned long zero;     // number of zero pages among them
+    unsigned long dup;      // number of pages which could be merged with another one
+    unsigned long skipped;  // number of anonymous pages already shared
+} pgmap_ksm_t;
+
+// physical memory fragmentation, filled by get_frag_pgmap()
+typedef struct pgmap_frag_t {
+    unsigned long pages;                    // number of existing page frames
+    unsigned long free_pages;               // number of free page frames
+    unsigned long free_runs[PGMAP_ORDERS];  // runs of free pages by log2 of length
+    unsigned long blocks_2m;                // number of 2 MB aligned blocks
+    unsigned long free_2m;                  //  completely free
+    unsigned long movable_2m;               //  free or movable (on LRU) only
+    unsigned long huge_2m;                  //  already backed by THP or HugeTLB page
+    unsigned long blocks_1g;                // number of 1 GB aligned blocks
+    unsigned long free_1g;                  //  completely free
+    unsigned long movable_1g;               //  free or movable (on LRU) only
+} pgmap_frag_t;
+
+// page flags and mapcounts of whole physical memory, filled by get_pages_pgmap()
+typedef struct pgmap_pages_t {
+    unsigned long pages;                        // number of existing page frames
+    unsigned long flags[PGMAP_KPF_BITS];        // pages with kpageflags bit n set (holes too for nopage)
+    unsigned long mapcount[PGMAP_MAPCOUNTS];    // pages mapped n times
+    uint64_t combo_mask;                        // kpageflags bits of combinations
+    unsigned long combos[1 << PGMAP_COMBO_BITS];// pages by combination, bit k of index = k-th bit of combo_mask
+} pgmap_pages_t;
+
 typedef struct pagemap_tbl {
     struct pagemap_list * start; //it will be root of tree
     struct pagemap_list * curr;
@@ -73,18 +201,94 @@ typedef struct pagemap_tbl {
     unsigned long size;  //number of pagemap processes
     int flags;
     struct kpagemap_t * kpagemap;
+    struct rmap_t * rmap; // only with PAGEMAP_RMAP
+    struct shm_pub_t * shm; // segment of publish_pgmap_table()
+    pgmap_stats_t * stats;
+    struct pgmap_io * io; // backend of all /proc reads
+    struct throttle_t * throttle; // budgets of set_pgmap_throttle()
+    struct filter_t * filter; // of set_pgmap_filter()
 } pagemap_tbl;
 
+/////////// I/O BACKENDS ////////////////////////////////////
+
+// backend of /proc reads of scans - /proc directory, status, stat, maps,
+// pagemap, kpagecount, kpageflags, meminfo and osrelease; handles are
+// numbers of backend, pread has to be thread-safe
+typedef struct pgmap_io_ops {
+    int (*open)(void * ctx, const char * path);     // returns handle or -1 and sets errno
+    long (*pread)(void * ctx, int handle, void * buf, unsigned long len, uint64_t off);
+    void (*close)(void * ctx, int handle);
+    int (*pids)(void * ctx, int ** pids);           // malloc'ed pids of /proc, returns their number or -1
+    int (*release)(void * ctx);                     // result of close_pgmap_io(), may be NULL
+} pgmap_io_ops;
+
+typedef struct pgmap_io pgmap_io;
+
+// custom backend, pagesize 0 = of this system, live 0 disables features
+// which use /proc directly (idle and soft-dirty tracking, KSM estimation)
+pgmap_io * create_pgmap_io(const pgmap_io_ops * ops, void * ctx, long pagesize, int live);
+
+// system backend recording all reads, close_pgmap_io() writes them together
+// with whole kpagecount and kpageflags into file path; ranges read more
+// times are recorded as they were read first
+pgmap_io * open_pgmap_record(const char * path);
+
+// backend serving recording from memory mapped file, ranges which were not
+// recorded read as end of file
+pgmap_io * open_pgmap_replay(const char * path);
+
+// frees backend after all its tables were freed, returns ERROR when
+// recording cannot be written
+int close_pgmap_io(pgmap_io * io);
+
 /////////// PUBLIC //////////////////////////////////////////
 
 
 // alloc all pagemap tables and initialize them and alloc kpagemap_t
 pagemap_tbl * init_pgmap_table(pagemap_tbl * table);
 
+// init_pgmap_table() of new table reading through io, NULL = system
+pagemap_tbl * init_pgmap_table_io(pagemap_tbl * table, pgmap_io * io);
+
 // fill up pagemap tables for all processes on system
 // or exactly one pid, if was choosen
 pagemap_tbl * open_pgmap_table(pagemap_tbl * table, int pid);
 
+// set optional features PAGEMAP_* for following open_pgmap_table() calls
+void set_pgmap_flags(pagemap_tbl * table, int flags);
+
+// budgets of throttled scan, 0 = unlimited
+typedef struct pgmap_throttle_t {
+    unsigned long rate;     // pagemap bytes per second read from one process
+    unsigned int cpu;       // max percent of CPU time of scanning thread
+    double psi;             // backs off while memory pressure "some avg10" of
+                            //  process's cgroup (or system) is above it
+    unsigned int pause_us;  // pause between mappings of process, 0 = yield only
+} pgmap_throttle_t;
+
+// sets budgets of following open_pgmap_table() and get_physical_pgmap()
+// calls (cpu only), NULL turns them off; throttled walk yields between
+// mappings and does not use PAGEMAP_BATCH, time slept is counted in
+// throttle_ns of pgmap_stats_t
+int set_pgmap_throttle(pagemap_tbl * table, const pgmap_throttle_t * throttle);
+
+// processes kept in table, processes whose maps cannot be read are
+// always dropped; zeroed members match any process, so e.g.
+// { .cgroup = "/system.slice" } keeps processes of all users
+typedef struct pgmap_filter_t {
+    int uid;                // real uid, checked only with use_uid
+    int use_uid;            // 0 = any uid, 1 = only uid (0 is root)
+    const char * cgroup;    // cgroup path or its parent (e.g. "/system.slice"), NULL = any
+    int pidns;              // PID namespace of this pid, 0 = any; system backend only
+    const int * pids;       // only these n_pids pids, NULL = any; list is copied
+    int n_pids;
+} pgmap_filter_t;
+
+// drops processes not matching filter from table and from following
+// init_pgmap_table() calls, NULL keeps all; only files needed by filter
+// are read
+int set_pgmap_filter(pagemap_tbl * table, const pgmap_filter_t * filter);
+
 // close pagemap tables and free them
 void free_pgmap_table(pagemap_tbl * table);
 
@@ -95,20 +299,353 @@ process_pagemap_t * get_single_pgmap(pagemap_tbl * table, int pid);
 // calling user is responsible for freeing returned array
 process_pagemap_t ** get_all_pgmap(pagemap_tbl * table, int * size);
 
+// structure of arrays view of table, counter PGMAP_COL_x of row r is
+// cols[PGMAP_COL_x][r]
+typedef struct pgmap_columns {
+    unsigned long n;                // number of rows
+    uint32_t * cols[PGMAP_COLS];    // n counters of every column
+    process_pagemap_t ** rows;      // rows in table order, for cmdline and mappings
+} pgmap_columns;
+
+// fills columns by all processes of opened table, counters are copied so
+// they do not change by following get_*_pgmap() calls
+int get_pgmap_columns(pagemap_tbl * table, pgmap_columns * columns);
+
+void free_pgmap_columns(pgmap_columns * columns);
+
 // return single pagemap table for physical memory mapping
 // uses only k{pageflags,pagecount} files = require PAGEMAP_ROOT flag
 int get_physical_pgmap(pagemap_tbl * table, unsigned long * shared, unsigned long * free, unsigned long * nonshared);
 
+// working set estimation by /sys/kernel/mm/page_idle/bitmap, marks all pages
+// of pid (or all pids for 0) idle, waits interval ms and fills n_hot/n_cold;
+// pages which kernel cannot mark idle (non-LRU ones like zero page) are in
+// neither of them, requires root and table opened with PAGEMAP_PFNS flag
+int get_idle_pgmap(pagemap_tbl * table, int pid, unsigned int interval);
+
+// write rate measurement by soft-dirty bits, clears them through
+// /proc/[pid]/clear_refs, waits interval ms and fills n_sdirty of
+// processes and their mappings; processes whose bits cannot be cleared or
+// whose pagemap cannot be read whole get 0, ERROR when no process (or given
+// pid) could be cleared
+int get_dirty_pgmap(pagemap_tbl * table, int pid, unsigned int interval);
+
+// it returns all (pid, vaddr) mappings of given pfn, count is set to their
+// number; table must be opened with PAGEMAP_RMAP flag
+const pgmap_rmap_entry * get_pfn_users(pagemap_tbl * table, uint64_t pfn, unsigned long * count);
+
+// fills n*n matrix (row-major) by numbers of page frames shared by each
+// pair of pids, diagonal gets number of page frames of every pid; pids
+// which are not in table get zero rows, get_single_pgmap() tells them
+// table must be opened with PAGEMAP_RMAP flag
+int get_share_matrix(pagemap_tbl * table, const int * pids, int n, unsigned long * matrix);
+
+// estimation of KSM merge potential, reads content of private anonymous
+// pages from /proc/[pid]/mem, skips pages already shared and counts zero
+// and duplicate pages into n_zero/n_dup; totals are written into total
+int get_ksm_pgmap(pagemap_tbl * table, int pid, pgmap_ksm_t * total);
+
+// physical memory fragmentation by reading kpageflags and kpagecount in
+// threads, requires root; kernel does not mark tails of free buddy blocks,
+// so page without flags and mappings after buddy head counts as free up to
+// the next 1024 pages (largest buddy block) aligned pfn
+int get_frag_pgmap(pagemap_tbl * table, pgmap_frag_t * frag);
+
+// counts kpageflags bits, mapcounts and combinations of combo_mask bits
+// (max PGMAP_COMBO_BITS of them, 0 = none) of all page frames in one
+// parallel pass over kpageflags and kpagecount, requires root
+int get_pages_pgmap(pagemap_tbl * table, uint64_t combo_mask, pgmap_pages_t * pages);
+
+// returns name of kpageflags bit or NULL for unused bits
+const char * get_kpf_name(int bit);
+
+// returns kpageflags bit of name or -1
+int find_kpf_bit(const char * name);
+
+// fills hist (PGMAP_ORDERS items) by numbers of runs of virtually and
+// physically contiguous pages of pid by log2 of their lengths, requires root
+int get_contig_pgmap(pagemap_tbl * table, int pid, unsigned long * hist);
+
 // it returns all proc_t step by step, return NULL at the end
 process_pagemap_t * iterate_over_all(pagemap_tbl * table);
 
 // reset reading pointer in table, should be used only for reading
 process_pagemap_t * reset_table_pos(pagemap_tbl * table);
 
+// iterator owned by caller, any number of them can walk one table at once
+typedef struct pgmap_iter {
+    struct pagemap_list * next;
+} pgmap_iter;
+
+// sets iterator to the first process of table
+void init_pgmap_iter(pagemap_tbl * table, pgmap_iter * it);
+
+// it returns next process of iterator, NULL at the end
+process_pagemap_t * next_pgmap_iter(pgmap_iter * it);
+
 // it returns number of pages of physical ram
 uint64_t get_ram_size_in_pages(pagemap_tbl * table);
 
 // it returns 8-tuple of bytes (uint64_t) from kpagecount/kpageflags
 uint64_t get_kpgflg(pagemap_tbl * table, uint64_t page);
 uint64_t get_kpgcnt(pagemap_tbl * table, uint64_t page);
+
+// copies scan counters, procdir phase of init_pgmap_table() is always
+// counted, other ones only when table has PAGEMAP_STATS flag
+int get_pgmap_stats(pagemap_tbl * table, pgmap_stats_t * stats);
+
+// zeroes scan counters
+void reset_pgmap_stats(pagemap_tbl * table);
+
+// returns name of PGMAP_PHASE_* or NULL
+const char * get_pgmap_phase_name(int phase);
+
+// reads count items of kpageflags/kpagecount from page into buf, returns
+// number of read items or -1, requires root
+long get_kpgflg_block(pagemap_tbl * table, uint64_t page, uint64_t * buf, unsigned long count);
+long get_kpgcnt_block(pagemap_tbl * table, uint64_t page, uint64_t * buf, unsigned long count);
+
+/////////// GENERATIONS /////////////////////////////////////
+
+// two tables, readers pin the current one and read it without locks while
+// refresh_pgmap_rcu() builds the other one and switches them
+struct pgmap_rcu;
+typedef struct pgmap_rcu pgmap_rcu;
+
+// creates both tables with PAGEMAP_* flags, nothing is readable before
+// the first refresh_pgmap_rcu()
+pgmap_rcu * create_pgmap_rcu(int flags);
+
+// scans all processes (or pid) into table which is not current, waits
+// until its last readers unpin it; only one thread may refresh at once
+int refresh_pgmap_rcu(pgmap_rcu * rcu, int pid);
+
+// returns current table, which stays unchanged until unpin_pgmap_rcu(),
+// NULL before the first refresh; it must be used only for reading (get_all_pgmap(),
+// get_single_pgmap(), pgmap_iter, get_pfn_users()..)
+pagemap_tbl * pin_pgmap_rcu(pgmap_rcu * rcu);
+
+void unpin_pgmap_rcu(pgmap_rcu * rcu, pagemap_tbl * table);
+
+// returns number of refreshes done
+unsigned long get_pgmap_rcu_gen(pgmap_rcu * rcu);
+
+void free_pgmap_rcu(pgmap_rcu * rcu);
+
+/////////// SNAPSHOTS ///////////////////////////////////////
+
+#define PGMAP_SNAP_MAGIC    "PGMAPSN"
+#define PGMAP_SNAP_VERSION  2
+#define PGMAP_SNAP_VMAS     0x0001  // per mapping rows
+#define PGMAP_SNAP_PFNS     0x0002  // resident PFNs of mappings, needs PGMAP_SNAP_VMAS
+
+// binary snapshot file starts by this header, all sections are 8-byte
+// aligned and written in host byte order
+typedef struct pgmap_snap_hdr {
+    char magic[8];          // PGMAP_SNAP_MAGIC
+    uint32_t version;       // PGMAP_SNAP_VERSION
+    uint32_t pagesize;
+    uint64_t time;          // time of scan, seconds since epoch
+    uint64_t ram_pages;     // get_ram_size_in_pages()
+    uint64_t n_procs;       // number of rows, sorted by pid
+    uint32_t n_cols;        // number of columns (PGMAP_COL_*) of uint32_t
+    uint32_t sections;      // PGMAP_SNAP_* flags
+    uint64_t off_cols;      // n_cols columns of n_procs items each
+    uint64_t off_cmds;      // n_procs command lines of SMALLBUF chars
+    uint64_t n_vmas;
+    uint64_t off_vmas;      // pgmap_snap_vma rows ordered by proc
+    uint64_t off_strs;      // NUL terminated paths of mappings
+    uint64_t n_pfns;
+    uint64_t off_pfns;      // uint64_t PFNs of mappings
+    uint64_t size;          // size of whole snapshot
+   // version 2
+    uint64_t off_starts;    // n_procs uint64_t start times of processes, 0 in older files
+} pgmap_snap_hdr;
+
+// one mapping in snapshot
+typedef struct pgmap_snap_vma {
+    uint64_t start, end, offset, inode;
+    uint64_t n_sdirty;
+    uint64_t pfn_first;     // index of first pfn in pfns section
+    uint64_t n_pfns;
+    uint32_t proc;          // row of owning process
+    uint32_t perms;         // PERM_* flags
+    uint32_t path;          // offset in strings section, 0 for anonymous memory
+    uint32_t pad;
+} pgmap_snap_vma;
+
+struct pgmap_snap;
+typedef struct pgmap_snap pgmap_snap;
+
+// writes snapshot of opened table into path, sections are PGMAP_SNAP_*
+int write_pgmap_snapshot(pagemap_tbl * table, const char * path, int sections);
+
+// maps snapshot file into memory, returns NULL on error
+pgmap_snap * open_pgmap_snapshot(const char * path);
+
+// unmaps snapshot
+void close_pgmap_snapshot(pgmap_snap * snap);
+
+// returns header of snapshot, sizes of all sections are there
+const pgmap_snap_hdr * get_snap_header(pgmap_snap * snap);
+
+// returns column PGMAP_COL_* of n_procs items, NULL if it is not in snapshot
+const uint32_t * get_snap_column(pgmap_snap * snap, int col);
+
+// returns command line of row
+const char * get_snap_cmdline(pgmap_snap * snap, unsigned long row);
+
+// returns all mappings of snapshot and their number, NULL without them
+const pgmap_snap_vma * get_snap_vmas(pgmap_snap * snap, unsigned long * count);
+
+// returns path of mapping or NULL for anonymous memory
+const char * get_snap_path(pgmap_snap * snap, const pgmap_snap_vma * vma);
+
+// returns PFNs of mapping and their number, NULL without them
+const uint64_t * get_snap_pfns(pgmap_snap * snap, const pgmap_snap_vma * vma, unsigned long * count);
+
+// returns start times of all rows, NULL for snapshots older than version 2
+const uint64_t * get_snap_starts(pgmap_snap * snap);
+
+// fills process_pagemap_t by row of snapshot, mappings are left NULL
+int get_snap_pgmap(pgmap_snap * snap, unsigned long row, process_pagemap_t * p_t);
+
+// name of column PGMAP_COL_* (same as item of process_pagemap_t) and back,
+// find_pgmap_col() returns -1 for unknown name
+const char * get_pgmap_col_name(int col);
+int find_pgmap_col(const char * name);
+
+/////////// DIFFS ///////////////////////////////////////////
+
+#define PGMAP_DIFF_BOTH     0   // process is in both snapshots
+#define PGMAP_DIFF_NEW      1   // process is only in the second snapshot
+#define PGMAP_DIFF_GONE     2   // process is only in the first snapshot
+
+// difference of one process, processes are matched by pid and start time;
+// rows without start time (files older than version 2, failed read of
+// /proc/[pid]/stat) are matched by pid alone, so reused pid is not detected
+typedef struct pgmap_diff_t {
+    int pid;
+    int status;                 // PGMAP_DIFF_*
+    long row_a, row_b;          // rows in snapshots, -1 if missing
+    int64_t delta[PGMAP_COLS];  // b - a of all counters, pid item is 0
+} pgmap_diff_t;
+
+// difference of one mapping, mappings are matched by start or by inode and offset
+typedef struct pgmap_vma_diff_t {
+    int status;                 // PGMAP_DIFF_*
+    long vma_a, vma_b;          // indexes to get_snap_vmas(), -1 if missing
+    int64_t d_size;             // change of size in pages
+    int64_t d_res;              // change of resident pages (only with PFNs)
+    int64_t d_sdirty;           // change of soft-dirty pages
+} pgmap_vma_diff_t;
+
+// compares two snapshots and returns array of changed processes sorted by
+// delta of column sort_col (descending, or ascending if sort_col is
+// negative -(col+1)), count gets length; caller frees returned array
+pgmap_diff_t * diff_pgmap_snapshots(pgmap_snap * a, pgmap_snap * b, int sort_col, unsigned long * count);
+
+// compares mappings of row_a in a with mappings of row_b in b, caller frees
+// returned array; needs snapshots with PGMAP_SNAP_VMAS
+pgmap_vma_diff_t * diff_pgmap_vmas(pgmap_snap * a, long row_a, pgmap_snap * b, long row_b, unsigned long * count);
+
+/////////// TIME SERIES /////////////////////////////////////
+
+struct pgmap_ring;
+typedef struct pgmap_ring pgmap_ring;
+
+// creates history of samples, every process gets ring buffer of size bytes
+// for delta encoded samples, the oldest ones are dropped when it is full
+pgmap_ring * create_pgmap_ring(unsigned int size);
+
+// appends all counters of opened table as sample of given time, processes
+// are matched by pid and start time (pid alone when start was not read),
+// histories of gone processes are dropped
+int add_pgmap_ring_sample(pgmap_ring * ring, pagemap_tbl * table, uint64_t time);
+
+// returns number of processes in history
+unsigned long get_pgmap_ring_procs(pgmap_ring * ring);
+
+// decodes up to max samples of idx-th process (oldest first), times gets
+// their times and values PGMAP_COLS counters of every sample; returns
+// number of samples or -1, with times or values NULL only number of samples
+int get_pgmap_ring_samples(pgmap_ring * ring, unsigned long idx, int * pid,
+        uint64_t * times, uint32_t * values, int max);
+
+// returns memory used by history in bytes
+unsigned long get_pgmap_ring_bytes(pgmap_ring * ring);
+
+void free_pgmap_ring(pgmap_ring * ring);
+
+/////////// SHARED MEMORY ///////////////////////////////////
+
+#define PGMAP_SHM_MAGIC     "PGMAPSHM"
+#define PGMAP_SHM_VERSION   1
+
+// shared memory segment starts by this header, followed by two slots with
+// snapshots (see pgmap_snap_hdr); publisher writes the slot which is not
+// current and then flips gen, readers validate slot by its seq
+typedef struct pgmap_shm_hdr {
+    char magic[8];          // PGMAP_SHM_MAGIC
+    uint32_t version;       // PGMAP_SHM_VERSION
+    uint32_t pad;
+    uint64_t gen;           // number of publications, gen & 1 is current slot
+    uint64_t seq[2];        // odd while slot is written
+    uint64_t off[2];        // offset of slot in segment
+    uint64_t cap[2];        // size reserved for slot
+    uint64_t len[2];        // size of snapshot in slot, 0 if empty
+} pgmap_shm_hdr;
+
+struct pgmap_shm;
+typedef struct pgmap_shm pgmap_shm;
+
+// writes snapshot of opened table into shared memory segment name (see
+// shm_open()), sections are PGMAP_SNAP_*; segment is removed by
+// free_pgmap_table()
+int publish_pgmap_table(pagemap_tbl * table, const char * name, int sections);
+
+// maps published segment read-only, no /proc access is needed
+pgmap_shm * attach_pgmap_shm(const char * name);
+
+// pins the latest publication and returns its view, NULL if nothing was
+// published yet; data read from the view are valid only if
+// check_pgmap_shm() succeeds after reading them
+pgmap_snap * pin_pgmap_shm(pgmap_shm * shm);
+
+// returns 0 if pinned publication was not overwritten since pin
+int check_pgmap_shm(pgmap_shm * shm);
+
+// fills p_t by next process of pinned publication (pins the latest one at
+// first call), returns 1, 0 at the end or -1 if publication was overwritten
+// meanwhile - next call starts again with the latest one
+int iterate_pgmap_shm(pgmap_shm * shm, process_pagemap_t * p_t);
+
+void detach_pgmap_shm(pgmap_shm * shm);
+
+/////////// VIEWS ///////////////////////////////////////////
+
+// page states of address range, filled by query_pgmap_view()
+typedef struct pgmap_residency_t {
+    unsigned long pages;        // pages of range up to end of address space
+    unsigned long resident;     // present in RAM
+    unsigned long swapped;      // in swap
+    unsigned long exclusive;    // mapped only by this process (kernel 4.2+)
+    unsigned long dirty;        // soft-dirty - written since last clear of soft-dirty
+                                //  bits (get_dirty_pgmap()) or since mapped
+} pgmap_residency_t;
+
+struct pgmap_view;
+typedef struct pgmap_view pgmap_view;
+
+// keeps /proc/[pid]/pagemap (0 = this process) open for repeated queries
+// of its own address ranges, no table is built and no maps are read;
+// one view is used by one thread at once
+pgmap_view * open_pgmap_view(int pid);
+
+// fills res by pages of [start, end), start is rounded down and end up to
+// page boundary; unmapped pages count only in pages; returns 0, 1 for bad
+// arguments or 2 when pagemap cannot be read (process exited)
+int query_pgmap_view(pgmap_view * view, unsigned long start, unsigned long end, pgmap_residency_t * res);
+
+void close_pgmap_view(pgmap_view * view);
 #endif
@@ -1,4 +1,4 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 
 # pagemapdata.py - module for utilization of pagemap interface
 # Copyright (C) 2010 Red Hat, Inc. All rights reserved.
@@ -22,6 +22,8 @@ import os
 import struct
 import resource
 
+import _pagemap
+
 class Error(Exception):
     '''
     Base exception for this module
@@ -65,22 +67,51 @@ class NoStatusAccess(Error):
     '''
     pass
 
+class NoSharedData(Error):
+    '''
+    Exception raised when shared memory segment does not exist or nothing
+    was published into it yet
+    '''
+    pass
+
+
+def column_index(*names):
+    '''
+    Returns indexes of counters in columns of _pagemap by their names
+    '''
+    columns = _pagemap.column_names()
+    return tuple(columns.index(name) for name in names)
+
 
 class PagemapData:
     '''
-    Class which encapsulate libpagemap operations
+    Class which encapsulate libpagemap operations, it is built on _pagemap
+    extension (make python) whose results are buffers shared with numpy
+    or memoryview without copying
+
+    kpagemap maps pid to (uss, pss, share, res, swap, cmd) in kB; cmd is
+    Name of /proc/[pid]/status as before, but pss is counted by libpagemap
+    in whole pages - it is still float, without the fraction of a page
+    which older versions summed from 1/count of every page
     '''
+    # rows of Table.columns() of counters kept in kpagemap
+    COLS = column_index('uss', 'pss', 'shr', 'res', 'swap')
+    PM_PRESENT = 1 << 63
+    PM_SWAP = 1 << 62
+    PM_PFRAME = (1 << 55) - 1
+
     def __init__(self):
-        self.kpagecount = '\0'
-        self.kpageflags = '\0'
+        self.kpagecount = memoryview(b'')
+        self.kpageflags = memoryview(b'')
         self.kpagemap = {}
         self.pids = []
         self.pagecount = 0
         self.pagesize = resource.getpagesize()
         try:
-            open("/proc/kpagecount","r",0)
-            open("/proc/kpageflags","r",0)
-        except:
+            open("/proc/kpagecount","rb",0).close()
+            open("/proc/kpageflags","rb",0).close()
+            self.table = _pagemap.Table()
+        except (IOError, OSError):
             raise NoPagemapError()
         self.refresh_pagecount()
 
@@ -89,28 +120,32 @@ class PagemapData:
         Refreshes pid's of processes in /proc directory
         '''
         self.kpagemap = {}
-        dirs = os.listdir('/proc')
-        self.pids = []
-        for index, d in enumerate(dirs):
-            try:
-                int(d)
-                self.pids.append(d)
-            except ValueError:
-                pass
+        self.table.refresh()
+        self.pids = [str(pid) for pid in self.table.pids()]
+
+    def fill_kpagemap(self):
+        '''
+        Converts opened table into kpagemap entries, returns their pids
+        '''
+        kb = self.pagesize >> 10
+        cols = memoryview(self.table.columns()).tolist()
+        cols = [cols[c] for c in self.COLS]
+        pids = [str(pid) for pid in self.table.pids()]
+        for row, (pid, cmd) in enumerate(zip(pids, self.table.cmdlines())):
+            uss, pss, share, res, swap = [c[row]*kb for c in cols]
+            self.kpagemap[pid] = (uss, float(pss), share, res, swap, cmd)
+        return pids
 
     def refresh_pgmap(self):
         '''
         Refresh counts based on pagemap file
         '''
         self.fill_count()
-        for p in self.pids:
-            try:
-                self.kpagemap[p] = self.count_stats(p)
-            except:
-                print 'pagemap error for pid %s' % p
-        #for k in sorted(self.kpagemap.iterkeys()):
-        #    print '%s = uss %d pss %d share %d res %d swap %d' % (k, self.kpagemap[k][0], self.kpagemap[k][1],self.kpagemap[k][2],self.kpagemap[k][3],self.kpagemap[k][4])
-
+        try:
+            self.table.open()
+        except OSError:
+            raise NoPagemapAccess()
+        self.fill_kpagemap()
 
     def read_maps(self, pid):
         '''
@@ -118,14 +153,14 @@ class PagemapData:
         '''
         areas = []
         try:
-            m_file = open(''.join(['/proc/',str(pid),'/maps']),"r",0)
-        except:
+            m_file = open(''.join(['/proc/',str(pid),'/maps']),"r")
+        except (IOError, OSError):
             raise NoMapsAccess(pid)
 
         for line in m_file:
             line = line.replace('-',' ')
             address = line.split(None,2)
-            areas.append((long(address[0],16), long(address[1],16)))
+            areas.append((int(address[0],16), int(address[1],16)))
 
         m_file.close()
         return areas
@@ -134,54 +169,13 @@ class PagemapData:
         '''
         Return tuple of statistics for one PID
         '''
-        uss = 0
-        pss = 0.0
-        share = 0
-        res = 0
-        swap = 0
-        cmd = ''
-
-        try:
-            maps = self.read_maps(pid)
-        except NoMapsAccess:
-            print 'No maps access for %d' % pid
-        name = ''.join(['/proc/',str(pid),'/pagemap'])
         try:
-            p_file = open(name,"rb", 0)
-        except: 
-            raise NoPagemapAccess(name)
-
-        for area in maps:
-            try:
-                p_file.seek(area[0] / self.pagesize * 8)
-                data = p_file.read((area[1]-area[0])/self.pagesize*8)
-            except:
-                continue
-            if len(data):
-                numbers = struct.unpack("Q"*(len(data)/8), data)
-
-                for number in numbers:
-                    uss_n, pss_n, share_n, res_n, swap_n = self.process_pfn(number)
-                    uss += uss_n*(self.pagesize >> 10)
-                    pss += float(pss_n)*(self.pagesize >> 10)
-                    share += share_n*(self.pagesize >> 10)
-                    res += res_n*(self.pagesize >> 10)
-                    swap += swap_n*(self.pagesize >> 10)
-
-        p_file.close()
-        
-        # Name of process examination
-        name = ''.join(['/proc/',str(pid),'/status'])
-        try:
-            p_file = open(name,"r", 0)
-        except: 
-            raise NoStatusAccess(name)
-
-        cmd = p_file.readline()[6:-1]
-        
-        p_file.close()
-
-        return uss,pss,share,res,swap,cmd
+            self.table.open(int(pid))
+        except OSError:
+            raise NoPagemapAccess(pid)
+        if str(pid) not in self.fill_kpagemap():
+            raise NoPagemapAccess(pid)
+        return self.kpagemap[str(pid)]
 
     def process_pfn(self, number):
         '''
@@ -194,23 +188,14 @@ class PagemapData:
         swap = 0
 
         # checks if is present or in swap
-        if number & (1L << 63):
+        if number & self.PM_PRESENT:
             res = 1
         else:
-            if number & (1L << 62):
+            if number & self.PM_SWAP:
                 swap = 1
             return uss, pss, share, res, swap
-        # add pfn count
-        pfn = number & ((1L << 55) - 1)
-
-        # get page count
-        pos = pfn*8
-        try:
-            cnt = self.kpagecount[pos:pos+8]
-        except:
-            cnt = '\0'*8
-        count = struct.unpack("Q", cnt)[0]
 
+        count = self.get_count(number & self.PM_PFRAME)
         if count:
             if count == 1:
                 uss = 1
@@ -219,18 +204,13 @@ class PagemapData:
             pss = 1/float(count)
 
         return uss, pss, share, res, swap
-            
+
     def refresh_pagecount(self):
         '''
         Get size of physical memory - alternative would be
         size of /proc/kcore
         '''
-        f = open("/proc/meminfo", "r", 0)
-        for line in f:
-            if line.find("MemTotal") != -1:
-                self.pagecount = long(line.split()[1])/4
-                break
-        f.close()
+        self.pagecount = self.table.ram_pages()
 
     def get_pagecount(self):
         '''
@@ -241,49 +221,98 @@ class PagemapData:
 
     def fill_count(self):
         '''
-        Map /proc/kpagecount to memory
+        Reads /proc/kpagecount, kpagecount is array of uint64 then
         '''
         try:
-            kcnt = open("/proc/kpagecount","rb",0)
-            self.kpagecount = kcnt.read(8*self.pagecount*2)
-            kcnt.close()
-        except:
-            self.kpagecount = '\0'*self.pagecount
+            self.kpagecount = memoryview(self.table.kpagecount())
+        except OSError:
+            raise NoKpagecountAccess()
 
     def fill_flags(self):
         '''
-        Map /proc/kpageflags to memory
+        Reads /proc/kpageflags, kpageflags is array of uint64 then
         '''
         try:
-            kflg = open("/proc/kpageflags","rb",0)
-            self.kpageflags = open("/proc/kpageflags","rb",0).read(8*self.pagecount)
-            kflg.close()
-        except:
-            self.kpageflags = '\0'*self.pagecount
+            self.kpageflags = memoryview(self.table.kpageflags())
+        except OSError:
+            raise NoKpageflagsAccess()
 
     def get_count(self,page):
         '''
-        Return 8-byte tuple for selected page -- may be bottleneck?
+        Return mapcount of selected page
         '''
-        pos = page*8
-        try:
-            cnt = self.kpagecount[pos:pos+8]
-        except:
-            cnt = '\0'*8
-        return struct.unpack("Q", cnt)[0]
+        if page < len(self.kpagecount):
+            return self.kpagecount[page]
+        return 0
 
     def get_flags(self,page):
         '''
-        Return 8-byte tuple for selected page -- may be bottleneck?
+        Return flags of selected page
+        '''
+        if page < len(self.kpageflags):
+            return self.kpageflags[page]
+        return 0
+
+    def get_page_stats(self, combo=()):
+        '''
+        Return (pages, flags, mapcounts, combos) of whole physical memory
+        from one native pass - flags maps kpageflags names to numbers of
+        pages, mapcounts is list of numbers of pages by mapcount (last item
+        counts all higher ones) and combos maps tuples of names of combo
+        flags set together to numbers of pages
         '''
-        pos = page*8
+        names = _pagemap.kpf_names()
+        bits = [names.index(name) for name in combo]
+        mask = 0
+        for bit in bits:
+            mask |= 1 << bit
         try:
-            cnt = self.kpageflags[pos:pos+8]
-        except:
-            cnt = '\0'*8
-        return struct.unpack("Q", cnt)[0]
-        
+            stats = self.table.pages(mask)
+        except OSError:
+            raise NoKpageflagsAccess()
+        flags = memoryview(stats['flags']).tolist()
+        flags = dict((names[bit], n) for bit, n in enumerate(flags) if names[bit] and n)
+        # k-th bit of index of combos is k-th lowest bit of mask
+        bits.sort()
+        combos = {}
+        for index, n in enumerate(memoryview(stats['combos']).tolist()):
+            if n:
+                combos[tuple(names[bit] for k, bit in enumerate(bits) if index & (1 << k))] = n
+        return stats['pages'], flags, memoryview(stats['mapcount']).tolist(), combos
+
     def refresh_data(self):
         pass
 
 
+class SharedPagemap:
+    '''
+    Reads tables published by pgmap --publish (publish_pgmap_table() of
+    libpagemap) from shared memory - no /proc access nor root is needed
+    '''
+    COLS = PagemapData.COLS
+
+    def __init__(self, name):
+        try:
+            self.shm = _pagemap.Shared(name)
+        except OSError:
+            raise NoSharedData(name)
+        self.name = name
+        self.kpagemap = {}
+        self.pids = []
+
+    def refresh_pgmap(self):
+        '''
+        Fills kpagemap like PagemapData.refresh_pgmap() does
+        '''
+        try:
+            pagesize, columns, cmds = self.shm.read()
+        except OSError:
+            raise NoSharedData(self.name)
+        kb = pagesize >> 10
+        columns = memoryview(columns).tolist()
+        cols = [columns[c] for c in self.COLS]
+        self.kpagemap = {}
+        self.pids = [str(pid) for pid in columns[column_index('pid')[0]]]
+        for row, (pid, cmd) in enumerate(zip(self.pids, cmds)):
+            uss, pss, share, res, swap = [c[row]*kb for c in cols]
+            self.kpagemap[pid] = (uss, float(pss), share, res, swap, cmd)
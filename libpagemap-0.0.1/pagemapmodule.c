@@ -0,0 +1,691 @@
+// pagemapmodule - python binding of libpagemap
+// Copyright (C) 2010 Red Hat, Inc. All rights reserved.
+//
+//     This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "libpagemap.h"
+
+// Buffer - memory filled by libpagemap, exported by buffer protocol so
+// memoryview() or numpy.asarray() use it without copying
+typedef struct {
+    PyObject_HEAD
+    void * data;
+    const char * format;        // struct module format of one item
+    Py_ssize_t itemsize;
+    int ndim;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} BufferObject;
+
+// methods release the GIL during scans, lock serializes them on one table
+// because refresh() and open() free processes which the others read
+typedef struct {
+    PyObject_HEAD
+    pagemap_tbl * table;
+    PyThread_type_lock lock;
+} TableObject;
+
+// publication of pgmap --publish, methods keep the GIL as reads are short
+typedef struct {
+    PyObject_HEAD
+    pgmap_shm * shm;
+} SharedObject;
+
+static PyTypeObject BufferType;
+static PyTypeObject TableType;
+static PyTypeObject SharedType;
+
+// new_buffer - data is freed with buffer, strides are C-contiguous
+static PyObject * new_buffer(void * data, const char * format, Py_ssize_t itemsize,
+        int ndim, Py_ssize_t rows, Py_ssize_t cols)
+{
+    BufferObject * self;
+
+    self = PyObject_New(BufferObject, &BufferType);
+    if (!self) {
+        free(data);
+        return NULL;
+    }
+    self->data = data;
+    self->format = format;
+    self->itemsize = itemsize;
+    self->ndim = ndim;
+    self->shape[0] = rows;
+    self->shape[1] = cols;
+    self->strides[0] = ndim == 2 ? cols*itemsize : itemsize;
+    self->strides[1] = itemsize;
+    return (PyObject *) self;
+}
+
+static void buffer_dealloc(BufferObject * self)
+{
+    free(self->data);
+    PyObject_Del(self);
+}
+
+static int buffer_getbuffer(BufferObject * self, Py_buffer * view, int flags)
+{
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "pagemap buffers are read-only");
+        return -1;
+    }
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->shape[0]*(self->ndim == 2 ? self->shape[1] : 1)*self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *) self->format : NULL;
+    view->ndim = self->ndim;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static Py_ssize_t buffer_length(BufferObject * self)
+{
+    return self->shape[0];
+}
+
+static PyBufferProcs buffer_as_buffer = {
+    (getbufferproc) buffer_getbuffer,
+    NULL,
+};
+
+static PySequenceMethods buffer_as_sequence = {
+    (lenfunc) buffer_length,
+};
+
+static PyTypeObject BufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_pagemap.Buffer",
+    sizeof(BufferObject),
+    0,
+    (destructor) buffer_dealloc,
+};
+
+/////////// Table //////////////////////////////////////////
+
+// table_lock - takes lock of table without blocking other Python threads,
+// -1 with exception when table is not initialized
+static int table_lock(TableObject * self)
+{
+    if (!self->lock) {
+        PyErr_SetString(PyExc_ValueError, "table is not initialized");
+        return -1;
+    }
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    if (!self->table) {
+        PyThread_release_lock(self->lock);
+        PyErr_SetString(PyExc_ValueError, "table is not initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static inline void table_unlock(TableObject * self)
+{
+    PyThread_release_lock(self->lock);
+}
+
+static int table_init(TableObject * self, PyObject * args, PyObject * kwds)
+{
+    static char * kwlist[] = {"flags", NULL};
+    pagemap_tbl * table;
+    int flags = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &flags))
+        return -1;
+    if (!self->lock && !(self->lock = PyThread_allocate_lock())) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    table = init_pgmap_table(NULL);
+    if (!table) {
+        PyErr_SetString(PyExc_OSError, "pagemap interface is not available");
+        return -1;
+    }
+    set_pgmap_flags(table, flags);
+    // __init__() called again replaces table
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+    free_pgmap_table(self->table);
+    self->table = table;
+    table_unlock(self);
+    return 0;
+}
+
+static void table_dealloc(TableObject * self)
+{
+    free_pgmap_table(self->table);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+#define LOCK_TABLE(self) \
+    if (table_lock(self) < 0) \
+        return NULL;
+
+static PyObject * table_refresh(TableObject * self, PyObject * unused)
+{
+    pagemap_tbl * ret;
+
+    LOCK_TABLE(self);
+    Py_BEGIN_ALLOW_THREADS
+    ret = init_pgmap_table(self->table);
+    Py_END_ALLOW_THREADS
+    if (!ret) {
+        // table is freed by init_pgmap_table() on error
+        self->table = NULL;
+        table_unlock(self);
+        PyErr_SetString(PyExc_OSError, "cannot read /proc");
+        return NULL;
+    }
+    table_unlock(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject * table_open(TableObject * self, PyObject * args)
+{
+    pagemap_tbl * ret;
+    int pid = 0;
+
+    if (!PyArg_ParseTuple(args, "|i", &pid))
+        return NULL;
+    LOCK_TABLE(self);
+    Py_BEGIN_ALLOW_THREADS
+    ret = open_pgmap_table(self->table, pid);
+    Py_END_ALLOW_THREADS
+    table_unlock(self);
+    if (!ret) {
+        PyErr_SetString(PyExc_OSError, "cannot scan processes");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject * table_pids(TableObject * self, PyObject * unused)
+{
+    PyObject * list, * item;
+    process_pagemap_t * p_t;
+    pgmap_iter it;
+
+    LOCK_TABLE(self);
+    list = PyList_New(0);
+    if (!list)
+        goto out;
+    init_pgmap_iter(self->table, &it);
+    while ((p_t = next_pgmap_iter(&it))) {
+        item = PyLong_FromLong(p_t->pid);
+        if (!item || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(list);
+            goto out;
+        }
+        Py_DECREF(item);
+    }
+out:
+    table_unlock(self);
+    return list;
+}
+
+static PyObject * table_cmdlines(TableObject * self, PyObject * unused)
+{
+    PyObject * list, * item;
+    process_pagemap_t * p_t;
+    pgmap_iter it;
+    size_t len;
+
+    LOCK_TABLE(self);
+    list = PyList_New(0);
+    if (!list)
+        goto out;
+    init_pgmap_iter(self->table, &it);
+    while ((p_t = next_pgmap_iter(&it))) {
+        len = strcspn(p_t->cmdline, "\n");
+        item = PyUnicode_DecodeUTF8(p_t->cmdline, len, "replace");
+        if (!item || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            Py_CLEAR(list);
+            goto out;
+        }
+        Py_DECREF(item);
+    }
+out:
+    table_unlock(self);
+    return list;
+}
+
+// columns - PGMAP_COLS x processes array of uint32, rows in pids() order
+static PyObject * table_columns(TableObject * self, PyObject * unused)
+{
+    pgmap_columns columns;
+    void * data;
+    int ret;
+
+    LOCK_TABLE(self);
+    ret = get_pgmap_columns(self->table, &columns);
+    table_unlock(self);
+    if (ret != 0)
+        return PyErr_NoMemory();
+    // all columns live in one block starting by the first one
+    data = columns.cols[0];
+    free(columns.rows);
+    return new_buffer(data, "I", sizeof(uint32_t), 2, PGMAP_COLS, columns.n);
+}
+
+// read_kpage - reads count items of kpagecount or kpageflags from page
+static PyObject * read_kpage(TableObject * self, PyObject * args, int flags)
+{
+    unsigned long long page = 0;
+    long long count = -1;
+    uint64_t * data;
+    long got;
+
+    if (!PyArg_ParseTuple(args, "|KL", &page, &count))
+        return NULL;
+    LOCK_TABLE(self);
+    if (count < 0) {
+        count = get_ram_size_in_pages(self->table) + 1;
+        count = (unsigned long long) count > page ? count - (long long) page : 0;
+    }
+    data = malloc((count ? count : 1)*sizeof(uint64_t));
+    if (!data) {
+        table_unlock(self);
+        return PyErr_NoMemory();
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if (flags)
+        got = get_kpgflg_block(self->table, page, data, count);
+    else
+        got = get_kpgcnt_block(self->table, page, data, count);
+    Py_END_ALLOW_THREADS
+    table_unlock(self);
+    if (got < 0) {
+        free(data);
+        PyErr_SetString(PyExc_OSError, flags ? "cannot read /proc/kpageflags" :
+                "cannot read /proc/kpagecount");
+        return NULL;
+    }
+    return new_buffer(data, "Q", sizeof(uint64_t), 1, got, 0);
+}
+
+static PyObject * table_kpagecount(TableObject * self, PyObject * args)
+{
+    return read_kpage(self, args, 0);
+}
+
+static PyObject * table_kpageflags(TableObject * self, PyObject * args)
+{
+    return read_kpage(self, args, 1);
+}
+
+static PyObject * table_contig_histogram(TableObject * self, PyObject * args)
+{
+    unsigned long * hist;
+    int pid;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "i", &pid))
+        return NULL;
+    hist = calloc(PGMAP_ORDERS, sizeof(unsigned long));
+    if (!hist)
+        return PyErr_NoMemory();
+    if (table_lock(self) < 0) {
+        free(hist);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ret = get_contig_pgmap(self->table, pid, hist);
+    Py_END_ALLOW_THREADS
+    table_unlock(self);
+    if (ret != 0) {
+        free(hist);
+        PyErr_SetString(PyExc_OSError, "process is not in table or not root");
+        return NULL;
+    }
+    return new_buffer(hist, "L", sizeof(unsigned long), 1, PGMAP_ORDERS, 0);
+}
+
+// copy_buffer - buffer of copy of small array
+static PyObject * copy_buffer(const void * src, const char * format, Py_ssize_t itemsize, Py_ssize_t n)
+{
+    void * data;
+
+    data = malloc(n*itemsize);
+    if (!data)
+        return PyErr_NoMemory();
+    memcpy(data, src, n*itemsize);
+    return new_buffer(data, format, itemsize, 1, n, 0);
+}
+
+// pages - dictionary of get_pages_pgmap() results
+static PyObject * table_pages(TableObject * self, PyObject * args)
+{
+    unsigned long long combo_mask = 0;
+    pgmap_pages_t * pages;
+    PyObject * flags, * mapcount, * combos, * ret = NULL;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "|K", &combo_mask))
+        return NULL;
+    pages = malloc(sizeof(pgmap_pages_t));
+    if (!pages)
+        return PyErr_NoMemory();
+    if (table_lock(self) < 0) {
+        free(pages);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ok = get_pages_pgmap(self->table, combo_mask, pages) == 0;
+    Py_END_ALLOW_THREADS
+    table_unlock(self);
+    if (!ok) {
+        free(pages);
+        PyErr_SetString(PyExc_OSError, "page flags need root and at most "
+                "PGMAP_COMBO_BITS bits of combo_mask");
+        return NULL;
+    }
+    flags = copy_buffer(pages->flags, "L", sizeof(unsigned long), PGMAP_KPF_BITS);
+    mapcount = copy_buffer(pages->mapcount, "L", sizeof(unsigned long), PGMAP_MAPCOUNTS);
+    combos = copy_buffer(pages->combos, "L", sizeof(unsigned long),
+            1 << __builtin_popcountll(combo_mask));
+    if (flags && mapcount && combos)
+        ret = Py_BuildValue("{s:k,s:O,s:O,s:K,s:O}", "pages", pages->pages,
+                "flags", flags, "mapcount", mapcount, "combo_mask", combo_mask,
+                "combos", combos);
+    Py_XDECREF(flags);
+    Py_XDECREF(mapcount);
+    Py_XDECREF(combos);
+    free(pages);
+    return ret;
+}
+
+static PyObject * table_physical(TableObject * self, PyObject * unused)
+{
+    unsigned long shared, free_pg, nonshared;
+    int ret;
+
+    LOCK_TABLE(self);
+    Py_BEGIN_ALLOW_THREADS
+    ret = get_physical_pgmap(self->table, &shared, &free_pg, &nonshared);
+    Py_END_ALLOW_THREADS
+    table_unlock(self);
+    if (ret != 0) {
+        PyErr_SetString(PyExc_OSError, "physical memory stats need root");
+        return NULL;
+    }
+    return Py_BuildValue("(kkk)", shared, free_pg, nonshared);
+}
+
+static PyObject * table_ram_pages(TableObject * self, PyObject * unused)
+{
+    unsigned long long pages;
+
+    LOCK_TABLE(self);
+    pages = get_ram_size_in_pages(self->table);
+    table_unlock(self);
+    return PyLong_FromUnsignedLongLong(pages);
+}
+
+static PyMethodDef table_methods[] = {
+    {"refresh", (PyCFunction) table_refresh, METH_NOARGS,
+        "refresh() - rereads list of processes from /proc"},
+    {"open", (PyCFunction) table_open, METH_VARARGS,
+        "open(pid=0) - scans all processes or only pid"},
+    {"pids", (PyCFunction) table_pids, METH_NOARGS,
+        "pids() - list of pids in table order"},
+    {"cmdlines", (PyCFunction) table_cmdlines, METH_NOARGS,
+        "cmdlines() - list of command lines in table order"},
+    {"columns", (PyCFunction) table_columns, METH_NOARGS,
+        "columns() - buffer of uint32 counters, shape (len(column_names()), processes)"},
+    {"kpagecount", (PyCFunction) table_kpagecount, METH_VARARGS,
+        "kpagecount(page=0, count=all) - buffer of uint64 mapcounts"},
+    {"kpageflags", (PyCFunction) table_kpageflags, METH_VARARGS,
+        "kpageflags(page=0, count=all) - buffer of uint64 page flags"},
+    {"contig_histogram", (PyCFunction) table_contig_histogram, METH_VARARGS,
+        "contig_histogram(pid) - buffer of runs of contiguous pages by log2 of length"},
+    {"pages", (PyCFunction) table_pages, METH_VARARGS,
+        "pages(combo_mask=0) - dict of pages, buffers of flags (pages by kpageflags bit),\n"
+        "mapcount (pages by mapcount, last item counts all higher) and combos\n"
+        "(pages by combination of combo_mask bits) from one pass over physical memory"},
+    {"physical", (PyCFunction) table_physical, METH_NOARGS,
+        "physical() - (shared, free, nonshared) pages of physical memory"},
+    {"ram_pages", (PyCFunction) table_ram_pages, METH_NOARGS,
+        "ram_pages() - number of pages of physical memory"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject TableType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_pagemap.Table",
+    sizeof(TableObject),
+    0,
+    (destructor) table_dealloc,
+};
+
+/////////// Shared /////////////////////////////////////////
+
+#define SHARED_RETRIES  100     // reads of publications overwritten meanwhile
+
+#define COL_OFFSET(item) offsetof(process_pagemap_t, item),
+static const size_t col_offsets[PGMAP_COLS] = { PGMAP_COUNTERS(COL_OFFSET) };
+
+static int shared_init(SharedObject * self, PyObject * args, PyObject * kwds)
+{
+    static char * kwlist[] = {"name", NULL};
+    const char * name;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name))
+        return -1;
+    detach_pgmap_shm(self->shm);
+    self->shm = attach_pgmap_shm(name);
+    if (!self->shm) {
+        PyErr_Format(PyExc_OSError, "cannot attach %s, it is missing or of other version", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void shared_dealloc(SharedObject * self)
+{
+    detach_pgmap_shm(self->shm);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// read_rows - rows of pinned publication into columns and cmdlines, 0 when
+// publication was overwritten meanwhile, -1 with exception
+static int read_rows(pgmap_shm * shm, unsigned long n, uint32_t * data, PyObject * cmds)
+{
+    process_pagemap_t p_t;
+    PyObject * item;
+    unsigned long row = 0;
+    int ret;
+
+    while ((ret = iterate_pgmap_shm(shm, &p_t)) == 1 && row < n) {
+        for (int c = 0; c < PGMAP_COLS; c++)
+            data[(unsigned long) c*n + row] = *(uint32_t *) ((char *) &p_t + col_offsets[c]);
+        item = PyUnicode_DecodeUTF8(p_t.cmdline, strcspn(p_t.cmdline, "\n"), "replace");
+        if (!item)
+            return -1;
+        PyList_SET_ITEM(cmds, row, item);
+        row++;
+    }
+    return ret == 0 && row == n;
+}
+
+// read - (pagesize, columns, cmdlines) of the latest publication
+static PyObject * shared_read(SharedObject * self, PyObject * unused)
+{
+    const pgmap_snap_hdr * hdr;
+    PyObject * cmds, * columns;
+    pgmap_snap * snap;
+    unsigned long n;
+    uint32_t * data;
+    int ret;
+
+    if (!self->shm) {
+        PyErr_SetString(PyExc_ValueError, "segment is not attached");
+        return NULL;
+    }
+    for (int i = 0; i < SHARED_RETRIES; i++) {
+        snap = pin_pgmap_shm(self->shm);
+        if (!snap) {
+            PyErr_SetString(PyExc_OSError, "nothing is published");
+            return NULL;
+        }
+        hdr = get_snap_header(snap);
+        n = hdr->n_procs;
+        data = malloc((n ? n : 1)*PGMAP_COLS*sizeof(uint32_t));
+        if (!data)
+            return PyErr_NoMemory();
+        cmds = PyList_New(n);
+        if (!cmds) {
+            free(data);
+            return NULL;
+        }
+        ret = read_rows(self->shm, n, data, cmds);
+        if (ret == 1) {
+            columns = new_buffer(data, "I", sizeof(uint32_t), 2, PGMAP_COLS, n);
+            if (!columns) {
+                Py_DECREF(cmds);
+                return NULL;
+            }
+            return Py_BuildValue("(INN)", hdr->pagesize, columns, cmds);
+        }
+        free(data);
+        Py_DECREF(cmds);
+        if (ret < 0)
+            return NULL;
+    }
+    PyErr_SetString(PyExc_OSError, "publication is overwritten faster than it is read");
+    return NULL;
+}
+
+static PyMethodDef shared_methods[] = {
+    {"read", (PyCFunction) shared_read, METH_NOARGS,
+        "read() - (pagesize, columns, cmdlines) of the latest publication, columns\n"
+        "are uint32 buffer of shape (len(column_names()), processes) like Table.columns()"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject SharedType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_pagemap.Shared",
+    sizeof(SharedObject),
+    0,
+    (destructor) shared_dealloc,
+};
+
+/////////// module /////////////////////////////////////////
+
+static PyObject * column_names(PyObject * module, PyObject * unused)
+{
+    PyObject * names;
+
+    names = PyTuple_New(PGMAP_COLS);
+    if (!names)
+        return NULL;
+    for (int c = 0; c < PGMAP_COLS; c++)
+        PyTuple_SET_ITEM(names, c, PyUnicode_FromString(get_pgmap_col_name(c)));
+    return names;
+}
+
+static PyObject * kpf_names(PyObject * module, PyObject * unused)
+{
+    PyObject * names, * name;
+
+    names = PyTuple_New(PGMAP_KPF_BITS);
+    if (!names)
+        return NULL;
+    for (int bit = 0; bit < PGMAP_KPF_BITS; bit++) {
+        if (get_kpf_name(bit)) {
+            name = PyUnicode_FromString(get_kpf_name(bit));
+        } else {
+            name = Py_None;
+            Py_INCREF(name);
+        }
+        PyTuple_SET_ITEM(names, bit, name);
+    }
+    return names;
+}
+
+static PyMethodDef module_methods[] = {
+    {"column_names", column_names, METH_NOARGS,
+        "column_names() - names of rows of Table.columns()"},
+    {"kpf_names", kpf_names, METH_NOARGS,
+        "kpf_names() - names of kpageflags bits, None for unused ones"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef pagemap_module = {
+    PyModuleDef_HEAD_INIT,
+    "_pagemap",
+    "binding of libpagemap, results are exported as buffers",
+    -1,
+    module_methods,
+};
+
+PyMODINIT_FUNC PyInit__pagemap(void)
+{
+    PyObject * module;
+
+    BufferType.tp_flags = Py_TPFLAGS_DEFAULT;
+    BufferType.tp_doc = "read-only array filled by libpagemap";
+    BufferType.tp_as_buffer = &buffer_as_buffer;
+    BufferType.tp_as_sequence = &buffer_as_sequence;
+    TableType.tp_flags = Py_TPFLAGS_DEFAULT;
+    TableType.tp_doc = "Table(flags=0) - processes scanned by libpagemap";
+    TableType.tp_new = PyType_GenericNew;
+    TableType.tp_init = (initproc) table_init;
+    TableType.tp_methods = table_methods;
+    SharedType.tp_flags = Py_TPFLAGS_DEFAULT;
+    SharedType.tp_doc = "Shared(name) - segment published by pgmap --publish, attached read-only";
+    SharedType.tp_new = PyType_GenericNew;
+    SharedType.tp_init = (initproc) shared_init;
+    SharedType.tp_methods = shared_methods;
+    if (PyType_Ready(&BufferType) < 0 || PyType_Ready(&TableType) < 0 ||
+            PyType_Ready(&SharedType) < 0)
+        return NULL;
+    module = PyModule_Create(&pagemap_module);
+    if (!module)
+        return NULL;
+    Py_INCREF(&BufferType);
+    PyModule_AddObject(module, "Buffer", (PyObject *) &BufferType);
+    Py_INCREF(&TableType);
+    PyModule_AddObject(module, "Table", (PyObject *) &TableType);
+    Py_INCREF(&SharedType);
+    PyModule_AddObject(module, "Shared", (PyObject *) &SharedType);
+    PyModule_AddIntConstant(module, "PAGEMAP_PFNS", PAGEMAP_PFNS);
+    PyModule_AddIntConstant(module, "PAGEMAP_RMAP", PAGEMAP_RMAP);
+    PyModule_AddIntConstant(module, "PAGEMAP_INCR", PAGEMAP_INCR);
+    PyModule_AddIntConstant(module, "PAGEMAP_EXCL", PAGEMAP_EXCL);
+    PyModule_AddIntConstant(module, "PGMAP_COMBO_BITS", PGMAP_COMBO_BITS);
+    return module;
+}
@@ -21,171 +21,211 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <stddef.h>
 #include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "libpagemap.h"
 
 #define NON_ROOT_HEAD "pid,res,swap"
+#define EXCL_HEAD     "pid,uss,swap,res,shr,n_anon,n_file"
 #define ROOT_HEAD     "pid,uss,pss,swap,res,shr"
 #define ROOT_HEAD_FLG "n_drt,n_uptd,n_wback,n_err,n_lck,n_slab,n_buddy," \
                       "n_cmpndh,n_cmpndt,n_ksm,n_hwpois,n_huge,n_npage,n_mmap," \
                       "n_anon,n_swpche,n_swpbck,n_onlru,n_actlru,n_unevctb," \
                       "n_referenced,n_recycle"
 
+#define IDLE_HEAD     "n_hot,n_cold"
+#define DIRTY_HEAD    "n_sdirty"
+#define KSM_HEAD      "n_zero,n_dup"
+#define FRAG_ROW      "Pages:       %lu kB\nFree:        %lu kB\n2M blocks:   %lu total, %lu free, %lu movable, %lu huge\n" \
+                      "1G blocks:   %lu total, %lu free, %lu movable\nFree runs:  "
+#define KSM_ROW       "KSM scanned: %lu kB\nZero:        %lu kB\nDuplicate:   %lu kB\nShared:      %lu kB\n--\n"
+
 #define STAT_ROW      "Total:     %lu kB\nFree:      %lu kB\nShared:    %lu kB\nNonshared: %lu kB\n--\n"
 #define HELP_STR      "pgmap - utility for getting information from kernel's pagemap interface\n" \
-                      "Usage: pgmap [-ndpFPs]\n " \
+                      "Usage: pgmap [-nxdpFPscjbIDVvMKfmwr]\n " \
                       "\t -h :for this info\n"\
                       "\t -n :simulate non-root = only RES and SWAP\n"\
+                      "\t -x :USS, SHR, ANON and FILE from pagemap exclusive bit, fast and without root (no PSS)\n"\
                       "\t -d :without headers\n"\
                       "\t -p :prints numbers in pages (instead of default kB)\n"\
                       "\t -F :prints info from kpageflags file\n"\
                       "\t -P pid :prints only specified pid\n"\
-                      "\t -s [uss|pss|shr|res|swap|pid][+-] :sort by given stat\n"\
-                      "\t -c :prints in csv format\n"
+                      "\t -s stat[+-][,stat[+-]...] :sort by given stats (uss, pss, res, cmdline, n_*...)\n"\
+                      "\t -c :prints in csv format\n"\
+                      "\t -j :prints processes as JSON lines\n"\
+                      "\t -b :prints processes as binary records\n"\
+                      "\t -I ms[:count] :working set - pages accessed within interval (root)\n"\
+                      "\t -D ms[:count] :write rate - pages dirtied within interval\n"\
+                      "\t -V :prints mappings of processes (with -D)\n"\
+                      "\t -v :prints syscalls, pages and time of scan phases to stderr\n"\
+                      "\t -M pid,pid,... :prints matrix of memory shared among pids, only they are walked (root)\n"\
+                      "\t -K :KSM merge potential - zero and duplicate anonymous pages\n"\
+                      "\t -f :physical fragmentation and contiguity of processes (root)\n"\
+                      "\t -m :page flags and mapcounts of physical memory (root)\n"\
+                      "\t\t  --combo flag,flag,... counts combinations of given flags too\n"\
+                      "\t -w file :writes binary snapshot of scan into file\n"\
+                      "\t -r file|shm:name :prints binary snapshot from file or shared memory instead of scanning\n"\
+                      "\t --diff A B :prints changes between snapshots A and B\n"\
+                      "\t --daemon :rescans every --interval sec, keeps history of samples\n"\
+                      "\t\t  SIGUSR1 prints the history as csv, --ring bytes sets its size per process\n"\
+                      "\t --export [host:]port|unix:path :serves last scan of --daemon in Prometheus format\n"\
+                      "\t\t  --labels pid,cmdline,cgroup sets labels, --top N limits processes (-s sorts)\n"\
+                      "\t --publish name :publishes every scan of --daemon into shared memory\n"\
+                      "\t --record file :records everything read by scan into file\n"\
+                      "\t --replay file :scans recording instead of this system\n"\
+                      "\t --batch :keeps many reads of process walk in flight (io_uring if available)\n"\
+                      "\t --throttle rate=B,cpu=%,psi=avg10,pause=us :scans with budgets - pagemap bytes/s\n"\
+                      "\t\t  per process, CPU share, memory pressure backoff and pause between mappings\n"\
+                      "\t --trigger \"some|full stall_us window_us\" :waits for memory pressure and captures\n"\
+                      "\t\t  -w file.0 .. file.N-1 snapshots (--keep N, 8), --pressure file sets cgroup's\n"\
+                      "\t\t  memory.pressure instead of /proc/pressure/memory, up to 4 triggers\n"\
+                      "\t --uid N, --cgroup path, --pidns pid :only processes of real uid, of cgroup path\n"\
+                      "\t\t  or below it, of PID namespace of pid\n"
 #define BUFFSIZE       128
+#define SORT_KEYS      8
+#define OUT_BUFSIZE    (1 << 16)
+#define OUT_ROW_MAX    4096        // longest formatted row
+#define OUT_NAME       16          // bytes of field name in binary header
+#define TRIGGER_MAX    4           // PSI thresholds of --trigger
 
-#define DEF_PRINT(item) \
-    static unsigned long get_ ## item(process_pagemap_t * table) \
-    { \
-        return table->item; \
-    }
+#define OUT_TABLE      0
+#define OUT_CSV        1
+#define OUT_JSON       2
+#define OUT_BIN        3
 
-#define DEF_CMP(item) \
-    static int cmp_ ## item(process_pagemap_t ** table1, process_pagemap_t ** table2) \
-    { \
-        if ((*table1)->item > (*table2)->item) \
-            return 1; \
-        else if ((*table2)->item > (*table1)->item) \
-            return -1; \
-        return 0; \
-    }
+#define EXPORT_PID      0x1
+#define EXPORT_CMD      0x2
+#define EXPORT_CGROUP   0x4
+#define EXPORT_DEADLINE 5       // seconds for whole scrape, slow clients are dropped
+#define HTTP_OK         "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n" \
+                        "Content-Length: %lu\r\nConnection: close\r\n\r\n"
+#define HTTP_UNAVAIL    "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n" \
+                        "Connection: close\r\n\r\n"
 
 typedef struct header_t {
     const char * desc;
     const char * name;
     int width;
-    unsigned long (*prfun)(process_pagemap_t * table);
-    int (*sortfun)(process_pagemap_t **, process_pagemap_t **);
 } header_t;
 
 typedef struct header_list {
     header_t item;
+    int col;    // PGMAP_COL_*, -1 for cmdline
     struct header_list * next;
 } header_list;
 
-DEF_PRINT(pid);
-DEF_PRINT(uss);
-DEF_PRINT(pss);
-DEF_PRINT(swap);
-DEF_PRINT(res);
-DEF_PRINT(shr);
-DEF_PRINT(n_actlru);
-DEF_PRINT(n_anon);
-DEF_PRINT(n_buddy);
-DEF_PRINT(n_cmpndh);
-DEF_PRINT(n_cmpndt);
-DEF_PRINT(n_drt);
-DEF_PRINT(n_err);
-DEF_PRINT(n_huge);
-DEF_PRINT(n_hwpois);
-DEF_PRINT(n_ksm);
-DEF_PRINT(n_lck);
-DEF_PRINT(n_mmap);
-DEF_PRINT(n_npage);
-DEF_PRINT(n_onlru);
-DEF_PRINT(n_referenced);
-DEF_PRINT(n_slab);
-DEF_PRINT(n_swpche);
-DEF_PRINT(n_swpbck);
-DEF_PRINT(n_unevctb);
-DEF_PRINT(n_uptd);
-DEF_PRINT(n_wback);
-DEF_PRINT(n_recycle);
-
-DEF_CMP(pid);
-DEF_CMP(uss);
-DEF_CMP(pss);
-DEF_CMP(swap);
-DEF_CMP(res);
-DEF_CMP(shr);
-DEF_CMP(n_actlru);
-DEF_CMP(n_anon);
-DEF_CMP(n_buddy);
-DEF_CMP(n_cmpndh);
-DEF_CMP(n_cmpndt);
-DEF_CMP(n_drt);
-DEF_CMP(n_err);
-DEF_CMP(n_huge);
-DEF_CMP(n_hwpois);
-DEF_CMP(n_ksm);
-DEF_CMP(n_lck);
-DEF_CMP(n_mmap);
-DEF_CMP(n_npage);
-DEF_CMP(n_onlru);
-DEF_CMP(n_referenced);
-DEF_CMP(n_slab);
-DEF_CMP(n_swpche);
-DEF_CMP(n_swpbck);
-DEF_CMP(n_unevctb);
-DEF_CMP(n_uptd);
-DEF_CMP(n_wback);
-DEF_CMP(n_recycle);
-
-static char * get_cmdline(process_pagemap_t * table) 
-{
-    return table->cmdline;
-}
-static int cmp_cmdline(process_pagemap_t ** table1, process_pagemap_t ** table2)
-{
-    return strcmp((*table1)->cmdline, (*table2)->cmdline);
-}
+// offsets of PGMAP_COUNTERS items, all of them are 32-bit
+#define COL_OFFSET(item) offsetof(process_pagemap_t, item),
+static const size_t col_offsets[PGMAP_COLS] = { PGMAP_COUNTERS(COL_OFFSET) };
+
+#define COL_VALUE(p_t,col) (*(uint32_t *) ((char *) (p_t) + col_offsets[col]))
 
 // -1 width for strings like cmdline
 
-static header_t head_tbl[]={{"CMD     ",    "cmdline",       -1, (unsigned long (*)(process_pagemap_t * table)) get_cmdline     ,cmp_cmdline      },
-                            {"ACTLRU  ",    "n_actlru",       8, get_n_actlru    ,cmp_n_actlru     },
-                            {"ANON    ",    "n_anon",         8, get_n_anon      ,cmp_n_anon       },
-                            {"BUDDY   ",    "n_buddy",        8, get_n_buddy     ,cmp_n_buddy      },
-                            {"CMPNDH  ",    "n_cmpndh",       8, get_n_cmpndh    ,cmp_n_cmpndh     },
-                            {"CMPNDT  ",    "n_cmpndt",       8, get_n_cmpndt    ,cmp_n_cmpndt     },
-                            {"DRT     ",    "n_drt",          8, get_n_drt       ,cmp_n_drt        },
-                            {"ERR     ",    "n_err",          8, get_n_err       ,cmp_n_err        },
-                            {"HUGE    ",    "n_huge",         8, get_n_huge      ,cmp_n_huge       },
-                            {"HWPOIS  ",    "n_hwpois",       8, get_n_hwpois    ,cmp_n_hwpois     },
-                            {"KSM     ",    "n_ksm",          8, get_n_ksm       ,cmp_n_ksm        },
-                            {"LCK     ",    "n_lck",          8, get_n_lck       ,cmp_n_lck        },
-                            {"MMAP    ",    "n_mmap",         8, get_n_mmap      ,cmp_n_mmap       },
-                            {"NPAGE   ",    "n_npage",        8, get_n_npage     ,cmp_n_npage      },
-                            {"ONLRU   ",    "n_onlru",        8, get_n_onlru     ,cmp_n_onlru      },
-                            {"RECYCLE ",    "n_recycle",      8, get_n_recycle   ,cmp_n_recycle    },
-                            {"REF     ",    "n_referenced",   8, get_n_referenced,cmp_n_referenced },
-                            {"SLAB    ",    "n_slab",         8, get_n_slab      ,cmp_n_slab       },
-                            {"SWPBCK  ",    "n_swpbck",       8, get_n_swpbck    ,cmp_n_swpbck     },
-                            {"SWPCHE  ",    "n_swpche",       8, get_n_swpche    ,cmp_n_swpche     },
-                            {"UNEVCTB ",    "n_unevctb",      8, get_n_unevctb   ,cmp_n_unevctb    },
-                            {"UPTD    ",    "n_uptd",         8, get_n_uptd      ,cmp_n_uptd       },
-                            {"WBACK   ",    "n_wback",        8, get_n_wback     ,cmp_n_wback      },
-                            {"PID     ",    "pid",            8, get_pid         ,cmp_pid          },
-                            {"PSS     ",    "pss",            8, get_pss         ,cmp_pss          },
-                            {"RES     ",    "res",            8, get_res         ,cmp_res          },
-                            {"SHR     ",    "shr",            8, get_shr         ,cmp_shr          },
-                            {"SWAP    ",    "swap",           8, get_swap        ,cmp_swap         },
-                            {"USS     ",    "uss",            8, get_uss         ,cmp_uss          }};
+static header_t head_tbl[]={{"CMD     ",    "cmdline",       -1},
+                            {"ACTLRU  ",    "n_actlru",       8},
+                            {"ANON    ",    "n_anon",         8},
+                            {"BUDDY   ",    "n_buddy",        8},
+                            {"CMPNDH  ",    "n_cmpndh",       8},
+                            {"CMPNDT  ",    "n_cmpndt",       8},
+                            {"COLD    ",    "n_cold",         8},
+                            {"DRT     ",    "n_drt",          8},
+                            {"DUP     ",    "n_dup",          8},
+                            {"ERR     ",    "n_err",          8},
+                            {"FILE    ",    "n_file",         8},
+                            {"HOT     ",    "n_hot",          8},
+                            {"HUGE    ",    "n_huge",         8},
+                            {"HWPOIS  ",    "n_hwpois",       8},
+                            {"KSM     ",    "n_ksm",          8},
+                            {"LCK     ",    "n_lck",          8},
+                            {"MMAP    ",    "n_mmap",         8},
+                            {"NPAGE   ",    "n_npage",        8},
+                            {"ONLRU   ",    "n_onlru",        8},
+                            {"RECYCLE ",    "n_recycle",      8},
+                            {"REF     ",    "n_referenced",   8},
+                            {"SDIRTY  ",    "n_sdirty",       8},
+                            {"SLAB    ",    "n_slab",         8},
+                            {"SWPBCK  ",    "n_swpbck",       8},
+                            {"SWPCHE  ",    "n_swpche",       8},
+                            {"UNEVCTB ",    "n_unevctb",      8},
+                            {"UPTD    ",    "n_uptd",         8},
+                            {"WBACK   ",    "n_wback",        8},
+                            {"ZERO    ",    "n_zero",         8},
+                            {"PID     ",    "pid",            8},
+                            {"PSS     ",    "pss",            8},
+                            {"RES     ",    "res",            8},
+                            {"SHR     ",    "shr",            8},
+                            {"SWAP    ",    "swap",           8},
+                            {"USS     ",    "uss",            8}};
 
 static int head_tbl_s = sizeof(head_tbl)/sizeof(header_t);
 
 static int n_arg; // it enables non-root version explicitly
+static int x_arg; // uss/shr from pagemap exclusive bit, without kpagecount
 static int d_arg; // prints the result without headers
 static int p_arg; // prints result in numbers of pages (adds pagesize into header)
 static int F_arg; // prints flag stuff too
 static int P_arg; // filter pid with argument
 static int s_arg; // sort results
 static int c_arg; // csv form
+static int out_format; // OUT_* format of process rows
+static unsigned long out_psize; // kB or pages per page
+static int I_arg; // idle page tracking
+static unsigned int idle_interval; // ms between marking and reading of idle bitmap
+static int D_arg; // soft-dirty write rate
+static unsigned int dirty_interval; // ms between clearing and reading of soft-dirty bits
+static int V_arg; // prints mappings of processes too
+static int v_arg; // prints scan statistics
+static int rounds; // number of idle/soft-dirty intervals
+static int M_arg; // prints matrix of shared memory
+static int * matrix_pids; // pids of shared memory matrix
+static int matrix_n; // number of matrix_pids
+static int K_arg; // KSM merge potential
+static int f_arg; // fragmentation of physical memory
+static int m_arg; // page flags and mapcounts of physical memory
+static uint64_t combo_mask; // kpageflags bits of combinations with m_arg
+static char * w_arg; // write snapshot into file
+static char * r_arg; // read snapshot from file
+static char * diff_a; // compare snapshot diff_a
+static char * diff_b; //  with snapshot diff_b
+static int daemon_arg; // daemon mode
+static unsigned int daemon_interval = 60; // seconds between scans in daemon mode
+static unsigned int ring_size = 1024; // bytes of history of one process
+static char * export_addr; // serve metrics on this address in daemon mode
+static char * publish_name; // shared memory segment of daemon mode
+static char * record_path; // recording of scan reads
+static char * replay_path; // recording scanned instead of /proc
+static pgmap_io * io; // backend of record_path or replay_path
+static int batch_arg; // batched reads of process walk
+static char * triggers[TRIGGER_MAX]; // PSI thresholds "some|full stall_us window_us"
+static int n_triggers;
+static char * pressure_path = "/proc/pressure/memory"; // file of triggers
+static unsigned int keep_snaps = 8; // rotated snapshots of triggered captures
+static int throttle_arg; // throttled scan with budgets of throttle
+static int proc_filter_arg; // only processes matching proc_filter
+static pgmap_filter_t proc_filter;
+static pgmap_throttle_t throttle;
+static int export_labels = 3; // EXPORT_PID | EXPORT_CMD by default
+static int export_top = 20; // processes with own metrics, rest is summed
+static volatile sig_atomic_t daemon_stop; // SIGINT/SIGTERM arrived
+static volatile sig_atomic_t daemon_dump; // SIGUSR1 arrived
 static int filter_pid; // pid, which only be shown
 static char sort_id[BUFFSIZE]; // for sort option
-static int (*sort_func)(process_pagemap_t **, process_pagemap_t **); //pointer to sorting function
-static int sort_sign; // + or - ?
 // with non-args are all disabled
 
 
@@ -203,11 +243,98 @@ static int comp_heads(const void * h1, const void * h2) {
 
 // general functions
 
+// apply_filter - sets --uid, --cgroup and --pidns filter of table
+static int apply_filter(pagemap_tbl * table)
+{
+    if (!proc_filter_arg || set_pgmap_filter(table, &proc_filter) == 0)
+        return 0;
+    fprintf(stderr,"Cannot set process filter%s\n",proc_filter.pidns ? " (--pidns needs live system)" : "");
+    return 1;
+}
+
+// parse_throttle - parses comma-separated budgets rate=,cpu=,psi=,pause=
+static int parse_throttle(const char * src)
+{
+    char buf[BUFFSIZE];
+    char * p;
+
+    strncpy(buf, src, BUFFSIZE-1);
+    buf[BUFFSIZE-1] = '\0';
+    for (p = strtok(buf, ","); p; p = strtok(NULL, ",")) {
+        if (sscanf(p, "rate=%lu", &throttle.rate) != 1 && sscanf(p, "cpu=%u", &throttle.cpu) != 1 &&
+                sscanf(p, "psi=%lf", &throttle.psi) != 1 && sscanf(p, "pause=%u", &throttle.pause_us) != 1)
+            return 1;
+    }
+    throttle_arg = 1;
+    return 0;
+}
+
+// parse_combo - parses comma-separated kpageflags names into combo_mask
+static int parse_combo(const char * src)
+{
+    char buf[BUFFSIZE];
+    char * p;
+    int bit;
+
+    strncpy(buf, src, BUFFSIZE-1);
+    buf[BUFFSIZE-1] = '\0';
+    for (p = strtok(buf, ","); p; p = strtok(NULL, ",")) {
+        if ((bit = find_kpf_bit(p)) < 0)
+            return 1;
+        combo_mask |= 1ULL << bit;
+    }
+    return __builtin_popcountll(combo_mask) > PGMAP_COMBO_BITS;
+}
+
+// parse_pids - parse comma separated list of pids for -M
+static int parse_pids(const char * src)
+{
+    const char * p;
+
+    matrix_n = 1;
+    for (p = src; *p; p++)
+        if (*p == ',')
+            matrix_n++;
+    matrix_pids = malloc(matrix_n*sizeof(int));
+    if (!matrix_pids)
+        return 1;
+    matrix_n = 0;
+    for (p = src; p; p = strchr(p, ',')) {
+        if (*p == ',')
+            p++;
+        if (sscanf(p,"%d",&matrix_pids[matrix_n]) != 1)
+            return 1;
+        matrix_n++;
+    }
+    return 0;
+}
+
 // parse_args - parsing function
 static int parse_args(int argc, char * argv[])
 {
     int opt;
     extern char * optarg;
+    extern int optind;
+    static struct option long_opts[] = {{"diff", required_argument, NULL, 'X'},
+                                        {"daemon", no_argument, NULL, 'Y'},
+                                        {"interval", required_argument, NULL, 'T'},
+                                        {"ring", required_argument, NULL, 'R'},
+                                        {"export", required_argument, NULL, 'E'},
+                                        {"labels", required_argument, NULL, 'L'},
+                                        {"top", required_argument, NULL, 'N'},
+                                        {"publish", required_argument, NULL, 'S'},
+                                        {"combo", required_argument, NULL, 'C'},
+                                        {"record", required_argument, NULL, 'A'},
+                                        {"replay", required_argument, NULL, 'B'},
+                                        {"batch", no_argument, NULL, 'G'},
+                                        {"throttle", required_argument, NULL, 'H'},
+                                        {"trigger", required_argument, NULL, 'U'},
+                                        {"pressure", required_argument, NULL, 'Q'},
+                                        {"keep", required_argument, NULL, 'O'},
+                                        {"uid", required_argument, NULL, 'J'},
+                                        {"cgroup", required_argument, NULL, 'W'},
+                                        {"pidns", required_argument, NULL, 'Z'},
+                                        {NULL, 0, NULL, 0}};
     if (argc == 1) {
         d_arg = 0;
         p_arg = 0;
@@ -215,11 +342,59 @@ static int parse_args(int argc, char * argv[])
         P_arg = 0;
         s_arg = 0;
     } else {
-        while((opt = getopt(argc,argv,"hncdFpP:s:")) != -1) {
+        while((opt = getopt_long(argc,argv,"hnxcdFpP:s:I:D:VvM:Kfmw:r:jb",long_opts,NULL)) != -1) {
             switch (opt) {
+                case 'j':
+                    out_format = OUT_JSON;
+                    break;
+                case 'b':
+                    out_format = OUT_BIN;
+                    break;
+                case 'X':
+                    diff_a = optarg;
+                    if (optind >= argc)
+                        print_help();
+                    diff_b = argv[optind++];
+                    break;
+                case 'Y':
+                    daemon_arg = 1;
+                    break;
+                case 'T':
+                    daemon_interval = atoi(optarg);
+                    if (daemon_interval < 1)
+                        print_help();
+                    break;
+                case 'R':
+                    ring_size = atoi(optarg);
+                    break;
+                case 'E':
+                    daemon_arg = 1;
+                    export_addr = optarg;
+                    break;
+                case 'L':
+                    export_labels = 0;
+                    if (strstr(optarg,"pid"))
+                        export_labels |= EXPORT_PID;
+                    if (strstr(optarg,"cmdline"))
+                        export_labels |= EXPORT_CMD;
+                    if (strstr(optarg,"cgroup"))
+                        export_labels |= EXPORT_CGROUP;
+                    break;
+                case 'S':
+                    daemon_arg = 1;
+                    publish_name = optarg;
+                    break;
+                case 'N':
+                    export_top = atoi(optarg);
+                    if (export_top < 0)
+                        print_help();
+                    break;
                 case 'n':
                     n_arg = 1;
                     break;
+                case 'x':
+                    x_arg = 1;
+                    break;
                 case 'd':
                     d_arg = 1;
                     break;
@@ -243,6 +418,90 @@ static int parse_args(int argc, char * argv[])
                     s_arg = 1;
                     strncpy(sort_id,optarg,BUFFSIZE-1);
                     break;
+                case 'I':
+                    I_arg = 1;
+                    if (sscanf(optarg,"%u:%d",&idle_interval,&rounds) < 1 || rounds < 0)
+                        print_help();
+                    break;
+                case 'D':
+                    D_arg = 1;
+                    if (sscanf(optarg,"%u:%d",&dirty_interval,&rounds) < 1 || rounds < 0)
+                        print_help();
+                    break;
+                case 'V':
+                    V_arg = 1;
+                    break;
+                case 'v':
+                    v_arg = 1;
+                    break;
+                case 'w':
+                    w_arg = optarg;
+                    break;
+                case 'r':
+                    r_arg = optarg;
+                    break;
+                case 'f':
+                    f_arg = 1;
+                    break;
+                case 'm':
+                    m_arg = 1;
+                    break;
+                case 'C':
+                    m_arg = 1;
+                    if (parse_combo(optarg) != 0)
+                        print_help();
+                    break;
+                case 'A':
+                    record_path = optarg;
+                    break;
+                case 'B':
+                    replay_path = optarg;
+                    break;
+                case 'G':
+                    batch_arg = 1;
+                    break;
+                case 'H':
+                    if (parse_throttle(optarg) != 0)
+                        print_help();
+                    break;
+                case 'U':
+                    if (n_triggers == TRIGGER_MAX)
+                        print_help();
+                    triggers[n_triggers++] = optarg;
+                    break;
+                case 'Q':
+                    pressure_path = optarg;
+                    break;
+                case 'O':
+                    keep_snaps = atoi(optarg);
+                    if (keep_snaps < 1)
+                        print_help();
+                    break;
+                case 'J':
+                    proc_filter.uid = atoi(optarg);
+                    proc_filter.use_uid = 1;
+                    if (proc_filter.uid < 0)
+                        print_help();
+                    proc_filter_arg = 1;
+                    break;
+                case 'W':
+                    proc_filter.cgroup = optarg;
+                    proc_filter_arg = 1;
+                    break;
+                case 'Z':
+                    proc_filter.pidns = atoi(optarg);
+                    if (proc_filter.pidns < 1)
+                        print_help();
+                    proc_filter_arg = 1;
+                    break;
+                case 'K':
+                    K_arg = 1;
+                    break;
+                case 'M':
+                    M_arg = 1;
+                    if (parse_pids(optarg) != 0)
+                        print_help();
+                    break;
                 default:
                     print_help();
                     return 1;
@@ -250,8 +509,22 @@ static int parse_args(int argc, char * argv[])
         }
     }
     // at the end, consider the values of global variables
+    if (M_arg) {
+        // reverse map of one -P process has no pages of the others
+        if (P_arg) {
+            fprintf(stderr,"-M cannot be used with -P\n");
+            print_help();
+        }
+        // only matrix pids are walked
+        proc_filter.pids = matrix_pids;
+        proc_filter.n_pids = matrix_n;
+        proc_filter_arg = 1;
+    }
     if (getuid() != 0)
         n_arg = 1;
+    if (c_arg && out_format == OUT_TABLE)
+        out_format = OUT_CSV;
+    out_psize = p_arg ? 1 : getpagesize() >> 10;
     return 0;
 }
 
@@ -278,6 +551,7 @@ static header_list * make_header(const char * src) {
            if (!temp)
                return NULL;
            memcpy(&temp->item,res,sizeof(header_t));
+           temp->col = find_pgmap_col(res->name);
            temp->next = NULL;
            point = start;
            while (point->next) {
@@ -305,6 +579,7 @@ static header_list * add_cmd(header_list * list) {
 
     new = (header_list *) malloc(sizeof(header_list));
     memcpy(&new->item,&head_tbl[0],sizeof(header_t));
+    new->col = -1;
     new->next = NULL;
 
     end = list;
@@ -318,18 +593,41 @@ static header_list * add_cmd(header_list * list) {
 static header_list * complete_header(void) {
     header_list * p, * end;
 
-    if (n_arg) {
+    if (x_arg) {
+        p = make_header(EXCL_HEAD);
+    } else if (n_arg) {
         p = make_header(NON_ROOT_HEAD);
     } else {
         p = make_header(ROOT_HEAD);
     }
-    if (!n_arg && F_arg) {
+    if (!n_arg && !x_arg && F_arg) {
         end = p;
         while (end->next) {
             end = end->next;
         }
         end->next = make_header(ROOT_HEAD_FLG);
     }
+    if (!n_arg && I_arg) {
+        end = p;
+        while (end->next) {
+            end = end->next;
+        }
+        end->next = make_header(IDLE_HEAD);
+    }
+    if (D_arg) {
+        end = p;
+        while (end->next) {
+            end = end->next;
+        }
+        end->next = make_header(DIRTY_HEAD);
+    }
+    if (K_arg) {
+        end = p;
+        while (end->next) {
+            end = end->next;
+        }
+        end->next = make_header(KSM_HEAD);
+    }
     p = add_cmd(p);
     return p;
 }
@@ -348,51 +646,445 @@ static void destroy_header(header_list * list) {
     }
 }
 
+// output engine - rows are formatted into out_buf and written by one
+// write() per full buffer, stdio output is flushed before
+static char out_buf[OUT_BUFSIZE];
+static size_t out_len;
+static const char digits2[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+static void out_flush(void)
+{
+    ssize_t n;
+    size_t done = 0;
+
+    fflush(stdout);
+    while (done < out_len) {
+        n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    out_len = 0;
+}
+
+static inline void out_mem(const void * src, size_t len)
+{
+    memcpy(out_buf + out_len, src, len);
+    out_len += len;
+}
+
+static inline void out_str(const char * src)
+{
+    out_mem(src, strlen(src));
+}
+
+static inline void out_char(char c)
+{
+    out_buf[out_len++] = c;
+}
+
+// out_num - itoa by two digits, returns number of written chars
+static inline int out_num(unsigned long v)
+{
+    char tmp[24];
+    char * p = tmp + sizeof(tmp);
+    int idx;
+
+    while (v >= 100) {
+        idx = (v % 100)*2;
+        v /= 100;
+        *--p = digits2[idx + 1];
+        *--p = digits2[idx];
+    }
+    if (v >= 10) {
+        *--p = digits2[v*2 + 1];
+        *--p = digits2[v*2];
+    } else {
+        *--p = '0' + v;
+    }
+    out_mem(p, tmp + sizeof(tmp) - p);
+    return tmp + sizeof(tmp) - p;
+}
+
+// out_json_str - quoted string without trailing newline
+static void out_json_str(const char * src)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out_char('"');
+    for (; *src && !(*src == '\n' && !src[1]); src++) {
+        if (*src == '"' || *src == '\\') {
+            out_char('\\');
+            out_char(*src);
+        } else if ((unsigned char) *src < 0x20) {
+            out_mem("\\u00", 4);
+            out_char(hex[(*src >> 4) & 0xf]);
+            out_char(hex[*src & 0xf]);
+        } else {
+            out_char(*src);
+        }
+    }
+    out_char('"');
+}
+
+// binary output starts by this header and names of fields (OUT_NAME bytes
+// each), every record has n_fields uint64_t values and SMALLBUF bytes of
+// command line, all in host byte order
+typedef struct out_bin_hdr {
+    char magic[8];          // "PGMAPREC"
+    uint32_t n_fields;
+    uint32_t rec_size;      // bytes of one record
+    uint32_t unit;          // bytes per unit of values except pid
+    uint32_t pad;
+} out_bin_hdr;
+
+// print_head - header of all formats
+static void print_head(header_list * head_l)
+{
+    header_list * curr;
+    out_bin_hdr hdr;
+    char name[OUT_NAME];
+
+    switch (out_format) {
+        case OUT_TABLE:
+            for (curr = head_l; curr; curr = curr->next)
+                out_str(curr->item.desc);
+            out_char('\n');
+            break;
+        case OUT_CSV:
+            for (curr = head_l; curr; curr = curr->next) {
+                out_str(curr->item.name);
+                if (curr->next)
+                    out_char(',');
+            }
+            out_char('\n');
+            break;
+        case OUT_BIN:
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, "PGMAPREC", sizeof(hdr.magic));
+            for (curr = head_l; curr; curr = curr->next)
+                if (curr->col >= 0)
+                    hdr.n_fields++;
+            hdr.rec_size = hdr.n_fields*sizeof(uint64_t) + SMALLBUF;
+            hdr.unit = p_arg ? getpagesize() : 1024;
+            out_mem(&hdr, sizeof(hdr));
+            for (curr = head_l; curr; curr = curr->next) {
+                if (curr->col < 0)
+                    continue;
+                memset(name, 0, sizeof(name));
+                strncpy(name, curr->item.name, sizeof(name) - 1);
+                out_mem(name, sizeof(name));
+            }
+            break;
+    }
+}
+
 // print_row - prints data row but with first argument NULL, prints headers
 static void print_row(process_pagemap_t * table, header_list * head_l)
 {
     header_list * curr;
+    unsigned long value;
+    uint64_t bin;
+    char cmd[SMALLBUF];
+    int len;
+
+    if (!table) {
+        print_head(head_l);
+        out_flush();
+        return;
+    }
+    if (out_len + OUT_ROW_MAX > OUT_BUFSIZE)
+        out_flush();
+    if (out_format == OUT_JSON)
+        out_char('{');
+    for (curr = head_l; curr; curr = curr->next) {
+        if (curr->col < 0) {
+            switch (out_format) {
+                case OUT_JSON:
+                    out_mem("\"cmdline\":", 10);
+                    out_json_str(table->cmdline);
+                    break;
+                case OUT_BIN:
+                    memset(cmd, 0, sizeof(cmd));
+                    strncpy(cmd, table->cmdline, sizeof(cmd) - 1);
+                    cmd[strcspn(cmd, "\n")] = '\0';
+                    out_mem(cmd, sizeof(cmd));
+                    break;
+                default:
+                    out_str(table->cmdline);
+            }
+            continue;
+        }
+        value = COL_VALUE(table, curr->col);
+        if (curr->col != PGMAP_COL_pid)
+            value *= out_psize;
+        switch (out_format) {
+            case OUT_TABLE:
+                len = out_num(value);
+                while (len++ < curr->item.width)
+                    out_char(' ');
+                break;
+            case OUT_CSV:
+                out_num(value);
+                out_char(',');
+                break;
+            case OUT_JSON:
+                out_char('"');
+                out_str(curr->item.name);
+                out_mem("\":", 2);
+                out_num(value);
+                if (curr->next)
+                    out_char(',');
+                break;
+            case OUT_BIN:
+                bin = value;
+                out_mem(&bin, sizeof(bin));
+                break;
+        }
+    }
+    if (out_format == OUT_JSON)
+        out_mem("}\n", 2);
+}
+
+// print_mappings - prints soft-dirty counts of all mappings of process
+static void print_mappings(process_pagemap_t * table)
+{
+    proc_mapping * map;
     int psize_c;
-    char pbuf[8];
 
-    curr = head_l;
+    if (!table)
+        return;
+    psize_c = p_arg ? 1 : getpagesize() >> 10;
+    for (map = table->mappings; map; map = map->next) {
+        if (!c_arg)
+            printf("    %016lx-%016lx %c%c%c%c %-8lu %s\n", map->start, map->end,
+                    map->perms & PERM_READ ? 'r' : '-',
+                    map->perms & PERM_WRITE ? 'w' : '-',
+                    map->perms & PERM_EXEC ? 'x' : '-',
+                    map->perms & PERM_SHARE ? 's' : 'p',
+                    map->n_sdirty*psize_c, map->path ? map->path : "");
+        else
+            printf("%d,%lx,%lx,%lu,%s\n", table->pid, map->start, map->end,
+                    map->n_sdirty*psize_c, map->path ? map->path : "");
+    }
+}
+
+// print_matrix - prints memory shared by every pair of matrix_pids
+// pids which are not in table are marked by "-" (empty in CSV) instead of
+// zeros, they were not scanned at all
+static void print_matrix(pagemap_tbl * table)
+{
+    unsigned long * matrix;
+    char * known;
+    int psize_c;
 
-    if (p_arg) {
-        psize_c = 1;
-    } else {
-        psize_c = getpagesize() >> 10;
+    psize_c = p_arg ? 1 : getpagesize() >> 10;
+    matrix = malloc((unsigned long) matrix_n*matrix_n*sizeof(unsigned long));
+    known = malloc(matrix_n);
+    if (!matrix || !known || get_share_matrix(table, matrix_pids, matrix_n, matrix) != 0) {
+        fprintf(stderr,"Reverse map is not available\n");
+        free(matrix);
+        free(known);
+        return;
     }
-    if (!table) {
-        //print header
-        while(curr) {
-            if (!c_arg) {
-                printf("%s", curr->item.desc);
-            } else {
-                if (curr->next)
-                     printf("%s,", curr->item.name);
-                else
-                     printf("%s", curr->item.name);
-            }
-            curr = curr->next;
+    for (int i = 0; i < matrix_n; i++) {
+        known[i] = get_single_pgmap(table, matrix_pids[i]) != NULL;
+        if (!known[i])
+            fprintf(stderr,"Process %d was not scanned (exited, unreadable or filtered out)\n",matrix_pids[i]);
+    }
+    if (!d_arg) {
+        printf(c_arg ? "pid" : "PID     ");
+        for (int j = 0; j < matrix_n; j++)
+            printf(c_arg ? ",%d" : "%-10d", matrix_pids[j]);
+        printf("\n");
+    }
+    for (int i = 0; i < matrix_n; i++) {
+        printf(c_arg ? "%d" : "%-8d", matrix_pids[i]);
+        for (int j = 0; j < matrix_n; j++) {
+            if (!known[i] || !known[j])
+                printf(c_arg ? "," : "%-10s", "-");
+            else
+                printf(c_arg ? ",%lu" : "%-10lu", matrix[(unsigned long) i*matrix_n + j]*psize_c);
         }
         printf("\n");
-    } else {
-        while(curr) {
-            if (curr->item.width != -1) {
-                if (!c_arg)
-                    sprintf(pbuf,"%%-%dlu",curr->item.width);
-                else
-                    sprintf(pbuf,"%%lu,");
-                if (curr->item.prfun != &get_pid)  // wanna avoid string comparison
-                    printf(pbuf, curr->item.prfun(table)*psize_c);
-                else 
-                    printf(pbuf, curr->item.prfun(table));
-            } else {
-                printf("%s", (char *) curr->item.prfun(table));
+    }
+    free(matrix);
+    free(known);
+}
+
+static void sort_data(process_pagemap_t ** table_arr, int size, const char * sort_key);
+
+// print_ksm - prints KSM merge potential of whole system and of groups
+// of processes with the same command
+static void print_ksm(pgmap_ksm_t * total, process_pagemap_t ** table_arr, int size)
+{
+    process_pagemap_t ** arr;
+    unsigned long zero, dup;
+    int psize_c, i, j;
+
+    psize_c = p_arg ? 1 : getpagesize() >> 10;
+    printf(KSM_ROW, total->scanned*psize_c, total->zero*psize_c,
+            total->dup*psize_c, total->skipped*psize_c);
+    arr = malloc(size*sizeof(process_pagemap_t *));
+    if (!arr)
+        return;
+    memcpy(arr, table_arr, size*sizeof(process_pagemap_t *));
+    sort_data(arr, size, "cmdline");
+    if (!d_arg)
+        printf(c_arg ? "procs,n_zero,n_dup,cmdline\n" : "PROCS   ZERO    DUP     CMD\n");
+    for (i = 0; i < size; i = j) {
+        zero = 0;
+        dup = 0;
+        for (j = i; j < size && !strcmp(arr[i]->cmdline, arr[j]->cmdline); j++) {
+            zero += arr[j]->n_zero;
+            dup += arr[j]->n_dup;
+        }
+        if (!zero && !dup)
+            continue;
+        printf(c_arg ? "%d,%lu,%lu,%s" : "%-8d%-8lu%-8lu%s", j - i,
+                zero*psize_c, dup*psize_c, arr[i]->cmdline);
+    }
+    printf("--\n");
+    free(arr);
+}
+
+// print_hist - prints non-zero items of log2 histogram as length:count
+static void print_hist(unsigned long * hist)
+{
+    for (int i = 0; i < PGMAP_ORDERS; i++)
+        if (hist[i])
+            printf(c_arg ? ",%lu:%lu" : " %lu:%lu", 1UL << i, hist[i]);
+}
+
+// print_frag - prints fragmentation of physical memory and physical
+// contiguity of processes (runs of pages by log2 length)
+static void print_frag(pagemap_tbl * table, process_pagemap_t ** table_arr, int size)
+{
+    pgmap_frag_t frag;
+    unsigned long hist[PGMAP_ORDERS];
+    long pagesize;
+
+    pagesize = getpagesize() >> 10;
+    if (get_frag_pgmap(table, &frag) != 0) {
+        fprintf(stderr,"Fragmentation report is not available\n");
+        return;
+    }
+    printf(FRAG_ROW, frag.pages*pagesize, frag.free_pages*pagesize,
+            frag.blocks_2m, frag.free_2m, frag.movable_2m, frag.huge_2m,
+            frag.blocks_1g, frag.free_1g, frag.movable_1g);
+    print_hist(frag.free_runs);
+    printf("\n--\n");
+    if (!d_arg)
+        printf(c_arg ? "pid,runs\n" : "PID     RUNS (pages:count)\n");
+    for (int i = 0; i < size; i++) {
+        if (P_arg && table_arr[i]->pid != filter_pid)
+            continue;
+        if (get_contig_pgmap(table, table_arr[i]->pid, hist) != 0 || !table_arr[i]->res)
+            continue;
+        printf(c_arg ? "%d" : "%-8d", table_arr[i]->pid);
+        print_hist(hist);
+        printf("\n");
+    }
+    printf("--\n");
+}
+
+// print_pages - prints sizes of pages with every kpageflags bit, of pages
+// by mapcount and by combinations of --combo flags
+static void print_pages(pagemap_tbl * table)
+{
+    pgmap_pages_t * pages;
+    const char * name;
+    char combo[PGMAP_COMBO_BITS*16];
+    int n_combo, k;
+
+    pages = malloc(sizeof(pgmap_pages_t));
+    if (!pages || get_pages_pgmap(table, combo_mask, pages) != 0) {
+        fprintf(stderr,"Page flags report is not available\n");
+        free(pages);
+        return;
+    }
+    if (!d_arg)
+        printf(c_arg ? "flag,size\n" : "FLAG            SIZE\n");
+    printf(c_arg ? "%s,%lu\n" : "%-16s%lu\n", "pages", pages->pages*out_psize);
+    for (int bit = 0; bit < PGMAP_KPF_BITS; bit++) {
+        if (!pages->flags[bit] || !(name = get_kpf_name(bit)))
+            continue;
+        printf(c_arg ? "%s,%lu\n" : "%-16s%lu\n", name, pages->flags[bit]*out_psize);
+    }
+    printf("--\n");
+    if (!d_arg)
+        printf(c_arg ? "mapcount,size\n" : "MAPCOUNT        SIZE\n");
+    for (int i = 0; i < PGMAP_MAPCOUNTS; i++) {
+        if (!pages->mapcount[i])
+            continue;
+        snprintf(combo, sizeof(combo), "%d%s", i, i == PGMAP_MAPCOUNTS - 1 ? "+" : "");
+        printf(c_arg ? "%s,%lu\n" : "%-16s%lu\n", combo, pages->mapcount[i]*out_psize);
+    }
+    printf("--\n");
+    if (!combo_mask) {
+        free(pages);
+        return;
+    }
+    n_combo = __builtin_popcountll(combo_mask);
+    if (!d_arg)
+        printf(c_arg ? "flags,size\n" : "FLAGS                                   SIZE\n");
+    for (int i = 0; i < (1 << n_combo); i++) {
+        if (!pages->combos[i])
+            continue;
+        // k-th bit of index is k-th bit of mask
+        combo[0] = '\0';
+        k = 0;
+        for (int bit = 0; bit < PGMAP_KPF_BITS; bit++) {
+            if (!((combo_mask >> bit) & 1))
+                continue;
+            if ((i >> k++) & 1) {
+                if (combo[0])
+                    strcat(combo, "+");
+                strcat(combo, get_kpf_name(bit));
             }
-            curr = curr->next;
         }
+        printf(c_arg ? "%s,%lu\n" : "%-40s%lu\n", combo[0] ? combo : "-",
+                pages->combos[i]*out_psize);
+    }
+    printf("--\n");
+    free(pages);
+}
+
+// print_scan_stats - prints counters and phase times of scans of table
+static void print_scan_stats(pagemap_tbl * table)
+{
+    pgmap_stats_t st;
+
+    if ((!v_arg && !throttle_arg) || get_pgmap_stats(table, &st) != 0)
+        return;
+    if (throttle_arg)
+        fprintf(stderr, "throttled scan: walk %.1f ms, phys %.1f ms, slept %.1f ms, %llu pressure backoffs\n",
+                st.phase_ns[PGMAP_PHASE_WALK]/1e6, st.phase_ns[PGMAP_PHASE_PHYS]/1e6,
+                st.throttle_ns/1e6, (unsigned long long) st.backoffs);
+    if (!v_arg)
+        return;
+    fprintf(stderr, "syscalls:    %llu\nbytes read:  %llu\npages:       %llu\n"
+            "pfn lookups: %llu (%llu cached)\nvanished:    %llu\nreused:      %llu blocks\n",
+            (unsigned long long) st.syscalls, (unsigned long long) st.bytes_read,
+            (unsigned long long) st.pages, (unsigned long long) st.pfn_lookups,
+            (unsigned long long) st.cache_hits, (unsigned long long) st.vanished,
+            (unsigned long long) st.reused_blocks);
+    for (int i = 0; i < PGMAP_PHASES; i++)
+        fprintf(stderr, "%-13s%.3f ms\n", get_pgmap_phase_name(i), st.phase_ns[i]/1e6);
+}
+
+// release_table - frees table and writes recording, returns exit status
+static int release_table(pagemap_tbl * table)
+{
+    print_scan_stats(table);
+    free_pgmap_table(table);
+    if (close_pgmap_io(io) != 0) {
+        fprintf(stderr,"Cannot write recording %s\n",record_path);
+        return 1;
     }
+    return 0;
 }
 
 // print_stats - prints total memory stats that gains from /kpagecount
@@ -416,40 +1108,895 @@ static void print_data(process_pagemap_t ** table_arr, int size, header_list * h
     print_row(NULL, head_l);
     while (i < size) {
         print_row(table_arr[i], head_l);
+        if (V_arg && out_format <= OUT_CSV) {
+            out_flush();
+            print_mappings(table_arr[i]);
+        }
         ++i;
     }
+    out_flush();
+}
+
+// radix_sort - stable LSD radix sort of idx by 64-bit keys, one byte per
+// pass; passes where all keys have the same byte are skipped
+static void radix_sort(uint64_t * keys, uint32_t * idx, uint64_t * tmp_keys, uint32_t * tmp_idx, unsigned long n)
+{
+    static unsigned long count[8][256];
+    uint64_t * k = keys, * tk = tmp_keys, * swp_k;
+    uint32_t * ix = idx, * ti = tmp_idx, * swp_i;
+    unsigned long sum, c;
+
+    if (n < 2)
+        return;
+    memset(count, 0, sizeof(count));
+    for (unsigned long i = 0; i < n; i++)
+        for (int b = 0; b < 8; b++)
+            count[b][(k[i] >> (8*b)) & 0xff]++;
+    for (int b = 0; b < 8; b++) {
+        if (count[b][(k[0] >> (8*b)) & 0xff] == n)
+            continue;
+        sum = 0;
+        for (int v = 0; v < 256; v++) {
+            c = count[b][v];
+            count[b][v] = sum;
+            sum += c;
+        }
+        for (unsigned long i = 0; i < n; i++) {
+            c = count[b][(k[i] >> (8*b)) & 0xff]++;
+            tk[c] = k[i];
+            ti[c] = ix[i];
+        }
+        swp_k = k; k = tk; tk = swp_k;
+        swp_i = ix; ix = ti; ti = swp_i;
+    }
+    if (ix != idx)
+        memcpy(idx, ix, n*sizeof(uint32_t));
 }
 
-// sort_f - envelope for sorting functions
-static int sort_f(process_pagemap_t ** table1, process_pagemap_t ** table2)
+static const char * const * rank_cmds; // for cmp_rank
+static int cmp_rank(const void * a, const void * b)
 {
-    return sort_sign*(sort_func(table1,table2));
+    return strcmp(rank_cmds[*(const uint32_t *) a], rank_cmds[*(const uint32_t *) b]);
+}
+
+// rank_cmdlines - equal command lines get equal rank, ranks follow order
+// of command lines
+static void rank_cmdlines(process_pagemap_t ** table_arr, unsigned long size, uint32_t * rank)
+{
+    const char ** cmds;
+    uint32_t * order;
+    uint32_t r = 0;
+
+    cmds = malloc(size*sizeof(char *));
+    order = malloc(size*sizeof(uint32_t));
+    if (!cmds || !order) {
+        memset(rank, 0, size*sizeof(uint32_t));
+        goto rank_out;
+    }
+    for (unsigned long i = 0; i < size; i++) {
+        cmds[i] = table_arr[i]->cmdline;
+        order[i] = i;
+    }
+    rank_cmds = cmds;
+    qsort(order, size, sizeof(uint32_t), cmp_rank);
+    for (unsigned long i = 0; i < size; i++) {
+        if (i && strcmp(cmds[order[i]], cmds[order[i-1]]))
+            r++;
+        rank[order[i]] = r;
+    }
+rank_out:
+    free(cmds);
+    free(order);
 }
 
-// sort_data - sort pointers in table_arr in requested order
-static void sort_data(process_pagemap_t ** table_arr, int size, char * key)
+// sort_data - sort pointers in table_arr by comma separated stats, each
+// one ascending or descending by its + or - suffix; stats are gathered
+// into columns and sorted by radix sort, two stats per 64-bit key
+static void sort_data(process_pagemap_t ** table_arr, int size, const char * sort_key)
 {
-    header_t what, * res;
-    int key_len;
+    char key[BUFFSIZE];
+    char * item, * saveptr;
+    int cols[SORT_KEYS], desc[SORT_KEYS], n_keys = 0, key_len;
+    uint32_t * vals[SORT_KEYS] = {NULL};
+    uint32_t * idx = NULL, * tmp_idx = NULL;
+    uint64_t * keys = NULL, * tmp_keys = NULL;
+    process_pagemap_t ** sorted = NULL;
 
-    key_len = strlen(key);
-    if (key[key_len-1] == '-' || key[key_len-1] == '+') {
-        if (key[key_len-1] == '-')
-            sort_sign = -1;
+    strcpy(key, sort_key);
+    for (item = strtok_r(key, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        if (n_keys == SORT_KEYS) {
+            fprintf(stderr,"Too many sort ids\n");
+            return;
+        }
+        key_len = strlen(item);
+        desc[n_keys] = key_len && item[key_len-1] == '-';
+        if (key_len && (item[key_len-1] == '-' || item[key_len-1] == '+'))
+            item[key_len-1] = '\0';
+        cols[n_keys] = strcmp(item, "cmdline") ? find_pgmap_col(item) : PGMAP_COLS;
+        if (cols[n_keys] < 0) {
+            fprintf(stderr,"Unknown sort id: %s\n",item);
+            return;
+        }
+        n_keys++;
+    }
+    if (size < 2 || !n_keys)
+        return;
+
+    for (int k = 0; k < n_keys; k++) {
+        vals[k] = malloc(size*sizeof(uint32_t));
+        if (!vals[k])
+            goto sort_out;
+        if (cols[k] == PGMAP_COLS)
+            rank_cmdlines(table_arr, size, vals[k]);
         else
-            sort_sign = 1;
-        key[key_len-1] = '\0';
+            for (int i = 0; i < size; i++)
+                vals[k][i] = COL_VALUE(table_arr[i], cols[k]);
+        if (desc[k])
+            for (int i = 0; i < size; i++)
+                vals[k][i] = ~vals[k][i];
+    }
+    idx = malloc(size*sizeof(uint32_t));
+    tmp_idx = malloc(size*sizeof(uint32_t));
+    keys = malloc(size*sizeof(uint64_t));
+    tmp_keys = malloc(size*sizeof(uint64_t));
+    sorted = malloc(size*sizeof(process_pagemap_t *));
+    if (!idx || !tmp_idx || !keys || !tmp_keys || !sorted)
+        goto sort_out;
+    for (int i = 0; i < size; i++)
+        idx[i] = i;
+    // least significant pair of stats first, every pass is stable
+    for (int k = n_keys; k > 0; k -= 2) {
+        for (int i = 0; i < size; i++) {
+            keys[i] = vals[k-1][idx[i]];
+            if (k >= 2)
+                keys[i] |= (uint64_t) vals[k-2][idx[i]] << 32;
+        }
+        radix_sort(keys, idx, tmp_keys, tmp_idx, size);
+    }
+    for (int i = 0; i < size; i++)
+        sorted[i] = table_arr[idx[i]];
+    memcpy(table_arr, sorted, size*sizeof(process_pagemap_t *));
+sort_out:
+    for (int k = 0; k < n_keys; k++)
+        free(vals[k]);
+    free(idx);
+    free(tmp_idx);
+    free(keys);
+    free(tmp_keys);
+    free(sorted);
+}
+
+// load_snap_rows - copies all processes of snapshot
+static process_pagemap_t * load_snap_rows(pgmap_snap * snap, unsigned long * n)
+{
+    process_pagemap_t * rows;
+
+    *n = get_snap_header(snap)->n_procs;
+    rows = malloc((*n + 1)*sizeof(process_pagemap_t));
+    if (!rows)
+        return NULL;
+    for (unsigned long i = 0; i < *n; i++)
+        get_snap_pgmap(snap, i, &rows[i]);
+    return rows;
+}
+
+// load_shm_rows - copies all processes of the latest publication in shared
+// memory segment, retries when it was overwritten during copying
+static process_pagemap_t * load_shm_rows(const char * name, unsigned long * n)
+{
+    pgmap_shm * shm;
+    pgmap_snap * snap;
+    process_pagemap_t * rows = NULL;
+
+    shm = attach_pgmap_shm(name);
+    if (!shm)
+        return NULL;
+    for (int tries = 0; tries < 10; tries++) {
+        snap = pin_pgmap_shm(shm);
+        if (!snap)
+            break;
+        rows = load_snap_rows(snap, n);
+        if (!rows || check_pgmap_shm(shm) == 0)
+            break;
+        free(rows);
+        rows = NULL;
+    }
+    detach_pgmap_shm(shm);
+    return rows;
+}
+
+// print_snapshot - prints processes stored in snapshot file or published
+// in shared memory segment (shm:name)
+static int print_snapshot(const char * path)
+{
+    pgmap_snap * snap = NULL;
+    process_pagemap_t * rows;
+    process_pagemap_t ** table_arr;
+    header_list * hlist;
+    unsigned long n;
+    int size = 0;
+
+    if (!strncmp(path, "shm:", 4)) {
+        rows = load_shm_rows(path + 4, &n);
     } else {
-        sort_sign = 1;
+        snap = open_pgmap_snapshot(path);
+        rows = snap ? load_snap_rows(snap, &n) : NULL;
+        close_pgmap_snapshot(snap);
+    }
+    if (!rows) {
+        fprintf(stderr,"Cannot read snapshot %s\n",path);
+        return 1;
+    }
+    table_arr = malloc((n + 1)*sizeof(process_pagemap_t *));
+    hlist = complete_header();
+    if (!table_arr || !hlist) {
+        free(rows);
+        return 1;
+    }
+    for (unsigned long i = 0; i < n; i++) {
+        if (P_arg && rows[i].pid != filter_pid)
+            continue;
+        table_arr[size++] = &rows[i];
+    }
+    if (s_arg)
+        sort_data(table_arr,size,sort_id);
+    print_data(table_arr,size,hlist);
+    destroy_header(hlist);
+    free(table_arr);
+    free(rows);
+    return 0;
+}
+
+// print_vma_diff - prints changed mappings of one process
+static void print_vma_diff(pgmap_snap * a, pgmap_snap * b, pgmap_diff_t * d)
+{
+    pgmap_vma_diff_t * vd;
+    const pgmap_snap_vma * vmas_a, * vmas_b, * v;
+    unsigned long count, n_a, n_b;
+    const char * path;
+    int psize_c;
+
+    psize_c = p_arg ? 1 : get_snap_header(b)->pagesize >> 10;
+    vmas_a = get_snap_vmas(a, &n_a);
+    vmas_b = get_snap_vmas(b, &n_b);
+    vd = diff_pgmap_vmas(a, d->row_a, b, d->row_b, &count);
+    if (!vd)
+        return;
+    for (unsigned long i = 0; i < count; i++) {
+        v = vd[i].vma_b >= 0 ? &vmas_b[vd[i].vma_b] : &vmas_a[vd[i].vma_a];
+        path = get_snap_path(vd[i].vma_b >= 0 ? b : a, v);
+        printf("  %c %016llx-%016llx %-8lld %-8lld %-8lld %s\n",
+                vd[i].status == PGMAP_DIFF_NEW ? '+' : (vd[i].status == PGMAP_DIFF_GONE ? '-' : ' '),
+                (unsigned long long) v->start, (unsigned long long) v->end,
+                (long long) vd[i].d_size*psize_c, (long long) vd[i].d_res*psize_c,
+                (long long) vd[i].d_sdirty*psize_c, path ? path : "");
+    }
+    free(vd);
+}
+
+// print_diff - prints changes of processes between two snapshots
+static int print_diff(const char * path_a, const char * path_b)
+{
+    pgmap_snap * a, * b;
+    pgmap_diff_t * diff;
+    header_list * hlist, * curr;
+    unsigned long count;
+    char key[BUFFSIZE];
+    int sort_col = PGMAP_COL_res, col, key_len, psize_c;
+    const char * cmd;
+
+    a = open_pgmap_snapshot(path_a);
+    b = open_pgmap_snapshot(path_b);
+    if (!a || !b) {
+        fprintf(stderr,"Cannot read snapshot %s\n", a ? path_b : path_a);
+        close_pgmap_snapshot(a);
+        close_pgmap_snapshot(b);
+        return 1;
+    }
+    psize_c = p_arg ? 1 : get_snap_header(b)->pagesize >> 10;
+    // the same sort id as -s, default is the biggest growth of res first
+    if (s_arg) {
+        strcpy(key, sort_id);
+        key_len = strlen(key);
+        if (key[key_len-1] == '-' || key[key_len-1] == '+')
+            key[key_len-1] = '\0';
+        col = find_pgmap_col(key);
+        if (col < 0)
+            fprintf(stderr,"Unknown sort id: %s\n",key);
+        else
+            sort_col = sort_id[key_len-1] == '-' ? col : -col - 1;
+    }
+    diff = diff_pgmap_snapshots(a, b, sort_col, &count);
+    hlist = complete_header();
+    if (!diff || !hlist) {
+        close_pgmap_snapshot(a);
+        close_pgmap_snapshot(b);
+        return 1;
+    }
+    if (!d_arg) {
+        printf(c_arg ? "status," : "S ");
+        print_row(NULL, hlist);
+    }
+    for (unsigned long i = 0; i < count; i++) {
+        if (P_arg && diff[i].pid != filter_pid)
+            continue;
+        printf(c_arg ? "%c," : "%c ", diff[i].status == PGMAP_DIFF_NEW ? '+' :
+                (diff[i].status == PGMAP_DIFF_GONE ? '-' : ' '));
+        for (curr = hlist; curr; curr = curr->next) {
+            col = find_pgmap_col(curr->item.name);
+            if (col == PGMAP_COL_pid) {
+                printf(c_arg ? "%d," : "%-8d", diff[i].pid);
+            } else if (col >= 0) {
+                printf(c_arg ? "%lld," : "%-8lld", (long long) diff[i].delta[col]*psize_c);
+            } else {
+                cmd = get_snap_cmdline(diff[i].row_b >= 0 ? b : a,
+                        diff[i].row_b >= 0 ? diff[i].row_b : diff[i].row_a);
+                printf("%s", cmd);
+            }
+        }
+        if (V_arg)
+            print_vma_diff(a, b, &diff[i]);
+    }
+    free(diff);
+    destroy_header(hlist);
+    close_pgmap_snapshot(a);
+    close_pgmap_snapshot(b);
+    return 0;
+}
+
+// daemon_signal - SIGUSR1 prints history, the others stop daemon
+static void daemon_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        daemon_dump = 1;
+    else
+        daemon_stop = 1;
+}
+
+// print_ring - prints history of all processes as csv
+static void print_ring(pgmap_ring * ring)
+{
+    uint64_t * times;
+    uint32_t * values;
+    int max, n, pid;
+
+    printf("time");
+    for (int c = 0; c < PGMAP_COLS; c++)
+        printf(",%s", get_pgmap_col_name(c));
+    printf("\n");
+    for (unsigned long i = 0; i < get_pgmap_ring_procs(ring); i++) {
+        max = get_pgmap_ring_samples(ring, i, &pid, NULL, NULL, 0);
+        if (max < 1)
+            continue;
+        times = malloc(max*sizeof(uint64_t));
+        values = malloc((unsigned long) max*PGMAP_COLS*sizeof(uint32_t));
+        if (times && values) {
+            n = get_pgmap_ring_samples(ring, i, &pid, times, values, max);
+            for (int k = 0; k < n; k++) {
+                printf("%llu", (unsigned long long) times[k]);
+                for (int c = 0; c < PGMAP_COLS; c++)
+                    printf(",%u", values[(unsigned long) k*PGMAP_COLS + c]);
+                printf("\n");
+            }
+        }
+        free(times);
+        free(values);
+    }
+    fflush(stdout);
+}
+
+// self_rss - resident memory of pgmap itself in kB
+static unsigned long self_rss(void)
+{
+    FILE * f;
+    unsigned long size, res = 0;
+
+    f = fopen("/proc/self/statm","r");
+    if (!f)
+        return 0;
+    if (fscanf(f,"%lu %lu",&size,&res) != 2)
+        res = 0;
+    fclose(f);
+    return res*(getpagesize() >> 10);
+}
+
+static inline double ts_ms(struct timespec * ts)
+{
+    return ts->tv_sec*1000.0 + ts->tv_nsec/1000000.0;
+}
+
+// exporter - scrapes are served from the front buffer while the next scan
+// is rendered into the back one, a scrape never waits for a walk
+typedef struct export_buf {
+    char * text;
+    size_t len;
+    size_t size;
+    int refs;           // scrapes sending this buffer
+} export_buf;
+
+static export_buf export_bufs[2];
+static int export_front = -1; // -1 until first scan is rendered
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+static int export_fd = -1;
+
+static void buf_printf(export_buf * b, const char * fmt, ...)
+{
+    va_list ap;
+    int n;
+    char * tmp;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->text + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (b->len + n < b->size)
+            break;
+        tmp = realloc(b->text, 2*b->size + n + 1);
+        if (!tmp)
+            return;
+        b->text = tmp;
+        b->size = 2*b->size + n + 1;
+    }
+    b->len += n;
+}
+
+// buf_label - appends label with escaped value
+static void buf_label(export_buf * b, const char * name, const char * value, int * first)
+{
+    buf_printf(b, "%s%s=\"", *first ? "" : ",", name);
+    *first = 0;
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"')
+            buf_printf(b, "\\%c", *value);
+        else if (*value == '\n' && value[1])
+            buf_printf(b, "\\n");
+        else if (*value == '\n')
+            break; // cmdline ends with newline
+        else
+            buf_printf(b, "%c", *value);
+    }
+    buf_printf(b, "\"");
+}
+
+// read_cgroup - path of pid in cgroup v2 hierarchy, or of the first v1 one
+static void read_cgroup(int pid, char * cgroup, int size)
+{
+    FILE * f;
+    char path[BUFFSIZE];
+    char line[BUFSIZ];
+    char * p;
+
+    cgroup[0] = '\0';
+    sprintf(path,"/proc/%d/cgroup",pid);
+    f = fopen(path,"r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        p = strchr(line,':');
+        if (!p || !(p = strchr(p + 1,':')))
+            continue;
+        p[strcspn(p,"\n")] = '\0';
+        if (!cgroup[0] || !strncmp(line,"0::",3))
+            snprintf(cgroup, size, "%s", p + 1);
+        if (!strncmp(line,"0::",3))
+            break;
     }
-    what.name = key;
-    res = bsearch(&what,head_tbl,head_tbl_s,sizeof(header_t),comp_heads);
-    if (!res) {
-        fprintf(stderr,"Unknown sort id: %s\n",key);
+    fclose(f);
+}
+
+// buf_labels - labels of row p_t with its cgroup, NULL = summed rest
+static void buf_labels(export_buf * b, process_pagemap_t * p_t, const char * cgroup)
+{
+    char pid[BUFFSIZE];
+    int first = 1;
+
+    if (!export_labels)
+        return;
+    buf_printf(b, "{");
+    if (export_labels & EXPORT_PID) {
+        sprintf(pid, "%d", p_t ? p_t->pid : 0);
+        buf_label(b, "pid", p_t ? pid : "other", &first);
+    }
+    if (export_labels & EXPORT_CMD)
+        buf_label(b, "cmdline", p_t ? p_t->cmdline : "other", &first);
+    if (export_labels & EXPORT_CGROUP)
+        buf_label(b, "cgroup", p_t && cgroup ? cgroup : "other", &first);
+    buf_printf(b, "}");
+}
+
+// export_render - renders table into back buffer and makes it the front one
+static void export_render(pagemap_tbl * table, double scan_ms)
+{
+    static const char * names[] = {"uss","pss","rss","shared","swap"};
+    static const char * helps[] = {"Unique set size","Proportional set size",
+        "Resident set size","Resident memory shared with others","Swapped out memory"};
+    process_pagemap_t ** table_arr;
+    process_pagemap_t * p_t;
+    unsigned long free_pg, shared, nonshared, value, other[5];
+    export_buf * b;
+    char ** cgroups = NULL;
+    char cgroup[BUFSIZ];
+    int size, root, back, first, top;
+    long pagesize = getpagesize();
+
+    pthread_mutex_lock(&export_lock);
+    back = export_front < 0 ? 0 : !export_front;
+    b = &export_bufs[back];
+    while (b->refs)
+        pthread_cond_wait(&export_cond, &export_lock);
+    pthread_mutex_unlock(&export_lock);
+
+    table_arr = get_all_pgmap(table,&size);
+    if (!table_arr)
         return;
+    root = get_physical_pgmap(table, &shared, &free_pg, &nonshared) == 0;
+    // uss and pss are known with kpagecount only
+    first = root ? 0 : 2;
+    sort_data(table_arr, size, s_arg ? sort_id : (root ? "pss-" : "res-"));
+    // cgroup of row is read once for all metrics
+    top = size < export_top ? size : export_top;
+    if ((export_labels & EXPORT_CGROUP) && top > 0 && (cgroups = calloc(top, sizeof(char *)))) {
+        for (int i = 0; i < top; i++) {
+            read_cgroup(table_arr[i]->pid, cgroup, sizeof(cgroup));
+            cgroups[i] = strdup(cgroup);
+        }
+    }
+
+    b->len = 0;
+    buf_printf(b, "# HELP pgmap_scan_duration_seconds Duration of the last scan.\n"
+            "# TYPE pgmap_scan_duration_seconds gauge\npgmap_scan_duration_seconds %.3f\n", scan_ms/1000.0);
+    buf_printf(b, "# HELP pgmap_processes Number of scanned processes.\n"
+            "# TYPE pgmap_processes gauge\npgmap_processes %d\n", size);
+    if (root) {
+        buf_printf(b, "# HELP pgmap_memory_bytes Physical memory by its use.\n"
+                "# TYPE pgmap_memory_bytes gauge\n");
+        buf_printf(b, "pgmap_memory_bytes{type=\"free\"} %lu\n", free_pg*pagesize);
+        buf_printf(b, "pgmap_memory_bytes{type=\"shared\"} %lu\n", shared*pagesize);
+        buf_printf(b, "pgmap_memory_bytes{type=\"nonshared\"} %lu\n", nonshared*pagesize);
+    }
+    for (int m = first; m < 5; m++) {
+        buf_printf(b, "# HELP pgmap_process_%s_bytes %s.\n# TYPE pgmap_process_%s_bytes gauge\n",
+                names[m], helps[m], names[m]);
+        other[m] = 0;
+        for (int i = 0; i < size; i++) {
+            p_t = table_arr[i];
+            value = m == 0 ? p_t->uss : m == 1 ? p_t->pss : m == 2 ? p_t->res :
+                m == 3 ? p_t->shr : p_t->swap;
+            if (i >= export_top) {
+                other[m] += value;
+                continue;
+            }
+            buf_printf(b, "pgmap_process_%s_bytes", names[m]);
+            buf_labels(b, p_t, cgroups ? cgroups[i] : NULL);
+            buf_printf(b, " %lu\n", value*pagesize);
+        }
+        if (size > export_top) {
+            buf_printf(b, "pgmap_process_%s_bytes", names[m]);
+            buf_labels(b, NULL, NULL);
+            buf_printf(b, " %lu\n", other[m]*pagesize);
+        }
+    }
+    for (int i = 0; cgroups && i < top; i++)
+        free(cgroups[i]);
+    free(cgroups);
+    free(table_arr);
+
+    pthread_mutex_lock(&export_lock);
+    export_front = back;
+    pthread_mutex_unlock(&export_lock);
+}
+
+// export_left - true until deadline of scrape, the front buffer must not be
+// held by client which stopped reading, render of the next scan waits for it
+static int export_left(const struct timespec * deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec < deadline->tv_sec ||
+        (now.tv_sec == deadline->tv_sec && now.tv_nsec < deadline->tv_nsec);
+}
+
+// export_send - sends data until deadline, sends time out by SO_SNDTIMEO
+static void export_send(int fd, const char * data, size_t len, const struct timespec * deadline)
+{
+    ssize_t n;
+
+    while (len > 0 && export_left(deadline)) {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+// export_serve - answers every request with the front buffer
+static void * export_serve(void * arg)
+{
+    struct timeval tv = {1, 0};
+    struct timespec deadline;
+    char req[BUFSIZ], head[BUFFSIZE];
+    export_buf * b = NULL;
+    size_t got;
+    ssize_t n;
+    int fd;
+
+    while ((fd = accept(export_fd, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        if (fd < 0)
+            continue;
+        // drain request headers, the path is not checked
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += EXPORT_DEADLINE;
+        got = 0;
+        while (got < sizeof(req) - 1 && export_left(&deadline) && (n = recv(fd, req + got, sizeof(req) - 1 - got, 0)) > 0) {
+            got += n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+                break;
+        }
+        pthread_mutex_lock(&export_lock);
+        if (export_front >= 0) {
+            b = &export_bufs[export_front];
+            b->refs++;
+        }
+        pthread_mutex_unlock(&export_lock);
+        if (b) {
+            snprintf(head, sizeof(head), HTTP_OK, (unsigned long) b->len);
+            export_send(fd, head, strlen(head), &deadline);
+            export_send(fd, b->text, b->len, &deadline);
+            pthread_mutex_lock(&export_lock);
+            b->refs--;
+            pthread_cond_signal(&export_cond);
+            pthread_mutex_unlock(&export_lock);
+            b = NULL;
+        } else {
+            export_send(fd, HTTP_UNAVAIL, strlen(HTTP_UNAVAIL), &deadline);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// export_open - listens on unix:path or [host:]port, host is 127.0.0.1
+// by default
+static int export_open(const char * addr)
+{
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    const char * port;
+    char host[BUFFSIZE] = "127.0.0.1";
+    int one = 1;
+
+    if (!strncmp(addr, "unix:", 5)) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof(sun.sun_path))
+            return -1;
+        strcpy(sun.sun_path, addr + 5);
+        export_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (export_fd < 0)
+            return -1;
+        unlink(sun.sun_path);
+        if (bind(export_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+            goto export_err;
+    } else {
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        port = strrchr(addr, ':');
+        if (port) {
+            if (port - addr >= BUFFSIZE)
+                return -1;
+            memcpy(host, addr, port - addr);
+            host[port - addr] = '\0';
+            port++;
+        } else {
+            port = addr;
+        }
+        if (inet_pton(AF_INET, host, &sin.sin_addr) != 1 || atoi(port) <= 0)
+            return -1;
+        sin.sin_port = htons(atoi(port));
+        export_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (export_fd < 0)
+            return -1;
+        setsockopt(export_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(export_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+            goto export_err;
+    }
+    if (listen(export_fd, 16) < 0)
+        goto export_err;
+    return 0;
+export_err:
+    close(export_fd);
+    export_fd = -1;
+    return -1;
+}
+
+static void export_close(pthread_t thread)
+{
+    shutdown(export_fd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(export_fd);
+    if (!strncmp(export_addr, "unix:", 5))
+        unlink(export_addr + 5);
+    free(export_bufs[0].text);
+    free(export_bufs[1].text);
+}
+
+// run_daemon - keeps table, kpage files and buffers open and rescans them
+// every daemon_interval, prints overhead of every tick
+static int run_daemon(void)
+{
+    pagemap_tbl * table;
+    pgmap_ring * ring;
+    struct timespec next, t0, t1, now;
+    struct rusage ru;
+    double cpu, last_cpu = 0.0, last_wall;
+    unsigned long tick = 0;
+    pthread_t server;
+    sigset_t set, old;
+    int ret = 0;
+
+    signal(SIGINT, daemon_signal);
+    signal(SIGTERM, daemon_signal);
+    signal(SIGUSR1, daemon_signal);
+    table = init_pgmap_table_io(NULL, io);
+    ring = create_pgmap_ring(ring_size);
+    if (!table || !ring || apply_filter(table))
+        return 1;
+    if (batch_arg || x_arg)
+        set_pgmap_flags(table, (batch_arg ? PAGEMAP_BATCH : 0) | (x_arg ? PAGEMAP_EXCL : 0));
+    if (throttle_arg)
+        set_pgmap_throttle(table, &throttle);
+    if (export_addr) {
+        if (export_open(export_addr) != 0) {
+            fprintf(stderr,"Cannot listen on %s\n",export_addr);
+            return 1;
+        }
+        // signals are left for the scanning thread
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        if (pthread_create(&server, NULL, export_serve, NULL) != 0) {
+            fprintf(stderr,"Cannot start exporter\n");
+            return 1;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
     }
-    sort_func = res->sortfun;
-    qsort(table_arr, size, sizeof(process_pagemap_t*),(void *)sort_f);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    last_wall = ts_ms(&next);
+    while (!daemon_stop) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (tick && !init_pgmap_table(table)) {
+            // table is freed by init_pgmap_table() on error
+            table = NULL;
+            fprintf(stderr,"Cannot read /proc, daemon stops\n");
+            ret = 1;
+            break;
+        }
+        if (!open_pgmap_table(table, P_arg ? filter_pid : 0)) {
+            fprintf(stderr,"Cannot scan processes, daemon stops\n");
+            ret = 1;
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &now);
+        add_pgmap_ring_sample(ring, table, (uint64_t) ts_ms(&now));
+        if (w_arg && write_pgmap_snapshot(table, w_arg, PGMAP_SNAP_VMAS) != 0)
+            fprintf(stderr,"Cannot write snapshot %s\n",w_arg);
+        if (publish_name && publish_pgmap_table(table, publish_name, PGMAP_SNAP_VMAS) != 0)
+            fprintf(stderr,"Cannot publish into %s\n",publish_name);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (export_addr)
+            export_render(table, ts_ms(&t1) - ts_ms(&t0));
+        getrusage(RUSAGE_SELF, &ru);
+        cpu = ru.ru_utime.tv_sec*1000.0 + ru.ru_utime.tv_usec/1000.0 +
+            ru.ru_stime.tv_sec*1000.0 + ru.ru_stime.tv_usec/1000.0;
+        fprintf(stderr,"tick %lu: %lu procs, scan %.1f ms, cpu %.2f%%, rss %lu kB, history %lu kB\n",
+                tick, table->size, ts_ms(&t1) - ts_ms(&t0),
+                tick ? 100.0*(cpu - last_cpu)/(ts_ms(&t1) - last_wall) : 0.0,
+                self_rss(), get_pgmap_ring_bytes(ring) >> 10);
+        last_cpu = cpu;
+        last_wall = ts_ms(&t1);
+        tick++;
+        next.tv_sec += daemon_interval;
+        while (!daemon_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0) {
+            if (daemon_dump) {
+                daemon_dump = 0;
+                print_ring(ring);
+            }
+        }
+    }
+    if (export_addr)
+        export_close(server);
+    else
+        print_ring(ring);
+    free_pgmap_ring(ring);
+    // NULL table only closes recording
+    if (release_table(table) != 0)
+        ret = 1;
+    return ret;
+}
+
+// run_trigger - registers PSI thresholds and captures snapshot into the
+// next of keep_snaps rotated files whenever some of them fires
+static int run_trigger(void)
+{
+    struct pollfd fds[TRIGGER_MAX];
+    pagemap_tbl * table;
+    struct timespec t0, t1, t2;
+    char path[BUFSIZ];
+    unsigned long n = 0;
+    int fired;
+
+    if (!w_arg) {
+        fprintf(stderr,"--trigger needs -w file\n");
+        return 1;
+    }
+    for (int i = 0; i < n_triggers; i++) {
+        fds[i].fd = open(pressure_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        fds[i].events = POLLPRI;
+        if (fds[i].fd < 0 || write(fds[i].fd, triggers[i], strlen(triggers[i]) + 1) < 0) {
+            fprintf(stderr,"Cannot set trigger \"%s\" of %s: %s\n",
+                    triggers[i], pressure_path, strerror(errno));
+            return 1;
+        }
+    }
+    signal(SIGINT, daemon_signal);
+    signal(SIGTERM, daemon_signal);
+    // the first scan allocates table, buffers and opens kpagecount and
+    // kpageflags; locked memory is not reclaimed by the pressure which
+    // should be captured
+    table = init_pgmap_table_io(NULL, io);
+    if (!table || apply_filter(table))
+        return 1;
+    set_pgmap_flags(table, (batch_arg ? PAGEMAP_BATCH : 0) | (x_arg ? PAGEMAP_EXCL : 0) |
+            (v_arg ? PAGEMAP_STATS : 0));
+    if (!open_pgmap_table(table, P_arg ? filter_pid : 0))
+        return 1;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr,"Cannot lock memory: %s\n",strerror(errno));
+    fprintf(stderr,"waiting for %d trigger(s) of %s\n",n_triggers,pressure_path);
+    while (!daemon_stop) {
+        if (poll(fds, n_triggers, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        fired = -1;
+        for (int i = n_triggers - 1; i >= 0; i--) {
+            if (fds[i].revents & POLLERR) {
+                fprintf(stderr,"Trigger \"%s\" was removed\n",triggers[i]);
+                daemon_stop = 1;
+            }
+            if (fds[i].revents & POLLPRI)
+                fired = i;
+        }
+        if (fired < 0)
+            continue;
+        if (!init_pgmap_table(table))
+            return 1;
+        if (!open_pgmap_table(table, P_arg ? filter_pid : 0))
+            return 1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        snprintf(path, sizeof(path), "%s.%lu", w_arg, n % keep_snaps);
+        if (write_pgmap_snapshot(table, path, PGMAP_SNAP_VMAS) != 0)
+            fprintf(stderr,"Cannot write snapshot %s\n",path);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        fprintf(stderr,"capture %lu by \"%s\": %lu procs, scan %.1f ms, %s written in %.1f ms\n",
+                n, triggers[fired], table->size, ts_ms(&t1) - ts_ms(&t0), path,
+                ts_ms(&t2) - ts_ms(&t1));
+        n++;
+    }
+    for (int i = 0; i < n_triggers; i++)
+        close(fds[i].fd);
+    return release_table(table);
 }
 
 int main(int argc, char * argv[])
@@ -459,45 +2006,135 @@ int main(int argc, char * argv[])
     process_pagemap_t ** table_arr;
     process_pagemap_t * one_tab;
     int size;
+    int flags = 0;
+    pgmap_ksm_t ksm_total;
 
     parse_args(argc,argv);
 
-    if (!(table = init_pgmap_table(table))) {
+    if (diff_a) {
+        return print_diff(diff_a, diff_b);
+    }
+    if (r_arg) {
+        return print_snapshot(r_arg);
+    }
+    if (record_path || replay_path) {
+        io = replay_path ? open_pgmap_replay(replay_path) : open_pgmap_record(record_path);
+        if (!io) {
+            fprintf(stderr,"Cannot open recording %s\n",replay_path ? replay_path : record_path);
+            return 1;
+        }
+    }
+    if (n_triggers) {
+        return run_trigger();
+    }
+    if (daemon_arg) {
+        return run_daemon();
+    }
+    if (!(table = init_pgmap_table_io(table, io))) {
+        return 1;
+    }
+    if (apply_filter(table)) {
+        release_table(table);
         return 1;
     }
     if (!P_arg) {
         filter_pid = 0;
     }
+    if (I_arg && !n_arg) {
+        flags |= PAGEMAP_PFNS;
+    }
+    if (M_arg) {
+        flags |= PAGEMAP_RMAP;
+    }
+    if (v_arg) {
+        flags |= PAGEMAP_STATS;
+    }
+    if (batch_arg) {
+        flags |= PAGEMAP_BATCH;
+    }
+    if (x_arg) {
+        flags |= PAGEMAP_EXCL;
+    }
+    if (throttle_arg) {
+        flags |= PAGEMAP_STATS;
+        set_pgmap_throttle(table, &throttle);
+    }
+    set_pgmap_flags(table, flags);
+    if (m_arg) {
+        print_pages(table);
+        return release_table(table);
+    }
     if (!open_pgmap_table(table,filter_pid)) {
         return 1;
     }
+    if (M_arg) {
+        print_matrix(table);
+        free(matrix_pids);
+        return release_table(table);
+    }
     //get and sort data
     table_arr = get_all_pgmap(table,&size);
 
-    if (s_arg) {
-        sort_data(table_arr,size,sort_id);
+    if (f_arg) {
+        print_frag(table, table_arr, size);
+        free(table_arr);
+        return release_table(table);
     }
 
-    //print data
     hlist = complete_header();
     if (!hlist)
         return 1;
-    if (!d_arg && !P_arg)
+    if (!d_arg && !P_arg && out_format <= OUT_CSV)
         print_stats(table);
-    if (!P_arg) {
-        print_data(table_arr, size,hlist);
-    } else {
-        one_tab = get_single_pgmap(table,filter_pid);
-        if (one_tab)
-            if (!d_arg)
-                print_row(NULL,hlist);
-        print_row(one_tab,hlist);
+    do {
+        if (K_arg) {
+            if (get_ksm_pgmap(table,filter_pid,&ksm_total) != 0) {
+                fprintf(stderr,"KSM estimation is not available\n");
+                break;
+            }
+            if (!P_arg)
+                print_ksm(&ksm_total, table_arr, size);
+        }
+        if (I_arg && !n_arg) {
+            if (get_idle_pgmap(table,filter_pid,idle_interval) != 0) {
+                fprintf(stderr,"Idle page tracking is not available\n");
+                break;
+            }
+        }
+        if (D_arg) {
+            if (get_dirty_pgmap(table,filter_pid,dirty_interval) != 0) {
+                fprintf(stderr,"Soft-dirty tracking is not available\n");
+                break;
+            }
+        }
+        if (s_arg) {
+            sort_data(table_arr,size,sort_id);
+        }
+
+        //print data
+        if (!P_arg) {
+            print_data(table_arr, size,hlist);
+        } else {
+            one_tab = get_single_pgmap(table,filter_pid);
+            if (one_tab)
+                if (!d_arg)
+                    print_row(NULL,hlist);
+            print_row(one_tab,hlist);
+            out_flush();
+            if (V_arg && out_format <= OUT_CSV)
+                print_mappings(one_tab);
+        }
+    } while (--rounds > 0);
+
+    if (w_arg) {
+        if (write_pgmap_snapshot(table, w_arg, PGMAP_SNAP_VMAS |
+                    ((flags & PAGEMAP_PFNS) ? PGMAP_SNAP_PFNS : 0)) != 0)
+            fprintf(stderr,"Cannot write snapshot %s\n",w_arg);
     }
 
     //release sources
-    free_pgmap_table(table);
     free(table_arr);
     destroy_header(hlist);
 
-    return 0;
+    return release_table(table);
 }